@@ -0,0 +1,138 @@
+#include "adjustments.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Value of the curve at x, a smooth curve through (0, 0), (64, curve[0]), (128, curve[1]), (192, curve[2]) and (255, 255)
+// Uses monotone cubic interpolation, so the curve never overshoots and an increasing set of points gives an increasing curve
+static float curveValue(const int curve[3], float x) {
+    const int n = 5;
+    const float xs[n] = {0, 64, 128, 192, 255};
+    const float ys[n] = {0, (float)curve[0], (float)curve[1], (float)curve[2], 255};
+    
+    // Slope of each segment, and the tangent at each point
+    float slopes[n - 1], tangents[n];
+    for (int i = 0; i < n - 1; i++) slopes[i] = (ys[i + 1] - ys[i]) / (xs[i + 1] - xs[i]);
+    tangents[0] = slopes[0];
+    tangents[n - 1] = slopes[n - 2];
+    for (int i = 1; i < n - 1; i++) {
+        // Flat at peaks and valleys, otherwise the harmonic mean keeps the curve from overshooting
+        tangents[i] = slopes[i - 1] * slopes[i] <= 0 ? 0 : 2 / (1 / slopes[i - 1] + 1 / slopes[i]);
+    }
+    
+    // Cubic Hermite interpolation on the segment x is in
+    int i = std::min((int)(x / 64), n - 2);
+    float width = xs[i + 1] - xs[i];
+    float t = (x - xs[i]) / width, t2 = t * t, t3 = t2 * t;
+    return (2 * t3 - 3 * t2 + 1) * ys[i] + (t3 - 2 * t2 + t) * width * tangents[i]
+         + (-2 * t3 + 3 * t2) * ys[i + 1] + (t3 - t2) * width * tangents[i + 1];
+}
+
+// Work out the lookup table and color matrix
+ColorAdjustment::ColorAdjustment(const AdjustmentSettings& settings) {
+    // Levels, curves and invert are applied one after another to every possible value of a channel
+    for (int v = 0; v < 256; v++) {
+        float range = std::max(settings.input_white - settings.input_black, 1);
+        float x = std::clamp((v - settings.input_black) / range, 0.0f, 1.0f);
+        x = std::pow(x, 1 / std::max(settings.gamma, 0.01f));
+        x = settings.output_black + x * (settings.output_white - settings.output_black);
+        
+        x = curveValue(settings.curve, x);
+        
+        if (settings.invert) x = 255 - x;
+        table[v] = std::clamp((int)std::lround(x), 0, 255);
+    }
+    
+    // Hue rotation around the gray axis, weighted by how bright each channel looks so lightness doesn't change
+    float angle = settings.hue * (float)M_PI / 180;
+    float c = std::cos(angle), s = std::sin(angle);
+    float hue[9] = {
+        0.213f + c * 0.787f - s * 0.213f, 0.715f - c * 0.715f - s * 0.715f, 0.072f - c * 0.072f + s * 0.928f,
+        0.213f - c * 0.213f + s * 0.143f, 0.715f + c * 0.285f + s * 0.140f, 0.072f - c * 0.072f - s * 0.283f,
+        0.213f - c * 0.213f - s * 0.787f, 0.715f - c * 0.715f + s * 0.715f, 0.072f + c * 0.928f + s * 0.072f
+    };
+    
+    // Saturation moves every color towards or away from the gray with the same brightness
+    float k = 1 + settings.saturation / 100;
+    float saturation[9] = {
+        0.213f + 0.787f * k, 0.715f - 0.715f * k, 0.072f - 0.072f * k,
+        0.213f - 0.213f * k, 0.715f + 0.285f * k, 0.072f - 0.072f * k,
+        0.213f - 0.213f * k, 0.715f - 0.715f * k, 0.072f + 0.928f * k
+    };
+    
+    // Both in one matrix, hue first
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            matrix[row * 3 + col] = 0;
+            for (int i = 0; i < 3; i++) matrix[row * 3 + col] += saturation[row * 3 + i] * hue[i * 3 + col];
+        }
+    }
+    use_matrix = settings.hue != 0 || settings.saturation != 0;
+}
+
+// Adjust premultiplied RGBA8888 pixels in place
+void ColorAdjustment::apply(Uint32* pixels, int count) const {
+    // 255 / alpha for every alpha, so unpremultiplying is a multiply instead of a divide
+    static const struct Reciprocals {
+        float values[256];
+        Reciprocals() {
+            values[0] = 0;
+            for (int a = 1; a < 256; a++) values[a] = 255.0f / a;
+        }
+    } reciprocals;
+    
+    // Rounded x * a / 255
+    auto mul = [](int x, int a) { x = x * a + 128; return (x + (x >> 8)) >> 8; };
+
+#ifdef __SSE2__
+    // Columns of the matrix, with lanes in the same order as the channels of a widened pixel (alpha, blue, green, red)
+    const __m128 col_r = _mm_set_ps(matrix[0], matrix[3], matrix[6], 0);
+    const __m128 col_g = _mm_set_ps(matrix[1], matrix[4], matrix[7], 0);
+    const __m128 col_b = _mm_set_ps(matrix[2], matrix[5], matrix[8], 0);
+    const __m128 zero_ps = _mm_setzero_ps(), max_ps = _mm_set1_ps(255);
+    const __m128i zero = _mm_setzero_si128();
+#endif
+
+    for (int i = 0; i < count; i++) {
+        Uint32 pixel = pixels[i];
+        int a = pixel & 0xFF;
+        
+        // Transparent pixels stay transparent
+        if (a == 0) continue;
+        
+        int rgb[3];
+#ifdef __SSE2__
+        // Widen to one float per channel and unpremultiply all of them at once
+        __m128i wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+        __m128 v = _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(reciprocals.values[a]));
+        
+        if (use_matrix) {
+            // Each output channel is a mix of all three input channels
+            __m128 r = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+            __m128 g = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2));
+            __m128 b = _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1));
+            v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, col_r), _mm_mul_ps(g, col_g)), _mm_mul_ps(b, col_b));
+        }
+        
+        // Round to whole values that can be looked up in the table
+        alignas(16) int lanes[4];
+        _mm_store_si128((__m128i*)lanes, _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(v, zero_ps), max_ps)));
+        rgb[0] = lanes[3], rgb[1] = lanes[2], rgb[2] = lanes[1];
+#else
+        // Scalar version, unpremultiply then mix the channels
+        float in[3];
+        for (int c = 0; c < 3; c++) in[c] = ((pixel >> (24 - c * 8)) & 0xFF) * reciprocals.values[a];
+        for (int c = 0; c < 3; c++) {
+            float x = use_matrix ? matrix[c * 3] * in[0] + matrix[c * 3 + 1] * in[1] + matrix[c * 3 + 2] * in[2] : in[c];
+            rgb[c] = std::clamp((int)std::lrintf(x), 0, 255);
+        }
+#endif
+
+        // Levels, curves and invert in one lookup, then premultiply again
+        pixels[i] = ((Uint32)mul(table[rgb[0]], a) << 24) | ((Uint32)mul(table[rgb[1]], a) << 16) | ((Uint32)mul(table[rgb[2]], a) << 8) | a;
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <SDL3/SDL.h>
+
+// Settings of every color adjustment
+// They're always applied in the order they're listed here, all in a single pass over the pixels
+struct AdjustmentSettings {
+    // Hue/saturation
+    float hue = 0;              // Degrees to rotate the hue by, between -180 and 180
+    float saturation = 0;       // Percent to change the saturation by, -100 is gray and 100 is twice as saturated
+    
+    // Levels, input_black and input_white become output_black and output_white, with gamma bending the values in between
+    int input_black = 0;
+    int input_white = 255;
+    float gamma = 1;
+    int output_black = 0;
+    int output_white = 255;
+    
+    // Curves, the output for an input of 64, 128 and 192, while 0 and 255 stay where they are
+    int curve[3] = {64, 128, 192};
+    
+    // Flip every color channel
+    bool invert = false;
+};
+
+// Color adjustments worked out into a lookup table and a color matrix, ready to be run on pixels
+// Levels, curves and invert are all per channel, so they're combined into a single table with 256 entries.
+// Hue and saturation mix the channels together, so they're a 3x3 matrix that runs before the table.
+class ColorAdjustment {
+public:
+    // Default constructor, an adjustment that doesn't change anything
+    ColorAdjustment() : ColorAdjustment(AdjustmentSettings{}) {}
+    
+    ColorAdjustment(const AdjustmentSettings& settings);
+    
+    // Adjust premultiplied RGBA8888 pixels in place, alpha stays the same
+    void apply(Uint32* pixels, int count) const;
+
+private:
+    Uint8 table[256];
+    float matrix[9];
+    bool use_matrix;    // Is the matrix anything other than the identity?
+};
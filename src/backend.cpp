@@ -1,124 +1,407 @@
 #include "backend.hpp"
 #include "texture.hpp"
 #include "utils.hpp"
+#include "image.hpp"
+#include "profiler.hpp"
+#include "pool.hpp"
+#include "shapes.hpp"
+#include "filters.hpp"
+#include "adjustments.hpp"
+#include "journal.hpp"
+#include "clipboard.hpp"
+
+#include <embedded_icons.hpp>
 
 #include <string>
+#include <memory>
+#include <filesystem>
 #include <stdexcept>
 #include <cmath>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <exception>
+#include <tuple>
+#include <iostream>
 
 // When the canvas is created, resized, or loaded from an image, we should update the default
 // "File->New" and "Image->Resize" options to the new canvas size just for QOL so the new resolution
 // doesn't need to be retyped every time
 void updateCanvasOptionValues(State* state) {
-    state->file_action_info.new_info.size = state->canvas.size();
-    state->image_action_info.resize_info.size = state->canvas.size();
+    state->file_action_info.new_info.size = state->doc().canvas.size();
+    state->image_action_info.resize_info.size = state->doc().canvas.size();
+    state->image_action_info.canvas_size_info.size = state->doc().canvas.size();
 }
 
-// Set the canvas to a new blank white texture with given size, deleting the old texture if a canvas already exists
-void recreateCanvas(State* state, ImVec2 size) {
-    // Create new texture with target access mode so it can be rendered to
-    // Implicitly deletes the old canvas when the existing state->canvas object goes out of scope
-    state->canvas = Texture(state->gui_resource->renderer, SDL_TEXTUREACCESS_TARGET, size.x, size.y);
+// Create the canvas texture with the same size as the layers, deleting the old texture if a canvas already exists
+// The texture only holds a copy of the composited layers, which is uploaded by updateCanvasTexture
+void createCanvasTexture(State* state) {
+    // Create new texture with streaming access mode so changed areas can be uploaded quickly
+    // The old canvas goes back to the pool when the existing state->doc().canvas object goes out of scope,
+    // so opening or creating images of the same size reuses it instead of creating a new texture
+    state->doc().canvas = Texture::fromPool(state->gui_resource->renderer, SDL_TEXTUREACCESS_STREAMING, state->doc().layers.width(), state->doc().layers.height(), MemoryCategory::Canvas);
     
     // Set scaling mode to nearest so pixels don't get blurry when you zoom in
-    SDL_SetTextureScaleMode(state->canvas.get(), SDL_SCALEMODE_NEAREST);
+    SDL_SetTextureScaleMode(state->doc().canvas.get(), SDL_SCALEMODE_NEAREST);
     
-    // Fill it with solid white
-    state->canvas.fill({1.0f, 1.0f, 1.0f, 1.0f});
+    // The composite has premultiplied alpha
+    SDL_SetTextureBlendMode(state->doc().canvas.get(), SDL_BLENDMODE_BLEND_PREMULTIPLIED);
     
     // Update the default values with new canvas size
     updateCanvasOptionValues(state);
 }
 
+// Create the canvas texture again after the size or content of the layers changed
+void recreateCanvasTexture(State* state) {
+    createCanvasTexture(state);
+    
+    // The old selection doesn't match the new canvas size, so start with nothing selected
+    state->doc().selection = Selection(state->doc().layers.width(), state->doc().layers.height());
+    state->doc().selection_outline.clear();
+}
+
+// Recomposite any area of the layers that changed and upload it to the canvas texture
+void updateCanvasTexture(State* state) {
+    PROFILE_SCOPE("updateCanvasTexture");
+    
+    // The brush stroke being painted also counts as a change
+    state->doc().layers.markDirty(state->brush_stroke.takeDirty());
+    
+    // A paste that hasn't been committed yet floats above the active layer
+    SDL_Rect changed = state->doc().layers.recomposite(&state->brush_stroke, &state->paste);
+    
+    // The filter preview is a copy of the active layer, which may be what changed
+    if (changed.w > 0) state->filter_preview_dirty = true;
+    
+    // While the adjustments window is open, the adjustments are previewed on the active layer
+    // The previewed pixels are composited separately and only uploaded, so the cached composite stays unadjusted
+    if (state->adjust_previewing) {
+        SDL_Rect area = unionRect(changed, state->adjust_preview_redraw);
+        state->adjust_preview_redraw = {0, 0, 0, 0};
+        if (area.w == 0) return;
+        
+        PooledBuffer pixels((size_t)area.w * area.h * sizeof(Uint32));
+        int pitch = area.w * sizeof(Uint32);
+        state->doc().layers.compositeRect(area, pixels.pixels(), pitch, &state->brush_stroke, &state->adjust_preview, &state->paste);
+        state->doc().canvas.update(&area, pixels.data(), pitch);
+        return;
+    }
+    
+    // Nothing to upload if nothing changed
+    if (changed.w == 0) return;
+    
+    // Upload only the changed area, rows of the composite have no padding
+    int pitch = state->doc().layers.width() * sizeof(Uint32);
+    state->doc().canvas.update(&changed, getPixel((void*)state->doc().layers.composite(), pitch, changed.x, changed.y), pitch);
+}
+
+// Reset the canvas to a single blank white layer with given size
+void recreateCanvas(State* state, ImVec2 size) {
+    // Fill it with solid white
+    state->doc().layers.reset(size.x, size.y, vecToUint32(SDL_PIXELFORMAT_RGBA8888, {255, 255, 255, 255}));
+    
+    recreateCanvasTexture(state);
+}
+
 // Resize the canvas to the given size without erasing content
 void resizeCanvas(State* state, ImVec2 size) {
-    // Create a new blank texture with the desired canvas size
-    Texture new_canvas(state->gui_resource->renderer, SDL_TEXTUREACCESS_TARGET, size.x, size.y);
+    // Stretch and scale every layer to fit
+    state->doc().layers.scale(size.x, size.y);
     
-    // Set scaling mode to nearest so pixels don't get blurry when you zoom in
-    SDL_SetTextureScaleMode(new_canvas.get(), SDL_SCALEMODE_NEAREST);
+    recreateCanvasTexture(state);
+}
+
+// Crop or extend the canvas to the given size without scaling the content
+// The anchor decides which part of the old canvas stays fixed, and any new area is filled with fill_color
+void resizeCanvasKeepContent(State* state, ImVec2 size, ImVec2 anchor, ImVec4 fill_color) {
+    ImVec2 old_size = state->doc().canvas.size();
     
-    // Render existing canvas to the new texture - SDL will stretch and scale it to fit
-    state->canvas.renderTo(new_canvas, nullptr, nullptr);
+    // Nothing to do if the size didn't change, so don't touch any pixels
+    if (old_size.x == size.x && old_size.y == size.y) return;
     
-    // Assign new texture as the canvas - implictly deletes old canvas
-    state->canvas = new_canvas;
+    // Position of the old canvas' top-left corner inside the new canvas
+    // Rounded down so the content always lands on whole pixels
+    int offset_x = std::floor((size.x - old_size.x) * anchor.x);
+    int offset_y = std::floor((size.y - old_size.y) * anchor.y);
     
-    // Update the default values with new canvas size
-    updateCanvasOptionValues(state);
+    // Only the overlapping area is copied, and when the offset lines up with the tile grid (e.g. the
+    // top-left anchor) whole tiles are moved over without copying any pixels at all
+    // New area is filled on the bottom layer and left transparent on the others
+    Uint32 fill = premultiply(vecToUint32(SDL_PIXELFORMAT_RGBA8888, scaleVec(fill_color, 255)));
+    state->doc().layers.place(size.x, size.y, offset_x, offset_y, fill);
+    
+    recreateCanvasTexture(state);
 }
 
-// The brush texture is a texture that is stamped on the canvas during a draw event
-// SDL doesn't have a renderCicle function, so creating our own circle ourselves enables
-// a brush size bigger than just a single pixel
-// However, the texture needs to be updated any time the brush size or color changes
-void recreateBrushTexture(State* state, int radius, ImVec4 color) {
+// The brush preview is a circle outline drawn around the cursor when hovering over the canvas
+// SDL doesn't have a renderCicle function, so we draw the circle ourselves
+// The preview textures are white and kept in a cache keyed by shape, so the color is applied with color
+// modulation and only a change in size, hardness or anti-aliasing can ever need a new texture
+void updateBrushTexture(State* state) {
+    PROFILE_SCOPE("updateBrushTexture");
+    
+    // Brush size is the width of the brush, so the radius is size/2
     // Make sure radius is at least 1
-    radius = (radius == 0 ? 1 : radius);
+    int radius = std::max(state->brush_size / 2, 1);
+    
+    // Fetch the stamp from the cache, only generated if this shape hasn't been used recently
+    const BrushStamp& stamp = state->brush_cache.get(state->gui_resource->renderer, {radius, state->brush_hardness, state->brush_anti_alias});
+    // Only a view is kept, the texture belongs to the cache. Strokes look up masks in the same cache, but the stamp
+    // from get() is pinned there until the next call to this function replaces the view
+    state->brush_texture_preview = stamp.preview.view();
+    
+    // Tint the preview with the draw color
+    ImVec4 color = state->draw_color;
+    SDL_SetTextureColorModFloat(state->brush_texture_preview.get(), color.x, color.y, color.z);
+}
+
+// Create a texture from an icon that was baked into the program at build time
+// The pixels are already RGBA8888, so it's uploaded as-is in one update with no decoding or conversion
+static Texture iconTexture(State* state, const EmbeddedIcon& icon) {
+    Texture texture(state->gui_resource->renderer, SDL_TEXTUREACCESS_STATIC, icon.w, icon.h, MemoryCategory::Icons);
+    texture.update(nullptr, icon.pixels, icon.w * sizeof(Uint32));
+    SDL_SetTextureBlendMode(texture.get(), SDL_BLENDMODE_BLEND);
+    return texture;
+}
+
+// Start a new autosave journal for a document
+// Autosave isn't needed to keep drawing, so if it can't be started the error is only printed
+void startAutosave(State* state, Document& document) {
+    try {
+        document.journal.start();
+        state->last_autosave = SDL_GetTicks();
+    } catch (const std::exception& e) {
+        std::cout << e.what() << std::endl << "Autosave has been turned off for " << document.name << std::endl;
+    }
+}
+
+// Merge the floating paste into the active layer, if there is one
+// Anything that changes or reads the layers other than drawing commits it first, so it's never left floating over the wrong layer
+void commitPaste(State* state) {
+    if (!state->paste.active()) return;
+    
+    PROFILE_SCOPE("commitPaste");
+    
+    Layer& layer = state->doc().layers.activeLayer();
+    layer.forgetStrokes();
+    state->doc().layers.markDirty(state->paste.commit(layer.image));
+    state->dragging_paste = false;
+}
+
+// Put the active document away so another one can be viewed
+// Its journal gets everything that changed first, then its tiles are compressed and its canvas texture goes back to the
+// pool, where the next document of the same size picks it up again
+void packDocument(State* state) {
+    PROFILE_SCOPE("packDocument");
+    
+    commitPaste(state);
+    
+    Document& document = state->doc();
+    try {
+        if (document.journal.running()) document.journal.flush(document.layers);
+    } catch (const std::exception& e) {
+        std::cout << e.what() << std::endl << "Autosave has been turned off for " << document.name << std::endl;
+        document.journal.stop(false);
+    }
     
-    // Create new blank surface with twice the radius, just big enough to draw circle to
-    SDL_Surface* surface = SDL_CreateSurface(radius*2, radius*2, SDL_PIXELFORMAT_RGBA8888);
+    document.layers.pack();
+    document.canvas = Texture();
+}
+
+// Start viewing the active document, unpacking it if it was put away
+void viewDocument(State* state) {
+    PROFILE_SCOPE("viewDocument");
+    
+    // Unpacking marks everything dirty, so the whole composite is uploaded to the new texture next frame
+    // A document that was just created already has its texture
+    if (state->doc().canvas.get() == nullptr) {
+        state->doc().layers.unpack();
+        createCanvasTexture(state);
+    }
+    
+    // Anything half drawn belonged to the old document
+    state->drawing_line = false;
+    state->drawing_shape = false;
+    state->polygon_points.clear();
+    state->selecting = false;
+    state->lasso_points.clear();
+    
+    // Previews are of the active layer, which is a different one now
+    state->adjust_previewing = false;
+    state->adjust_preview_dirty = true;
+    state->adjust_preview_redraw = {0, 0, 0, 0};
+    state->filter_preview_dirty = true;
+    
+    // Make the tab bar show the document, in case it wasn't switched to by clicking its tab
+    state->select_tab = true;
+}
+
+// Switch to another open document
+void switchDocument(State* state, int index) {
+    if (index == state->active_document) return;
+    
+    packDocument(state);
+    state->active_document = index;
+    viewDocument(state);
+}
+
+// Open a new document with a single blank white layer in a new tab and switch to it
+// Autosave is held back while the recover window is open, so a new journal can't be mistaken for one that's left over
+Document& addDocument(State* state, const std::string& name, ImVec2 size) {
+    if (!state->documents.empty()) packDocument(state);
+    
+    auto document = std::make_unique<Document>();
+    document->name = name;
+    document->id = ++state->documents_created;
+    state->documents.push_back(std::move(document));
+    state->active_document = state->documents.size() - 1;
     
-    // Call util function to draw the outline of a circle
-    drawCircle(surface, radius, color);
+    recreateCanvas(state, size);
+    viewDocument(state);
     
-    // The preview texture (when hovering over the canvas) should just be the circle outline,
-    // but the brush texture itself needs to be solid in order to fill a solid circle when stamping
-    // it to the canvas
-    // The current surface just has the outline of the circle which is what the preview needs to be,
-    // so create a texture from the surface and set scale mode to nearest so it doesn't get blurry when zooming in
-    state->brush_texture_preview = Texture(state->gui_resource->renderer, surface);
-    SDL_SetTextureScaleMode(state->brush_texture_preview.get(), SDL_SCALEMODE_NEAREST);
+    if (!state->show_recover_window) startAutosave(state, state->doc());
+    return state->doc();
+}
+
+// Close an open document, deleting its journal
+// There's always at least one document open, so closing the last one opens a blank one in its place
+void closeDocument(State* state, int index) {
+    PROFILE_SCOPE("closeDocument");
     
-    // Now we can fill in the texture by performing a flood fill with the draw color, starting at
-    // the center of the circle
-    floodFill(surface, {surface->w/2.0f, surface->h/2.0f}, state->draw_color);
+    bool was_active = index == state->active_document;
+    state->documents[index]->journal.stop(true);
     
-    // Update brush texture with new filled-in surface
-    state->brush_texture = Texture(state->gui_resource->renderer, surface);
+    // A floating paste belongs to the active document, so it goes along with it rather than landing on the next one
+    if (was_active) {
+        state->paste.discard();
+        state->dragging_paste = false;
+    }
     
-    // Destroy temporary surface
-    SDL_DestroySurface(surface);
+    if (state->documents.size() == 1) {
+        state->documents.clear();
+        addDocument(state, "Untitled " + std::to_string(state->documents_created + 1), state->initial_canvas_size);
+        return;
+    }
+    
+    state->documents.erase(state->documents.begin() + index);
+    if (index < state->active_document || state->active_document == (int)state->documents.size()) state->active_document--;
+    
+    // The document next to the closed one is unpacked to be viewed
+    if (was_active) viewDocument(state);
 }
 
 // Initializes the state and creates some required objects e.g. canvas and icon textures
 void backendInit(State* state) {
-    // Temporary surface for loading icon textures
-    SDL_Surface* temp_surface;
+    // Tool icons, embedded by the build so nothing is read from disk
+    state->icons.brush = iconTexture(state, icon_brush);
+    state->icons.line = iconTexture(state, icon_line);
+    state->icons.rectangle = iconTexture(state, icon_rectangle);
+    state->icons.ellipse = iconTexture(state, icon_ellipse);
+    state->icons.polygon = iconTexture(state, icon_polygon);
+    state->icons.fill = iconTexture(state, icon_bucket);
+    state->icons.eyedropper = iconTexture(state, icon_eyedropper);
+    state->icons.rect_select = iconTexture(state, icon_select_rect);
+    state->icons.lasso = iconTexture(state, icon_lasso);
+    state->icons.magic_wand = iconTexture(state, icon_wand);
 
-    // Load brush, line, and bucket icons
-    temp_surface = openImage("icons/brush.png");
-    state->icons.brush = Texture(state->gui_resource->renderer, temp_surface);
+    // Create initial brush texture
+    updateBrushTexture(state);
+    
+    // Journals left behind mean the last session crashed, so ask before starting any new ones
+    try {
+        state->recover_paths = Journal::leftOver();
+    } catch (const std::exception& e) {
+        std::cout << e.what() << std::endl;
+    }
+    state->show_recover_window = !state->recover_paths.empty();
     
-    temp_surface = openImage("icons/line.png");
-    state->icons.line = Texture(state->gui_resource->renderer, temp_surface);
+    // Create initial blank canvas
+    state->startup_document = addDocument(state, "Untitled 1", state->initial_canvas_size).id;
+}
+
+// Selection that drawing tools are limited to, or nullptr if nothing is selected and the whole canvas can be drawn on
+const Selection* selectionMask(State* state) {
+    return state->doc().selection.empty() ? nullptr : &state->doc().selection;
+}
+
+// Replace the selection, combining it with the old one based on the selection mode
+void applySelection(State* state, const Selection& selection) {
+    switch (state->selection_mode) {
+        case SelectionMode::Replace:
+            state->doc().selection = selection;
+            break;
+        case SelectionMode::Add:
+            state->doc().selection = selectionUnion(state->doc().selection, selection);
+            break;
+        case SelectionMode::Subtract:
+            state->doc().selection = selectionSubtract(state->doc().selection, selection);
+            break;
+        case SelectionMode::Intersect:
+            state->doc().selection = selectionIntersect(state->doc().selection, selection);
+            break;
+    }
     
-    temp_surface = openImage("icons/bucket.png");
-    state->icons.fill = Texture(state->gui_resource->renderer, temp_surface);
+    // Outline only needs to be worked out again when the selection changes
+    state->doc().selection_outline = selectionOutline(state->doc().selection);
+}
+
+// Gather the current brush settings into the settings used by the brush engine
+StrokeSettings currentStrokeSettings(State* state) {
+    StrokeSettings settings;
     
-    // Create initial brush texture
     // Brush size is the width of the brush, so the radius is size/2
-    recreateBrushTexture(state, state->brush_size / 2, state->draw_color);
+    settings.shape = {std::max(state->brush_size / 2, 1), state->brush_hardness, state->brush_anti_alias};
+    settings.color = state->draw_color;
     
-    // Create initial blank canvas
-    recreateCanvas(state, state->initial_canvas_size);
+    // Sliders are in percent
+    settings.opacity = state->brush_opacity / 100.0f;
+    settings.flow = state->brush_flow / 100.0f;
+    settings.spacing = state->brush_spacing / 100.0f;
+    
+    settings.pressure_size = state->pressure_size;
+    settings.pressure_flow = state->pressure_flow;
+    
+    // Strokes can only paint inside the selection
+    settings.mask = selectionMask(state);
+    return settings;
+}
+
+// Pressure to paint with - comes from the pen if it's touching the tablet, otherwise the mouse always paints at full pressure
+float currentPressure(State* state) {
+    return state->pen_info.down ? state->pen_info.pressure : 1.0f;
 }
 
 // Process drawing with the brush tool
 void handleDrawBrush(State* state) {
-    // Return early if mouse is not held down
-    if (!state->lmb_info.down) return;
+    PROFILE_SCOPE("handleDrawBrush");
     
-    // Return early if the mouse is not over the canvas
-    if (state->gui_wants_mouse) return;
-
-    // If the user moves the mouse quickly, there might be large gaps between the reported mouse position
-    // So, we need to draw a solid line between the last position and the current position to make the drawing continuous
-    state->canvas.stampTextureAlongLine(state->brush_texture, state->mouse_pos_old.canvas, state->mouse_pos.canvas);
+    // Alias
+    BrushStroke& stroke = state->brush_stroke;
+    
+    // Start a new stroke if the user just clicked on the canvas
+    if (state->lmb_info.down && !state->lmb_info_old.down && !state->gui_wants_mouse) {
+        stroke.begin(state->brush_cache, state->doc().layers.width(), state->doc().layers.height(),
+            currentStrokeSettings(state), state->mouse_pos.canvas, currentPressure(state));
+    }
+    
+    // Return early if no stroke is being painted
+    if (!stroke.active()) return;
+    
+    if (state->lmb_info.down) {
+        // If the user moves the mouse quickly, there might be large gaps between the reported mouse position
+        // The stroke places dabs along the whole path since the last position so the drawing stays continuous
+        stroke.moveTo(state->brush_cache, state->mouse_pos.canvas, currentPressure(state));
+    } else {
+        // The user let go of the mouse, so merge the stroke into the active layer and keep its path
+        state->doc().layers.markDirty(stroke.commit(state->doc().layers.activeLayer().image));
+        state->doc().layers.recordStroke(stroke);
+    }
 }
 
 // Process drawing with the line tool
 void handleDrawLine(State* state){
+    PROFILE_SCOPE("handleDrawLine");
+    
     // Return early if the mouse is not over the canvas
     if (state->gui_wants_mouse) return;
     
@@ -136,14 +419,95 @@ void handleDrawLine(State* state){
     
     // If the user just let go of the mouse and we're currently drawing a line
     if (!state->lmb_info.down && state->lmb_info_old.down && state->drawing_line) {
-        // Draw line from start to end position
-        state->canvas.stampTextureAlongLine(state->brush_texture, state->draw_line_start.canvas, state->draw_line_end.canvas);
+        // Draw line from start to end position as a single stroke at full pressure
+        BrushStroke& stroke = state->brush_stroke;
+        stroke.begin(state->brush_cache, state->doc().layers.width(), state->doc().layers.height(),
+            currentStrokeSettings(state), state->draw_line_start.canvas, 1.0f);
+        stroke.moveTo(state->brush_cache, state->draw_line_end.canvas, 1.0f);
+        state->doc().layers.markDirty(stroke.commit(state->doc().layers.activeLayer().image));
+        state->doc().layers.recordStroke(stroke);
+        
         state->drawing_line = false;
     }
 }
 
+// Paint the area of a shape onto the active layer with the draw color and brush opacity
+void paintShape(State* state, Selection area) {
+    // Shapes can only be painted inside the selection
+    if (const Selection* mask = selectionMask(state)) area = selectionIntersect(area, *mask);
+    
+    ImVec4 color = {state->draw_color.x, state->draw_color.y, state->draw_color.z, state->brush_opacity / 100.0f};
+    Uint32 premultiplied = premultiply(vecToUint32(SDL_PIXELFORMAT_RGBA8888, scaleVec(color, 255)));
+    
+    Layer& layer = state->doc().layers.activeLayer();
+    layer.forgetStrokes();
+    state->doc().layers.markDirty(paintArea(layer.image, area, premultiplied));
+}
+
+// Process drawing with the rectangle and ellipse tools
+void handleDrawShape(State* state) {
+    PROFILE_SCOPE("handleDrawShape");
+    
+    // Return early if the mouse is not over the canvas
+    if (state->gui_wants_mouse) return;
+    
+    // If the user just started dragging the mouse, track the corner the shape starts at
+    if (state->lmb_info.down && !state->lmb_info_old.down) {
+        state->shape_start = state->mouse_pos;
+        state->drawing_shape = true;
+    }
+    
+    // If the user just let go of the mouse, paint the shape between the two corners
+    if (!state->lmb_info.down && state->lmb_info_old.down && state->drawing_shape) {
+        int w = state->doc().layers.width(), h = state->doc().layers.height();
+        ImVec2 a = state->shape_start.canvas, b = state->mouse_pos.canvas;
+        
+        if (state->drawing_tool == DrawingTool::Rectangle) {
+            paintShape(state, rectangleShape(w, h, a, b, state->shape_filled, state->brush_size));
+        } else {
+            paintShape(state, ellipseShape(w, h, a, b, state->shape_filled, state->brush_size));
+        }
+        
+        state->drawing_shape = false;
+    }
+}
+
+// Process drawing with the polygon tool
+// Every click places a corner, and clicking the first corner again or right clicking closes the polygon
+void handleDrawPolygon(State* state) {
+    PROFILE_SCOPE("handleDrawPolygon");
+    
+    // Return early if the mouse is not over the canvas
+    if (state->gui_wants_mouse) return;
+    
+    // Alias
+    std::vector<ImVec2>& points = state->polygon_points;
+    
+    bool close = false;
+    if (state->lmb_info.down && !state->lmb_info_old.down) {
+        // Close the polygon if the click is within a few pixels on screen of the first corner
+        ImVec2 first = points.empty() ? ImVec2{0, 0} : canvasToScreenPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, points[0]);
+        float dx = state->mouse_pos.screen.x - first.x, dy = state->mouse_pos.screen.y - first.y;
+        
+        if (points.size() >= 3 && dx * dx + dy * dy <= 8 * 8) close = true;
+        else points.push_back(state->mouse_pos.canvas);
+    }
+    if (state->rmb_info.down && !state->rmb_info_old.down) {
+        // Right clicking before there are enough corners gives up on the polygon
+        if (points.size() >= 3) close = true;
+        else points.clear();
+    }
+    
+    if (close) {
+        paintShape(state, polygonShape(state->doc().layers.width(), state->doc().layers.height(), points, state->shape_filled, state->brush_size));
+        points.clear();
+    }
+}
+
 // Process drawing with the fill tool
 void handleDrawFill(State* state) {
+    PROFILE_SCOPE("handleDrawFill");
+    
     // Return early if the mouse is over GUI elements
     if (state->gui_wants_mouse) return;
     
@@ -151,33 +515,188 @@ void handleDrawFill(State* state) {
     if (!state->lmb_info.down || state->lmb_info_old.down) return;
     
     // Make sure mouse cursor is over the canvas
-    if (state->mouse_pos.canvas.x < 0 || state->mouse_pos.canvas.x > state->canvas.width() ||
-        state->mouse_pos.canvas.y < 0 || state->mouse_pos.canvas.y > state->canvas.height()) return;
+    if (state->mouse_pos.canvas.x < 0 || state->mouse_pos.canvas.x >= state->doc().layers.width() ||
+        state->mouse_pos.canvas.y < 0 || state->mouse_pos.canvas.y >= state->doc().layers.height()) return;
+    
+    // Alias
+    TiledImage& image = state->doc().layers.activeLayer().image;
+    int pitch = image.width() * sizeof(Uint32);
+    
+    // Copy the active layer into a flat array and wrap it in a surface so the fill region can be found
+    PooledBuffer pixels(image.height() * pitch);
+    image.readRect({0, 0, image.width(), image.height()}, pixels.pixels(), pitch);
+    SDL_Surface* layer_surface = SDL_CreateSurfaceFrom(image.width(), image.height(), SDL_PIXELFORMAT_RGBA8888, pixels.data(), pitch);
+    
+    // Area to fill, only inside the selection if there is one
+    Selection region = floodSelection(layer_surface, state->mouse_pos.canvas);
+    if (const Selection* mask = selectionMask(state)) region = selectionIntersect(region, *mask);
+    
+    // Clean up surface, this doesn't free the pixels since they belong to the array
+    SDL_DestroySurface(layer_surface);
+    
+    // The draw color is always opaque, so it's the same with or without premultiplied alpha
+    Uint32 draw_color = vecToUint32(SDL_PIXELFORMAT_RGBA8888, scaleVec(state->draw_color, 255));
+    
+    // Fill a whole span at a time
+    for (int y = 0; y < region.height(); y++) {
+        for (const Span& span : region.row(y)) {
+            std::fill(&pixels.pixels()[y * image.width() + span.start], &pixels.pixels()[y * image.width() + span.end], draw_color);
+        }
+    }
+    
+    // Copy the filled area back into the layer, this doesn't allocate tiles that are still transparent
+    SDL_Rect changed = region.bounds();
+    state->doc().layers.activeLayer().forgetStrokes();
+    image.writeRect(changed, getPixel(pixels.data(), pitch, changed.x, changed.y), pitch);
+    state->doc().layers.markDirty(changed);
+}
 
-    // Create a surface from the canvas texture so we can modify its pixels directly
-    state->canvas.setRenderTarget();
-    SDL_Surface* canvas_surface = SDL_RenderReadPixels(state->gui_resource->renderer, NULL);
+// Process selecting with the rectangle select tool
+void handleDrawRectSelect(State* state) {
+    PROFILE_SCOPE("handleDrawRectSelect");
+    
+    // Start dragging out a rectangle if the user just clicked on the canvas
+    if (state->lmb_info.down && !state->lmb_info_old.down && !state->gui_wants_mouse) {
+        state->select_start = state->mouse_pos;
+        state->selecting = true;
+    }
+    
+    // If the user just let go of the mouse and we're currently dragging a rectangle
+    if (!state->lmb_info.down && state->lmb_info_old.down && state->selecting) {
+        state->selecting = false;
+        
+        // Corners of the rectangle rounded to the nearest pixel edge, in any order
+        ImVec2 a = state->select_start.canvas;
+        ImVec2 b = state->mouse_pos.canvas;
+        int x1 = std::round(std::min(a.x, b.x)), x2 = std::round(std::max(a.x, b.x));
+        int y1 = std::round(std::min(a.y, b.y)), y2 = std::round(std::max(a.y, b.y));
+        
+        applySelection(state, rectSelection(state->doc().layers.width(), state->doc().layers.height(), {x1, y1, x2 - x1, y2 - y1}));
+    }
+}
+
+// Process selecting with the lasso tool
+void handleDrawLasso(State* state) {
+    PROFILE_SCOPE("handleDrawLasso");
+    
+    // Start a new lasso if the user just clicked on the canvas
+    if (state->lmb_info.down && !state->lmb_info_old.down && !state->gui_wants_mouse) {
+        state->lasso_points.clear();
+        state->lasso_points.push_back(state->mouse_pos.canvas);
+        state->selecting = true;
+    }
+    
+    // Return early if no lasso is being drawn
+    if (!state->selecting) return;
+    
+    if (state->lmb_info.down) {
+        // Add a point whenever the mouse moves
+        ImVec2 last = state->lasso_points.back();
+        if (last.x != state->mouse_pos.canvas.x || last.y != state->mouse_pos.canvas.y) {
+            state->lasso_points.push_back(state->mouse_pos.canvas);
+        }
+    } else {
+        // The user let go of the mouse, so close the lasso and select everything inside it
+        state->selecting = false;
+        applySelection(state, polygonSelection(state->doc().layers.width(), state->doc().layers.height(), state->lasso_points));
+        state->lasso_points.clear();
+    }
+}
 
-    // Fill the surface with the draw color at the mouse position
-    floodFill(canvas_surface, state->mouse_pos.canvas, state->draw_color);
+// Process selecting with the magic wand tool
+void handleDrawMagicWand(State* state) {
+    PROFILE_SCOPE("handleDrawMagicWand");
+    
+    // Return early if the mouse is over GUI elements
+    if (state->gui_wants_mouse) return;
     
-    // Create a new texture from the result of the filled surface
-    // We can't directly set the canvas to be this texture, because the canvas needs to have target access mode
-    // for rendering to it but creating a texture from a surface forces it to have streaming access mode
-    Texture filled_canvas = Texture(state->gui_resource->renderer, canvas_surface);
+    // Only need to select if user just clicked the mouse
+    if (!state->lmb_info.down || state->lmb_info_old.down) return;
+    
+    // Make sure mouse cursor is over the canvas
+    if (state->mouse_pos.canvas.x < 0 || state->mouse_pos.canvas.x >= state->doc().layers.width() ||
+        state->mouse_pos.canvas.y < 0 || state->mouse_pos.canvas.y >= state->doc().layers.height()) return;
+    
+    // Alias
+    TiledImage& image = state->doc().layers.activeLayer().image;
+    int pitch = image.width() * sizeof(Uint32);
     
-    // Create new blank canvas with same size as current canvas
-    recreateCanvas(state, state->canvas.size());
+    // Copy the active layer into a flat array and wrap it in a surface, same as the fill tool
+    PooledBuffer pixels(image.height() * pitch);
+    image.readRect({0, 0, image.width(), image.height()}, pixels.pixels(), pitch);
+    SDL_Surface* layer_surface = SDL_CreateSurfaceFrom(image.width(), image.height(), SDL_PIXELFORMAT_RGBA8888, pixels.data(), pitch);
     
-    // Copy the data of the filled canvas to the newly created canvas
-    filled_canvas.renderTo(state->canvas, NULL, NULL);
+    // Select the same region that the fill tool would fill
+    applySelection(state, floodSelection(layer_surface, state->mouse_pos.canvas));
     
     // Clean up surface
-    SDL_DestroySurface(canvas_surface);
+    SDL_DestroySurface(layer_surface);
+}
+
+// Process picking a color with the eyedropper tool
+void handleDrawEyedropper(State* state) {
+    PROFILE_SCOPE("handleDrawEyedropper");
+    
+    // Only sample while the cursor is over the canvas and not over GUI elements
+    int x = std::floor(state->mouse_pos.canvas.x), y = std::floor(state->mouse_pos.canvas.y);
+    state->eyedropper_hovering = !state->gui_wants_mouse &&
+        x >= 0 && x < state->doc().layers.width() && y >= 0 && y < state->doc().layers.height();
+    if (!state->eyedropper_hovering) return;
+    
+    // Square centered on the cursor, cut off at the edges of the canvas
+    int half = state->eyedropper_size / 2;
+    SDL_Rect rect = intersectRect({x - half, y - half, state->eyedropper_size, state->eyedropper_size}, {0, 0, state->doc().layers.width(), state->doc().layers.height()});
+    
+    // The composite is kept up to date with every edit, so this only reads a few pixels of it
+    Uint32 average = unpremultiply(averageRect(state->doc().layers.composite(), state->doc().layers.width(), rect));
+    state->eyedropper_color = scaleVec(uint32ToVec(SDL_PIXELFORMAT_RGBA8888, average), 1 / 255.0f);
+    
+    // Clicking or dragging picks the color, alpha is ignored since the draw color is always opaque
+    if (state->lmb_info.down) {
+        state->draw_color = {state->eyedropper_color.x, state->eyedropper_color.y, state->eyedropper_color.z, 1};
+        state->brush_details_changed = true;
+    }
+}
+
+// Process dragging the floating paste around, which takes over from the drawing tools while there is one
+// Clicking outside of the paste commits it, and that click isn't used by the drawing tool
+void handleDrawPaste(State* state) {
+    ImVec2 mouse = state->mouse_pos.canvas;
+    
+    // Grab or commit the paste when the user clicks on the canvas
+    if (state->lmb_info.down && !state->lmb_info_old.down && !state->gui_wants_mouse) {
+        SDL_Rect area = state->paste.area();
+        if (mouse.x >= area.x && mouse.x < area.x + area.w && mouse.y >= area.y && mouse.y < area.y + area.h) {
+            state->dragging_paste = true;
+            state->paste_grab = {mouse.x - area.x, mouse.y - area.y};
+        } else {
+            commitPaste(state);
+        }
+        return;
+    }
+    
+    if (!state->dragging_paste) return;
+    
+    if (state->lmb_info.down) {
+        // Keep the paste on whole pixels, so it's never resampled
+        int x = std::floor(mouse.x - state->paste_grab.x);
+        int y = std::floor(mouse.y - state->paste_grab.y);
+        state->doc().layers.markDirty(state->paste.moveTo(x, y));
+    } else {
+        state->dragging_paste = false;
+    }
 }
 
 // Process drawing on canvas
 void handleDraw(State* state) {
+    if (state->paste.active()) {
+        handleDrawPaste(state);
+        return;
+    }
+    
+    // A polygon that wasn't finished before switching tools is dropped
+    if (state->drawing_tool != DrawingTool::Polygon) state->polygon_points.clear();
+    
     // Switch depending on current selected tool
     switch(state->drawing_tool) {
         case DrawingTool::Brush:
@@ -186,20 +705,43 @@ void handleDraw(State* state) {
         case DrawingTool::Line:
             handleDrawLine(state);
             break;
+        case DrawingTool::Rectangle:
+        case DrawingTool::Ellipse:
+            handleDrawShape(state);
+            break;
+        case DrawingTool::Polygon:
+            handleDrawPolygon(state);
+            break;
         case DrawingTool::Fill:
             handleDrawFill(state);
             break;
+        case DrawingTool::RectSelect:
+            handleDrawRectSelect(state);
+            break;
+        case DrawingTool::Lasso:
+            handleDrawLasso(state);
+            break;
+        case DrawingTool::MagicWand:
+            handleDrawMagicWand(state);
+            break;
+        case DrawingTool::Eyedropper:
+            handleDrawEyedropper(state);
+            break;
     }
 }
 
 // Called if the user selects "File->New" in the top menu bar
 void handleNewFile(State* state) {
-    // Create a new canvas with user-selected size
-    recreateCanvas(state, state->file_action_info.new_info.size);
+    PROFILE_SCOPE("handleNewFile");
+    
+    // Create a new canvas with user-selected size in a new tab
+    addDocument(state, "Untitled " + std::to_string(state->documents_created + 1), state->file_action_info.new_info.size);
 }
 
 // Called if the user selects "File->Open" in the top menu bar
 void handleOpenFile(State* state) {
+    PROFILE_SCOPE("handleOpenFile");
+    
     // Open file dialog asking user where to save file
     std::string path = requestFileDialog({ { "PNG", "png" }, { "JPG", "jpg" } }, false);
     
@@ -209,46 +751,417 @@ void handleOpenFile(State* state) {
     // Read image file from path
     SDL_Surface* image_surface = openImage(path);
     
-    // Create texture from surface of image
-    Texture image_texture = Texture(state->gui_resource->renderer, image_surface);
-    
-    // Create new blank canvas with same size as the opened image
-    recreateCanvas(state, image_texture.size());
+    // Create new canvas with same size as the opened image in a new tab, named after the file
+    addDocument(state, std::filesystem::path(path).filename().string(), {(float)image_surface->w, (float)image_surface->h});
     
-    // Copy the data of the image to the newly created canvas
-    image_texture.renderTo(state->canvas, NULL, NULL);
+    // Copy the data of the image into the background layer, converting it to premultiplied alpha
+    PooledBuffer pixels(image_surface->w * image_surface->h * sizeof(Uint32));
+    for (int row = 0; row < image_surface->h; row++) {
+        for (int col = 0; col < image_surface->w; col++) {
+            pixels.pixels()[row * image_surface->w + col] = premultiply(*getPixel(image_surface->pixels, image_surface->pitch, col, row));
+        }
+    }
+    state->doc().layers.layers[0].forgetStrokes();
+    state->doc().layers.layers[0].image.writeRect({0, 0, image_surface->w, image_surface->h}, pixels.pixels(), image_surface->w * sizeof(Uint32));
     
     // Clean up surface
-    SDL_DestroySurface(image_surface);
+    destroySurface(image_surface);
+}
+
+// Join the save thread once it has finished, or wait for it to finish if wait is true
+// Rethrows any error from the save on this thread
+void finishSave(State* state, bool wait) {
+    if (!state->save_thread.joinable()) return;
+    if (!wait && !state->save_done) return;
+    
+    state->save_thread.join();
+    
+    if (state->save_error) {
+        std::exception_ptr error = state->save_error;
+        state->save_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+// Save the composite of a layer stack to a file on the save thread
+// The composite must already be up to date
+void startSave(State* state, std::string path, const LayerStack& layers, SaveOptions options = {}) {
+    // Only one save at a time, so wait for the previous one if it's still being written
+    finishSave(state, true);
+    
+    // Take a snapshot of the composite of all layers, so no pixels need to be read back from the GPU
+    // and drawing can carry on while the file is written without changing what gets saved
+    // The pixels are borrowed from the pool, so saving repeatedly doesn't allocate a new full-size buffer each time
+    int w = layers.width(), h = layers.height();
+    PooledBuffer pixels(w * h * sizeof(Uint32));
+    const Uint32* composite = layers.composite();
+    for (int i = 0; i < w * h; i++) {
+        // Image files don't use premultiplied alpha
+        pixels.pixels()[i] = unpremultiply(composite[i]);
+    }
+    
+    // Encode and write the file on the save thread, which takes over the snapshot
+    state->save_done = false;
+    state->save_thread = std::thread([state, path, w, h, options, pixels = std::move(pixels)]() mutable {
+        try {
+            SDL_Surface* canvas_surface = SDL_CreateSurfaceFrom(w, h, SDL_PIXELFORMAT_RGBA8888, pixels.data(), w * sizeof(Uint32));
+            saveImage(path, canvas_surface, options);
+            
+            // Clean up surface, this doesn't free the pixels since they belong to the pooled buffer
+            SDL_DestroySurface(canvas_surface);
+        } catch (...) {
+            // Exceptions can't cross threads, so hand it to the main thread
+            state->save_error = std::current_exception();
+        }
+        state->save_done = true;
+    });
 }
 
 // Called if the user selects "File->Save As" in the top menu bar
 void handleSaveAsFile(State* state) {
+    PROFILE_SCOPE("handleSaveAsFile");
+    
+    // Open file dialog asking user where to save file, only showing the format picked in the save window
+    const SaveOptions& options = state->file_action_info.save_options;
+    std::string path = options.format == ImageFormat::JPG ? requestFileDialog({ { "JPG", "jpg,jpeg" } }, true)
+                                                          : requestFileDialog({ { "PNG", "png" } }, true);
+    
+    // Return if path is empty (user cancelled)
+    if (path.empty()) return;
+    
+    // Make sure the composite is up to date with every layer
+    updateCanvasTexture(state);
+    
+    startSave(state, path, state->doc().layers, options);
+}
+
+// Called if the user selects "File->Export at 2x" or "File->Export at 4x" in the top menu bar
+void handleExportScaled(State* state) {
+    PROFILE_SCOPE("handleExportScaled");
+    
     // Open file dialog asking user where to save file
     std::string path = requestFileDialog({ { "PNG", "png" }, { "JPG", "jpg" } }, true);
     
     // Return if path is empty (user cancelled)
     if (path.empty()) return;
     
-    // Create a surface from the canvas texture so we can read its pixels directly
-    state->canvas.setRenderTarget();
-    SDL_Surface* canvas_surface = SDL_RenderReadPixels(state->gui_resource->renderer, NULL);
+    // Layers made of strokes are painted again at the bigger size, so they stay sharp
+    // The document itself isn't changed
+    int scale = state->file_action_info.export_scale;
+    LayerStack scaled = state->doc().layers.scaledCopy(state->doc().layers.width() * scale, state->doc().layers.height() * scale);
     
-    // Write image file to path
-    saveImage(path, canvas_surface);
+    startSave(state, path, scaled, state->file_action_info.save_options);
+}
+
+// Called if the user clicks OK in the "File->Export Indexed PNG" window
+void handleExportIndexed(State* state) {
+    PROFILE_SCOPE("handleExportIndexed");
     
-    // Clean up surface
-    SDL_DestroySurface(canvas_surface);
+    // Open file dialog asking user where to save file, indexed images can only be PNGs
+    std::string path = requestFileDialog({ { "PNG", "png" } }, true);
+    
+    // Return if path is empty (user cancelled)
+    if (path.empty()) return;
+    
+    // Make sure the composite is up to date with every layer
+    updateCanvasTexture(state);
+    
+    // The palette is picked on the save thread, so a big image doesn't hold up drawing
+    startSave(state, path, state->doc().layers, state->file_action_info.indexed_options);
+}
+
+// Start autosaving the documents that were opened while the recover window was open
+void startHeldBackAutosave(State* state) {
+    for (auto& document : state->documents) {
+        if (!document->journal.running()) startAutosave(state, *document);
+    }
+}
+
+// Is the document still a single blank layer, like it was when it was opened?
+// A layer that's still described by its strokes and has none is only its base color
+static bool isUntouched(State* state, const Document& document) {
+    if (document.layers.layers.size() != 1) return false;
+    if (document.layers.width() != state->initial_canvas_size.x || document.layers.height() != state->initial_canvas_size.y) return false;
+    const Layer& layer = document.layers.layers[0];
+    bool floating_paste = &document == &state->doc() && state->paste.active();
+    return layer.has_strokes && layer.strokes.empty() && layer.visible && layer.opacity == 1 && layer.blend_mode == BlendMode::Normal && !floating_paste;
+}
+
+// Called if the user clicks "Recover" in the window shown on startup after a crash
+void handleRecover(State* state) {
+    PROFILE_SCOPE("handleRecover");
+    
+    // Every journal becomes a document of its own, from the last complete checkpoint in it
+    // A damaged journal is skipped, rather than stopping the app from starting every time
+    int recovered = 0;
+    for (const std::string& path : state->recover_paths) {
+        Document& document = addDocument(state, "Recovered " + std::to_string(recovered + 1), state->initial_canvas_size);
+        try {
+            if (Journal::recover(path, document.layers)) {
+                recreateCanvasTexture(state);
+                recovered++;
+            } else {
+                closeDocument(state, state->active_document);
+            }
+        } catch (const std::exception& e) {
+            std::cout << e.what() << std::endl << "Could not recover " << path << std::endl;
+            closeDocument(state, state->active_document);
+        }
+    }
+    
+    // The recovered documents carry on autosaving in new journals, so the old ones can go
+    for (const std::string& path : state->recover_paths) Journal::discard(path);
+    state->recover_paths.clear();
+    
+    // Close the blank document that was opened on startup, unless nothing could be recovered
+    // The recover window doesn't stop anything else, so it's left open if it was drawn on or already closed
+    for (int i = 0; i < (int)state->documents.size() && recovered > 0; i++) {
+        if (state->documents[i]->id == state->startup_document) {
+            if (isUntouched(state, *state->documents[i])) closeDocument(state, i);
+            break;
+        }
+    }
+    startHeldBackAutosave(state);
+}
+
+// Called if the user clicks "Discard" in the window shown on startup after a crash
+void handleDiscardRecovery(State* state) {
+    for (const std::string& path : state->recover_paths) Journal::discard(path);
+    state->recover_paths.clear();
+    
+    startHeldBackAutosave(state);
 }
 
 // Called if the user selects "Image->Resize" in the top menu bar
 void handleImageResize(State* state) {
+    PROFILE_SCOPE("handleImageResize");
+    
     // Resize canvas to user-selected size
     resizeCanvas(state, state->image_action_info.resize_info.size);
 }
 
+// Called if the user selects "Image->Canvas Size" in the top menu bar
+void handleImageCanvasSize(State* state) {
+    PROFILE_SCOPE("handleImageCanvasSize");
+    
+    // Alias
+    auto& info = state->image_action_info.canvas_size_info;
+    
+    // Crop or extend canvas to user-selected size around the selected anchor
+    resizeCanvasKeepContent(state, info.size, info.anchor, info.fill_color);
+}
+
+// Called if the user selects one of the rotate or flip options in the Image menu
+void handleImageTransform(State* state) {
+    PROFILE_SCOPE("handleImageTransform");
+    
+    // Rotated and mirrored on the CPU one tile at a time, so nothing goes through the GPU
+    state->doc().layers.transform(state->image_action_info.transform);
+    
+    // Rotating by 90 degrees changes the size, and the old selection doesn't match the new content either way
+    recreateCanvasTexture(state);
+}
+
+// Called if the user clicks "OK" in the filter window
+// Runs the filter on the active layer at full size, and only keeps the result inside the selection if there is one
+void handleImageFilter(State* state) {
+    PROFILE_SCOPE("handleImageFilter");
+    
+    // Aliases
+    Layer& layer = state->doc().layers.activeLayer();
+    TiledImage& image = layer.image;
+    int w = image.width(), h = image.height();
+    int pitch = w * sizeof(Uint32);
+    
+    // Filters need every pixel around the one they're working on, so they run on a flat copy of the layer
+    PooledBuffer pixels((size_t)h * pitch);
+    image.readRect({0, 0, w, h}, pixels.pixels(), pitch);
+    applyFilter(pixels.pixels(), w, h, state->image_action_info.filter_info);
+    
+    layer.forgetStrokes();
+    
+    if (const Selection* mask = selectionMask(state)) {
+        // Copy back a span at a time so pixels outside the selection keep their old color
+        for (int y = 0; y < h; y++) {
+            for (const Span& span : mask->row(y)) {
+                image.writeRect({span.start, y, span.end - span.start, 1}, &pixels.pixels()[y * w + span.start], pitch);
+            }
+        }
+        state->doc().layers.markDirty(mask->bounds());
+    } else {
+        image.writeRect({0, 0, w, h}, pixels.pixels(), pitch);
+        state->doc().layers.markAllDirty();
+    }
+}
+
+// Called if the user clicks "OK" in the adjustments window
+// Adjustments only look at one pixel at a time, so they run straight on the tiles with no flat copy of the layer
+void handleImageAdjust(State* state) {
+    PROFILE_SCOPE("handleImageAdjust");
+    
+    // Aliases
+    Layer& layer = state->doc().layers.activeLayer();
+    TiledImage& image = layer.image;
+    ColorAdjustment adjustment(state->image_action_info.adjust_info);
+    const Selection* mask = selectionMask(state);
+    
+    // Each thread gets its own band of tile rows
+    parallelFor(image.tilesY(), [&](int ty0, int ty1) {
+        TRACE_SCOPE("adjustTiles");
+        
+        for (int ty = ty0; ty < ty1; ty++) {
+            for (int tx = 0; tx < image.tilesX(); tx++) {
+                // Empty tiles are transparent and stay that way
+                // Tiles that already exist are never allocated again, so getting them for writing is safe from any thread
+                if (image.tile(tx, ty) == nullptr) continue;
+                Uint32* tile = image.tileForWrite(tx, ty);
+                
+                // Pixels past the edge of the image are transparent too, so the whole tile can be adjusted
+                if (mask == nullptr) {
+                    adjustment.apply(tile, tile_size * tile_size);
+                    continue;
+                }
+                
+                // Only adjust the selected part of each row
+                for (int y = ty * tile_size; y < std::min((ty + 1) * tile_size, image.height()); y++) {
+                    for (const Span& span : mask->row(y)) {
+                        int start = std::max(span.start, tx * tile_size), end = std::min(span.end, (tx + 1) * tile_size);
+                        if (start < end) adjustment.apply(&tile[(y - ty * tile_size) * tile_size + start - tx * tile_size], end - start);
+                    }
+                }
+            }
+        }
+    });
+    
+    layer.forgetStrokes();
+    state->doc().layers.markAllDirty();
+}
+
+// Part of the canvas that is on screen, in canvas coordinates
+SDL_Rect visibleCanvasRect(State* state) {
+    ImVec4 viewport = state->viewport;
+    ImVec2 top_left = screenToCanvasPos(state->doc().canvas.size(), viewport, state->doc().viewport_offset, state->doc().scale, {viewport.x, viewport.y});
+    ImVec2 bottom_right = screenToCanvasPos(state->doc().canvas.size(), viewport, state->doc().viewport_offset, state->doc().scale, {viewport.x + viewport.z, viewport.y + viewport.w});
+    
+    int x0 = std::floor(top_left.x), y0 = std::floor(top_left.y);
+    int x1 = std::ceil(bottom_right.x), y1 = std::ceil(bottom_right.y);
+    return intersectRect({x0, y0, x1 - x0, y1 - y0}, {0, 0, state->doc().layers.width(), state->doc().layers.height()});
+}
+
+// Keep the adjustment preview on the canvas up to date
+// Only the visible part of the canvas is composited with the preview and uploaded, and any part that scrolls into view
+// later is done then. Once the window is closed, everything is uploaded again without it.
+void updateAdjustPreview(State* state) {
+    if (!state->show_adjust_window) {
+        // Preview just ended, put the canvas back the way it was (or show the adjusted layer, if OK was clicked)
+        if (state->adjust_previewing) {
+            state->adjust_previewing = false;
+            state->adjust_preview_redraw = {0, 0, 0, 0};
+            state->doc().layers.markAllDirty();
+        }
+        return;
+    }
+    
+    PROFILE_SCOPE("updateAdjustPreview");
+    
+    SDL_Rect visible = visibleCanvasRect(state);
+    
+    // Settings changed, so everything on screen needs the new preview
+    if (state->adjust_preview_dirty || !state->adjust_previewing) {
+        state->adjust_preview_dirty = false;
+        state->adjust_preview = ColorAdjustment(state->image_action_info.adjust_info);
+        state->adjust_preview_redraw = unionRect(state->adjust_preview_redraw, visible);
+    }
+    // The view moved, so some of what's on screen might not have the preview yet
+    else if (std::tie(visible.x, visible.y, visible.w, visible.h) != std::tie(state->adjust_preview_visible.x, state->adjust_preview_visible.y, state->adjust_preview_visible.w, state->adjust_preview_visible.h)) {
+        state->adjust_preview_redraw = unionRect(state->adjust_preview_redraw, visible);
+    }
+    
+    state->adjust_previewing = true;
+    state->adjust_preview_visible = visible;
+}
+
+// Longest side of the filter preview in pixels
+static const int filter_preview_size = 256;
+
+// Work out the filter preview again if the filter window asked for it
+// The preview is a scaled down copy of the active layer, with the filter scaled down by the same amount,
+// so adjusting a setting stays interactive no matter how big the canvas is
+void updateFilterPreview(State* state) {
+    if (!state->show_filter_window || !state->filter_preview_dirty) return;
+    state->filter_preview_dirty = false;
+    
+    PROFILE_SCOPE("updateFilterPreview");
+    
+    // Size of the preview, the same shape as the canvas
+    const TiledImage& image = state->doc().layers.activeLayer().image;
+    int w = image.width(), h = image.height();
+    float factor = std::min(1.0f, (float)filter_preview_size / std::max(w, h));
+    int preview_w = std::max((int)std::round(w * factor), 1);
+    int preview_h = std::max((int)std::round(h * factor), 1);
+    
+    // Sample the nearest pixel of the layer for every pixel of the preview
+    PooledBuffer pixels((size_t)preview_w * preview_h * sizeof(Uint32));
+    for (int y = 0; y < preview_h; y++) {
+        int src_y = std::min((int)((y + 0.5f) / factor), h - 1);
+        for (int x = 0; x < preview_w; x++) {
+            int src_x = std::min((int)((x + 0.5f) / factor), w - 1);
+            pixels.pixels()[y * preview_w + x] = image.pixel(src_x, src_y);
+        }
+    }
+    
+    FilterSettings settings = state->image_action_info.filter_info;
+    settings.radius *= factor;
+    applyFilter(pixels.pixels(), preview_w, preview_h, settings);
+    
+    // Only create a new texture if the preview changed size
+    if (state->filter_preview.get() == nullptr || state->filter_preview.width() != preview_w || state->filter_preview.height() != preview_h) {
+        state->filter_preview = Texture(state->gui_resource->renderer, SDL_TEXTUREACCESS_STATIC, preview_w, preview_h, MemoryCategory::Temporary);
+        
+        // The layer has premultiplied alpha
+        SDL_SetTextureBlendMode(state->filter_preview.get(), SDL_BLENDMODE_BLEND_PREMULTIPLIED);
+    }
+    state->filter_preview.update(nullptr, pixels.data(), preview_w * sizeof(Uint32));
+}
+
+// Work out the save estimate again if the save window asked for it
+void updateSaveEstimate(State* state) {
+    if (!state->show_save_window || !state->save_estimate_dirty) return;
+    state->save_estimate_dirty = false;
+    
+    PROFILE_SCOPE("updateSaveEstimate");
+    
+    state->save_estimate = estimateSave(state->doc().layers.composite(), state->doc().layers.width(), state->doc().layers.height(), state->file_action_info.save_options);
+}
+
+// How often the autosave journal gets a checkpoint, in milliseconds
+static const Uint64 autosave_interval = 10000;
+
+// Append anything that changed to the autosave journal every few seconds
+void updateAutosave(State* state) {
+    if (!state->doc().journal.running() || SDL_GetTicks() - state->last_autosave < autosave_interval) return;
+    state->last_autosave = SDL_GetTicks();
+    
+    PROFILE_SCOPE("updateAutosave");
+    
+    // Autosave failing shouldn't take the image down with it, so turn it off and let the user save by hand
+    try {
+        state->doc().journal.checkpoint(state->doc().layers);
+    } catch (const std::exception& e) {
+        std::cout << e.what() << std::endl << "Autosave has been turned off" << std::endl;
+        state->doc().journal.stop(false);
+    }
+}
+
 // Process any actions caused by the user clicking an option in the top menu bar e.g. File->New
 void handleMenuBarAction(State* state) {
+    PROFILE_SCOPE("handleMenuBarAction");
+    
+    // File and Image actions read or change the layers, so a floating paste becomes part of them first
+    if (state->file_action_info.status != FileActionInfo::None || state->image_action_info.status != ImageActionInfo::None) {
+        commitPaste(state);
+    }
+    
     // Dispatch actions if the user clicked an option in the File menu
     switch (state->file_action_info.status) {
         case FileActionInfo::DoNew:
@@ -260,6 +1173,18 @@ void handleMenuBarAction(State* state) {
         case FileActionInfo::DoSaveAs:
             handleSaveAsFile(state);
             break;
+        case FileActionInfo::DoExportScaled:
+            handleExportScaled(state);
+            break;
+        case FileActionInfo::DoExportIndexed:
+            handleExportIndexed(state);
+            break;
+        case FileActionInfo::DoRecover:
+            handleRecover(state);
+            break;
+        case FileActionInfo::DoDiscardRecovery:
+            handleDiscardRecovery(state);
+            break;
         default:
             break;
     }
@@ -271,22 +1196,170 @@ void handleMenuBarAction(State* state) {
         case ImageActionInfo::DoResize:
             handleImageResize(state);
             break;
+        case ImageActionInfo::DoCanvasSize:
+            handleImageCanvasSize(state);
+            break;
+        case ImageActionInfo::DoFilter:
+            handleImageFilter(state);
+            break;
+        case ImageActionInfo::DoAdjust:
+            handleImageAdjust(state);
+            break;
+        case ImageActionInfo::DoTransform:
+            handleImageTransform(state);
+            break;
         default:
             break;
     }
     // Action has been processed, clear status
     state->image_action_info.status = ImageActionInfo::None;
+    
+    // Dispatch actions if the user clicked an option in the Select menu
+    // These always replace the selection, no matter the selection mode
+    switch (state->select_action_info.status) {
+        case SelectActionInfo::DoSelectAll:
+            state->doc().selection = selectionInvert(Selection(state->doc().layers.width(), state->doc().layers.height()));
+            break;
+        case SelectActionInfo::DoDeselect:
+            state->doc().selection = Selection(state->doc().layers.width(), state->doc().layers.height());
+            break;
+        case SelectActionInfo::DoInvert:
+            state->doc().selection = selectionInvert(state->doc().selection);
+            break;
+        default:
+            break;
+    }
+    if (state->select_action_info.status != SelectActionInfo::None) {
+        state->doc().selection_outline = selectionOutline(state->doc().selection);
+    }
+    // Action has been processed, clear status
+    state->select_action_info.status = SelectActionInfo::None;
+}
+
+// Called if the user selects "Edit->Copy" in the top menu bar or presses Ctrl+C
+// Copies the selected part of the active layer, or the whole layer if nothing is selected
+void handleCopy(State* state) {
+    PROFILE_SCOPE("handleCopy");
+    
+    // Copying a paste that's still floating shares its pixels again, without copying anything
+    std::shared_ptr<const ClipboardImage> image = state->paste.active() ? state->paste.image()
+                                                                        : copyImage(state->doc().layers.activeLayer().image, selectionMask(state));
+    if (image == nullptr) return;
+    
+    setClipboardImage(std::move(image));
+}
+
+// Called if the user selects "Edit->Paste" in the top menu bar or presses Ctrl+V
+// The image floats above the active layer until it's committed, so nothing is copied into the layer yet
+void handlePaste(State* state) {
+    PROFILE_SCOPE("handlePaste");
+    
+    // Wait for the stroke being painted to finish, since the paste puts the drawing tools on hold
+    if (state->brush_stroke.active()) return;
+    
+    // Another app's image might not decode, which shouldn't take the document down with it
+    std::shared_ptr<const ClipboardImage> image;
+    try {
+        image = getClipboardImage();
+    } catch (const std::exception& e) {
+        std::cout << e.what() << std::endl << "Could not paste the image on the clipboard" << std::endl;
+        return;
+    }
+    if (image == nullptr) return;
+    
+    // Only one paste floats at a time
+    commitPaste(state);
+    
+    // Pasted back where it was copied from, unless that's off the canvas e.g. when it came from a bigger document
+    int x = image->x, y = image->y;
+    if (intersectRect({x, y, image->w, image->h}, {0, 0, state->doc().layers.width(), state->doc().layers.height()}).w == 0) {
+        x = 0;
+        y = 0;
+    }
+    
+    state->paste.begin(std::move(image), x, y);
+    state->doc().layers.markDirty(state->paste.area());
+}
+
+// Process any actions caused by the user clicking an option in the Edit menu, or pressing one of its shortcuts
+void handleEditAction(State* state) {
+    switch (state->edit_action_info.status) {
+        case EditActionInfo::DoCopy:
+            handleCopy(state);
+            break;
+        case EditActionInfo::DoPaste:
+            handlePaste(state);
+            break;
+        case EditActionInfo::DoCommitPaste:
+            commitPaste(state);
+            break;
+        case EditActionInfo::DoDiscardPaste:
+            state->doc().layers.markDirty(state->paste.discard());
+            state->dragging_paste = false;
+            break;
+        default:
+            break;
+    }
+    // Action has been processed, clear status
+    state->edit_action_info.status = EditActionInfo::None;
+}
+
+// Process any actions caused by the user clicking or closing a document tab
+void handleDocumentAction(State* state) {
+    switch (state->document_action_info.status) {
+        case DocumentActionInfo::DoSwitch:
+            switchDocument(state, state->document_action_info.index);
+            break;
+        case DocumentActionInfo::DoClose:
+            closeDocument(state, state->document_action_info.index);
+            break;
+        default:
+            break;
+    }
+    // Action has been processed, clear status
+    state->document_action_info.status = DocumentActionInfo::None;
+}
+
+// Process any actions caused by the user clicking a button in the layer panel
+void handleLayerAction(State* state) {
+    PROFILE_SCOPE("handleLayerAction");
+    
+    // The paste floats above the active layer, so it's committed before a layer is added or deleted
+    if (state->layer_action_info.status == LayerActionInfo::DoAdd || state->layer_action_info.status == LayerActionInfo::DoDelete) commitPaste(state);
+    
+    switch (state->layer_action_info.status) {
+        case LayerActionInfo::DoAdd:
+            state->doc().layers.addLayer();
+            break;
+        case LayerActionInfo::DoDelete:
+            state->doc().layers.deleteLayer();
+            break;
+        case LayerActionInfo::DoMoveUp:
+            state->doc().layers.moveLayer(1);
+            break;
+        case LayerActionInfo::DoMoveDown:
+            state->doc().layers.moveLayer(-1);
+            break;
+        case LayerActionInfo::DoChanged:
+            // Layer properties affect every pixel of the layer, so recomposite everything
+            state->doc().layers.markAllDirty();
+            break;
+        default:
+            break;
+    }
+    // Action has been processed, clear status
+    state->layer_action_info.status = LayerActionInfo::None;
 }
 
 // Handle any scroll wheel inputs
 void handleScroll(State* state) {
     // Every scroll wheel input should multiply or divide the scale by a fixed amount
     // If the user is scrolling quickly, state->scroll might be large so we need to multiply or divide repeatedly (which is what pow does)
-    state->scale *= pow(1.1, state->scroll);
+    state->doc().scale *= pow(1.1, state->scroll);
     
     // Cap scale between 0.1 and 10
-    if (state->scale < 0.1) state->scale = 0.1;
-    if (state->scale > 10) state->scale = 10;
+    if (state->doc().scale < 0.1) state->doc().scale = 0.1;
+    if (state->doc().scale > 10) state->doc().scale = 10;
     
 }
 
@@ -300,8 +1373,8 @@ void handleCanvasDrag(State* state) {
     if (state->rmb_info.down && !state->gui_wants_mouse) {
         // Adjust viewport offset by the amount the mouse moved since the last frame
         // Divide by scale because the canvas should drag slower if very zoomed in
-        state->viewport_offset.x -= (mouse.x - mouse_old.x) / state->scale;
-        state->viewport_offset.y -= (mouse.y - mouse_old.y) / state->scale;
+        state->doc().viewport_offset.x -= (mouse.x - mouse_old.x) / state->doc().scale;
+        state->doc().viewport_offset.y -= (mouse.y - mouse_old.y) / state->doc().scale;
     }
 }
 
@@ -309,8 +1382,7 @@ void handleCanvasDrag(State* state) {
 void handleBrushDetailsChange(State* state) {
     if (state->brush_details_changed) {
         state->brush_details_changed = false;
-        // Brush size is the width of the brush, so the radius is size/2
-        recreateBrushTexture(state, state->brush_size / 2, state->draw_color);
+        updateBrushTexture(state);
     }
 }
 
@@ -327,9 +1399,33 @@ void updateOldVars(State* state) {
 void backendProcess(State* state) {
     handleDraw(state);
     handleMenuBarAction(state);
+    handleEditAction(state);
+    handleDocumentAction(state);
+    handleLayerAction(state);
     handleCanvasDrag(state);
     handleScroll(state);
     handleBrushDetailsChange(state);
+    updateFilterPreview(state);
+    updateAdjustPreview(state);
+    
+    // Upload anything that changed this frame so it shows up on screen
+    updateCanvasTexture(state);
+    
+    // Needs the composite to be up to date
+    updateSaveEstimate(state);
+    
+    // Clean up after a save that finished in the background
+    finishSave(state, false);
+    
+    updateAutosave(state);
     
     updateOldVars(state);
+}
+
+// Wait for anything still running in the background, call once the main loop has ended
+void backendShutdown(State* state) {
+    finishSave(state, true);
+    
+    // Closing normally, so the journals aren't needed to recover anything
+    for (auto& document : state->documents) document->journal.stop(true);
 }
\ No newline at end of file
@@ -7,4 +7,7 @@
 void backendInit(State* state);
 
 // Process events that happened e.g. if user dragged mouse to draw
-void backendProcess(State* state);
\ No newline at end of file
+void backendProcess(State* state);
+
+// Wait for anything still running in the background, call once the main loop has ended
+void backendShutdown(State* state);
\ No newline at end of file
@@ -0,0 +1,112 @@
+#include "brush.hpp"
+#include "utils.hpp"
+#include "pool.hpp"
+
+#include <tuple>
+#include <cmath>
+#include <algorithm>
+
+// Needed so the key can be used in a std::map
+bool BrushKey::operator<(const BrushKey& other) const {
+    return std::tie(radius, hardness, anti_alias) < std::tie(other.radius, other.hardness, other.anti_alias);
+}
+
+// Get the stamp with its mask and preview texture, generating anything missing
+const BrushStamp& BrushCache::get(SDL_Renderer* renderer, BrushKey key) {
+    BrushStamp& stamp = lookup(key);
+    pinned = key;
+    
+    // Mask is already there, but the preview is only created the first time it's asked for
+    if (!stamp.has_preview) {
+        // Create surface just big enough for the circle and draw its outline in white,
+        // so that color modulation gives the exact draw color
+        // Both the pixels and the texture are borrowed from the pools, and the texture goes back to the pool
+        // when the stamp is evicted, so dragging the size slider around doesn't keep allocating
+        PooledBuffer pixels(stamp.size * stamp.size * sizeof(Uint32));
+        SDL_Surface* surface = SDL_CreateSurfaceFrom(stamp.size, stamp.size, SDL_PIXELFORMAT_RGBA8888, pixels.data(), stamp.size * sizeof(Uint32));
+        SDL_FillSurfaceRect(surface, nullptr, 0);
+        drawCircle(surface, key.radius, {1, 1, 1, 1});
+        stamp.preview = Texture::fromPool(renderer, SDL_TEXTUREACCESS_STATIC, stamp.size, stamp.size, MemoryCategory::Brush);
+        stamp.preview.update(nullptr, surface->pixels, surface->pitch);
+        
+        // Set scale mode to nearest so the preview doesn't get blurry when zooming in
+        SDL_SetTextureScaleMode(stamp.preview.get(), SDL_SCALEMODE_NEAREST);
+        
+        // Destroy temporary surface, this doesn't free the pixels since they belong to the pooled buffer
+        SDL_DestroySurface(surface);
+        
+        stamp.has_preview = true;
+    }
+    
+    return stamp;
+}
+
+// Get the stamp with only its mask generated, without touching the GPU
+const BrushStamp& BrushCache::getMask(BrushKey key) {
+    return lookup(key);
+}
+
+// Find the stamp in the cache and mark it as most recently used, generating the mask if it's not cached
+BrushStamp& BrushCache::lookup(BrushKey key) {
+    auto found = index.find(key);
+    
+    if (found != index.end()) {
+        // Cache hit, move the stamp to the front of the list
+        // Splicing doesn't invalidate the iterator stored in the index
+        stamps.splice(stamps.begin(), stamps, found->second);
+        return found->second->second;
+    }
+    
+    // Cache miss, evict the least recently used stamp if the cache is full
+    // The pinned stamp is skipped, since its preview might still be shown
+    if (stamps.size() >= capacity) {
+        auto evicted = std::prev(stamps.end());
+        if (evicted->first == pinned && evicted != stamps.begin()) evicted = std::prev(evicted);
+        if (evicted->first == pinned) pinned.reset();
+        index.erase(evicted->first);
+        stamps.erase(evicted);
+    }
+    
+    // Generate the new stamp and put it at the front
+    stamps.emplace_front(key, BrushStamp{});
+    BrushStamp& stamp = stamps.front().second;
+    stamp.size = key.radius * 2;
+    stamp.mask = generateBrushMask(key);
+    stamp.mask_memory.set(stamp.mask.size());
+    index[key] = stamps.begin();
+    
+    return stamp;
+}
+
+// Generate the coverage mask of a round brush analytically, returns a (radius*2)^2 array
+std::vector<Uint8> generateBrushMask(BrushKey key) {
+    int size = key.radius * 2;
+    std::vector<Uint8> mask(size * size);
+    
+    // Radius of the fully opaque center, the rest of the brush fades out towards the edge
+    float radius = key.radius;
+    float inner_radius = radius * key.hardness / 100.0f;
+    
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            // Distance from the center of this pixel to the center of the stamp
+            float dx = x + 0.5f - radius;
+            float dy = y + 0.5f - radius;
+            float dist = std::sqrt(dx * dx + dy * dy);
+            
+            // Soft falloff between the inner radius and the edge, using smoothstep so it doesn't look like a cone
+            float coverage = 1;
+            if (dist > inner_radius && inner_radius < radius) {
+                float t = std::min((dist - inner_radius) / (radius - inner_radius), 1.0f);
+                coverage = 1 - t * t * (3 - 2 * t);
+            }
+            
+            // The edge itself is either a hard cutoff or gets one pixel of anti-aliasing
+            float edge = key.anti_alias ? std::clamp(radius - dist + 0.5f, 0.0f, 1.0f) : (dist < radius ? 1.0f : 0.0f);
+            
+            mask[y * size + x] = std::round(std::min(coverage, edge) * 255);
+        }
+    }
+    
+    return mask;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "texture.hpp"
+
+#include <SDL3/SDL.h>
+
+#include <list>
+#include <map>
+#include <vector>
+#include <optional>
+
+// Everything that affects the shape of a brush stamp
+// Color isn't part of this since it's applied with texture color modulation, so changing it doesn't need a new stamp
+struct BrushKey {
+    int radius;         // Radius of the stamp in pixels
+    int hardness;       // 0 to 100, percentage of the radius that is fully opaque before the edge starts fading out
+    bool anti_alias;    // Smooth out the edge of hard brushes
+    
+    // Needed so the key can be used in a std::map
+    bool operator<(const BrushKey& other) const;
+    bool operator==(const BrushKey& other) const { return !(*this < other) && !(other < *this); }
+};
+
+// A brush stamp generated from a BrushKey
+struct BrushStamp {
+    int size = 0;               // Width and height of the stamp in pixels
+    std::vector<Uint8> mask;    // Coverage of each pixel from 0 to 255, size*size entries with no padding
+    MemoryUsage mask_memory{MemoryCategory::Brush};
+
+    // The preview is only created the first time it's needed, so a stamp that is only used for
+    // its mask doesn't allocate anything on the GPU
+    Texture preview;            // White circle outline with no fill, tinted using color modulation
+    bool has_preview = false;   // Has the preview been created yet?
+};
+
+// Least-recently-used cache of brush stamps, so moving the brush sliders back and forth
+// doesn't allocate new textures every frame
+class BrushCache {
+public:
+    // Maximum number of stamps kept alive before the least recently used one is destroyed
+    BrushCache(size_t capacity = 32) : capacity(capacity) {}
+    
+    // Get the stamp with its mask and preview texture, generating anything missing
+    // The stamp is pinned until the next call to get(), so getMask() never evicts it and its preview can be kept around
+    const BrushStamp& get(SDL_Renderer* renderer, BrushKey key);
+    
+    // Get the stamp with only its mask generated, without touching the GPU
+    // The reference is only valid until the next call, since it might get evicted after that
+    const BrushStamp& getMask(BrushKey key);
+
+private:
+    // Find the stamp in the cache and mark it as most recently used, generating the mask if it's not cached
+    BrushStamp& lookup(BrushKey key);
+    
+    size_t capacity;
+    
+    // Stamps in order of use, most recently used at the front
+    std::list<std::pair<BrushKey, BrushStamp>> stamps;
+    
+    // Index into the list so lookups don't need to walk it
+    std::map<BrushKey, std::list<std::pair<BrushKey, BrushStamp>>::iterator> index;
+    
+    // Stamp returned by the last call to get(), which is never evicted
+    std::optional<BrushKey> pinned;
+};
+
+// Generate the coverage mask of a round brush analytically, returns a (radius*2)^2 array
+std::vector<Uint8> generateBrushMask(BrushKey key);
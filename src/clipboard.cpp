@@ -0,0 +1,193 @@
+#include "clipboard.hpp"
+#include "layers.hpp"
+#include "utils.hpp"
+#include "profiler.hpp"
+#include "pool.hpp"
+
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+// The only format offered to and read from other apps
+static const char* png_mime_type = "image/png";
+
+// An image this app put on the clipboard, kept alive by SDL until the clipboard is replaced
+struct ClipboardOffer {
+    std::shared_ptr<const ClipboardImage> image;
+    std::vector<unsigned char> png; // Encoded the first time another app asks for it
+};
+
+// The offer on the clipboard right now, or nullptr if another app has replaced it since
+// SDL cleans up the offer as soon as anything else is put on the clipboard, so this is how pastes know the pixels are ours
+static ClipboardOffer* current_offer = nullptr;
+
+// Copy the part of an image inside a selection, or the whole image if mask is nullptr
+std::shared_ptr<const ClipboardImage> copyImage(const TiledImage& image, const Selection* mask) {
+    PROFILE_SCOPE("copyImage");
+    
+    SDL_Rect bounds = mask ? mask->bounds() : SDL_Rect{0, 0, image.width(), image.height()};
+    if (bounds.w <= 0 || bounds.h <= 0) return nullptr;
+    
+    auto copy = std::make_shared<ClipboardImage>();
+    copy->w = bounds.w;
+    copy->h = bounds.h;
+    copy->x = bounds.x;
+    copy->y = bounds.y;
+    copy->pixels.resize((size_t)bounds.w * bounds.h);
+    copy->memory.set(copy->pixels.size() * sizeof(Uint32));
+    
+    if (mask == nullptr) {
+        image.readRect(bounds, copy->pixels.data(), bounds.w * sizeof(Uint32));
+        return copy;
+    }
+    
+    // Only copy the selected spans of each row, everything else stays transparent
+    for (int y = bounds.y; y < bounds.y + bounds.h; y++) {
+        for (const Span& span : mask->row(y)) {
+            Uint32* dest = &copy->pixels[(size_t)(y - bounds.y) * bounds.w + span.start - bounds.x];
+            image.readRect({span.start, y, span.end - span.start, 1}, dest, bounds.w * sizeof(Uint32));
+        }
+    }
+    return copy;
+}
+
+// Called by SDL when another app asks for the clipboard contents
+// SDL keeps a pointer to the returned data, so it's kept in the offer until the offer is cleaned up
+static const void* SDLCALL provideClipboardData(void* userdata, const char* mime_type, size_t* size) {
+    ClipboardOffer* offer = (ClipboardOffer*)userdata;
+    if (mime_type == nullptr || std::strcmp(mime_type, png_mime_type) != 0) return nullptr;
+    
+    if (offer->png.empty()) {
+        PROFILE_SCOPE("encodeClipboard");
+        
+        // Image files don't use premultiplied alpha
+        const ClipboardImage& image = *offer->image;
+        PooledBuffer pixels(image.pixels.size() * sizeof(Uint32));
+        for (size_t i = 0; i < image.pixels.size(); i++) pixels.pixels()[i] = unpremultiply(image.pixels[i]);
+        
+        try {
+            offer->png = encodePng(pixels.pixels(), image.w, image.h);
+        } catch (const std::exception&) {
+            // SDL treats missing data as an empty clipboard, so there's nothing else to tell it
+            return nullptr;
+        }
+    }
+    
+    *size = offer->png.size();
+    return offer->png.data();
+}
+
+// Called by SDL once the offer has been replaced on the clipboard, or the app is closing
+static void SDLCALL cleanupClipboardData(void* userdata) {
+    ClipboardOffer* offer = (ClipboardOffer*)userdata;
+    if (current_offer == offer) current_offer = nullptr;
+    delete offer;
+}
+
+// Put an image on the system clipboard
+void setClipboardImage(std::shared_ptr<const ClipboardImage> image) {
+    ClipboardOffer* offer = new ClipboardOffer{std::move(image), {}};
+    
+    // The offer belongs to SDL from here on, and is deleted by cleanupClipboardData() even if this fails
+    const char* mime_types[] = {png_mime_type};
+    if (!SDL_SetClipboardData(provideClipboardData, cleanupClipboardData, offer, mime_types, 1))
+        throw std::runtime_error(std::string("Error: SDL_SetClipboardData(): ") + SDL_GetError());
+    
+    // Set after the call, since putting the offer on the clipboard cleans up the old one first
+    current_offer = offer;
+}
+
+// Get the image on the system clipboard
+std::shared_ptr<const ClipboardImage> getClipboardImage() {
+    // Our own image is shared as it is, with no encoding or decoding at all
+    if (current_offer != nullptr) return current_offer->image;
+    
+    if (!SDL_HasClipboardData(png_mime_type)) return nullptr;
+    
+    PROFILE_SCOPE("decodeClipboard");
+    
+    size_t size = 0;
+    void* data = SDL_GetClipboardData(png_mime_type, &size);
+    if (data == nullptr) return nullptr;
+    
+    SDL_Surface* surface;
+    try {
+        surface = openImageFromMemory(data, size);
+    } catch (...) {
+        SDL_free(data);
+        throw;
+    }
+    SDL_free(data);
+    
+    // Convert to premultiplied alpha like an opened file
+    auto image = std::make_shared<ClipboardImage>();
+    image->w = surface->w;
+    image->h = surface->h;
+    image->pixels.resize((size_t)surface->w * surface->h);
+    image->memory.set(image->pixels.size() * sizeof(Uint32));
+    for (int row = 0; row < surface->h; row++) {
+        for (int col = 0; col < surface->w; col++) {
+            image->pixels[(size_t)row * surface->w + col] = premultiply(*getPixel(surface->pixels, surface->pitch, col, row));
+        }
+    }
+    
+    destroySurface(surface);
+    return image;
+}
+
+// Start floating an image with its top-left corner at the given canvas position
+void FloatingPaste::begin(std::shared_ptr<const ClipboardImage> image, int x, int y) {
+    pasted = std::move(image);
+    this->x = x;
+    this->y = y;
+}
+
+// Move the paste, returns the area that needs recompositing
+SDL_Rect FloatingPaste::moveTo(int x, int y) {
+    SDL_Rect old_area = area();
+    this->x = x;
+    this->y = y;
+    return unionRect(old_area, area());
+}
+
+// Blend the paste on top of a row of premultiplied pixels that starts at the given canvas position
+void FloatingPaste::blendOver(Uint32* row, int x, int y, int count) const {
+    if (y < this->y || y >= this->y + pasted->h) return;
+    
+    // Part of the row that the paste covers
+    int start = std::max(x, this->x), end = std::min(x + count, this->x + pasted->w);
+    if (start >= end) return;
+    
+    const Uint32* src = &pasted->pixels[(size_t)(y - this->y) * pasted->w + start - this->x];
+    blendRow(BlendMode::Normal, &row[start - x], src, end - start, 255);
+}
+
+// Merge the paste into an image and stop floating, returns the area that changed
+// This is the only time the pasted pixels are copied, and only the part that's on the canvas
+SDL_Rect FloatingPaste::commit(TiledImage& image) {
+    SDL_Rect changed = intersectRect(area(), {0, 0, image.width(), image.height()});
+    
+    if (changed.w > 0) {
+        PooledBuffer pixels((size_t)changed.w * changed.h * sizeof(Uint32));
+        int pitch = changed.w * sizeof(Uint32);
+        image.readRect(changed, pixels.pixels(), pitch);
+        for (int y = 0; y < changed.h; y++) blendOver(&pixels.pixels()[y * changed.w], changed.x, changed.y + y, changed.w);
+        image.writeRect(changed, pixels.pixels(), pitch);
+    }
+    
+    pasted.reset();
+    return changed;
+}
+
+// Stop floating without changing anything
+SDL_Rect FloatingPaste::discard() {
+    SDL_Rect old_area = area();
+    pasted.reset();
+    return old_area;
+}
+
+// Area covered by the paste
+SDL_Rect FloatingPaste::area() const {
+    if (pasted == nullptr) return {0, 0, 0, 0};
+    return {x, y, pasted->w, pasted->h};
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "image.hpp"
+#include "selection.hpp"
+#include "memory.hpp"
+
+#include <SDL3/SDL.h>
+
+#include <vector>
+#include <memory>
+
+// Pixels that were copied, premultiplied RGBA8888 with no padding
+// Never changed once it's made, so the clipboard and every paste of it can share the same pixels without copying them
+struct ClipboardImage {
+    int w = 0, h = 0;
+    int x = 0, y = 0;               // Where on the canvas the pixels were copied from, so a paste lands in the same place
+    std::vector<Uint32> pixels;
+    MemoryUsage memory{MemoryCategory::Clipboard};
+};
+
+// Copy the part of an image inside a selection, or the whole image if mask is nullptr
+// Pixels in the bounding box of the selection but outside the selection itself are transparent
+// Returns nullptr if nothing is selected
+std::shared_ptr<const ClipboardImage> copyImage(const TiledImage& image, const Selection* mask);
+
+// Put an image on the system clipboard
+// Other apps are offered a PNG, which is only encoded if one of them asks for it, and then only once
+void setClipboardImage(std::shared_ptr<const ClipboardImage> image);
+
+// Get the image on the system clipboard, or nullptr if there isn't one
+// If the image was copied from this app, the same pixels are returned without decoding or copying anything
+// Throws if another app's image can't be decoded
+std::shared_ptr<const ClipboardImage> getClipboardImage();
+
+// A pasted image floating above the active layer, which can be moved around until it's committed
+// Only a reference to the pasted pixels is kept, so pasting doesn't copy anything. The paste is blended on top
+// of the active layer when compositing, and merged into the layer once it's committed.
+class FloatingPaste {
+public:
+    // Start floating an image with its top-left corner at the given canvas position
+    void begin(std::shared_ptr<const ClipboardImage> image, int x, int y);
+    
+    // Move the paste so its top-left corner is at the given canvas position, returns the area that needs recompositing
+    SDL_Rect moveTo(int x, int y);
+    
+    // Blend the paste on top of a row of premultiplied pixels that starts at the given canvas position
+    void blendOver(Uint32* row, int x, int y, int count) const;
+    
+    // Merge the paste into an image and stop floating, returns the area that changed
+    SDL_Rect commit(TiledImage& image);
+    
+    // Stop floating without changing anything, returns the area that needs recompositing
+    SDL_Rect discard();
+    
+    // Area covered by the paste, which can reach past the edges of the canvas
+    SDL_Rect area() const;
+    
+    // Pasted pixels, shared with the clipboard
+    const std::shared_ptr<const ClipboardImage>& image() const { return pasted; }
+    
+    // Is an image currently floating?
+    bool active() const { return pasted != nullptr; }
+
+private:
+    std::shared_ptr<const ClipboardImage> pasted;
+    int x = 0, y = 0;
+};
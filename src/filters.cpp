@@ -0,0 +1,272 @@
+#include "filters.hpp"
+#include "pool.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The AVX2 kernel is compiled for AVX2 on its own and only called if the CPU supports it,
+// so the rest of the program still runs on any x86 CPU
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FILTERS_AVX2
+#include <immintrin.h>
+#endif
+
+// Names of each filter, in the same order as the enum
+const char* filter_names[3] = {"Gaussian Blur", "Unsharp Mask", "Edge Detect"};
+
+// Radii of the three box blurs that together come closest to a gaussian blur with the given standard deviation
+// Boxes are a mix of two sizes, picked so the variance of the three boxes adds up to sigma^2
+static void boxRadii(float sigma, int radii[3]) {
+    // Ideal width if all three boxes were the same, rounded down to an odd number
+    float ideal = std::sqrt(12 * sigma * sigma / 3 + 1);
+    int lower = (int)std::floor(ideal);
+    if (lower % 2 == 0) lower--;
+    int upper = lower + 2;
+    
+    // How many boxes use the smaller width
+    float lower_count = (12 * sigma * sigma - 3 * lower * lower - 12 * lower - 9) / (-4.0f * lower - 4);
+    int m = std::round(lower_count);
+    
+    for (int i = 0; i < 3; i++) radii[i] = ((i < m ? lower : upper) - 1) / 2;
+}
+
+// Box blur rows y0 to y1 of src horizontally into dst
+// Keeps a running sum of the pixels under the box, so every pixel costs one add and one subtract no matter the radius
+static void boxBlurRows(const Uint32* src, Uint32* dst, int w, int y0, int y1, int r) {
+    float inv = 1.0f / (2 * r + 1);
+    
+    for (int y = y0; y < y1; y++) {
+        const Uint32* in = &src[y * w];
+        Uint32* out = &dst[y * w];
+
+#ifdef __SSE2__
+        // All 4 channels of a pixel are summed at once, with one 32-bit lane per channel
+        const __m128i zero = _mm_setzero_si128();
+        const __m128 scale = _mm_set1_ps(inv);
+        auto widen = [&](Uint32 pixel) { return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero); };
+        
+        // Start with the box centered on the first pixel, where everything to the left is a copy of the first pixel
+        __m128i sum = zero;
+        for (int i = -r; i <= r; i++) sum = _mm_add_epi32(sum, widen(in[std::clamp(i, 0, w - 1)]));
+        
+        for (int x = 0; x < w; x++) {
+            // Divide by the box width and pack the channels back down to bytes
+            __m128i v = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sum), scale));
+            v = _mm_packs_epi32(v, v);
+            out[x] = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+            
+            // Slide the box one pixel to the right
+            sum = _mm_add_epi32(sum, _mm_sub_epi32(widen(in[std::min(x + r + 1, w - 1)]), widen(in[std::max(x - r, 0)])));
+        }
+#else
+        // Scalar version, one sum per channel
+        int sum[4] = {0, 0, 0, 0};
+        for (int i = -r; i <= r; i++) {
+            for (int c = 0; c < 4; c++) sum[c] += (in[std::clamp(i, 0, w - 1)] >> (c * 8)) & 0xFF;
+        }
+        
+        for (int x = 0; x < w; x++) {
+            Uint32 pixel = 0;
+            for (int c = 0; c < 4; c++) pixel |= (Uint32)std::lrintf(sum[c] * inv) << (c * 8);
+            out[x] = pixel;
+            
+            Uint32 add = in[std::min(x + r + 1, w - 1)], sub = in[std::max(x - r, 0)];
+            for (int c = 0; c < 4; c++) sum[c] += (int)((add >> (c * 8)) & 0xFF) - (int)((sub >> (c * 8)) & 0xFF);
+        }
+#endif
+    }
+}
+
+// One row of a vertical box blur: write out the current sums divided by the box width, then slide the box down a row
+// Works on bytes (channels) instead of pixels, since every channel of every column has its own sum
+static void columnStep(int* sums, Uint8* out, const Uint8* add, const Uint8* sub, int count, float inv) {
+    for (int i = 0; i < count; i++) {
+        out[i] = (Uint8)std::lrintf(sums[i] * inv);
+        sums[i] += add[i] - sub[i];
+    }
+}
+
+#ifdef FILTERS_AVX2
+// AVX2 version of columnStep(), which handles 8 channels (2 pixels) at a time
+__attribute__((target("avx2")))
+static void columnStepAVX2(int* sums, Uint8* out, const Uint8* add, const Uint8* sub, int count, float inv) {
+    const __m256 scale = _mm256_set1_ps(inv);
+    int i = 0;
+    
+    for (; i + 8 <= count; i += 8) {
+        __m256i sum = _mm256_loadu_si256((const __m256i*)&sums[i]);
+        
+        // Divide by the box width and pack the 8 results down to bytes
+        __m256i v = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(sum), scale));
+        __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        _mm_storel_epi64((__m128i*)&out[i], _mm_packus_epi16(packed, packed));
+        
+        // Widen the bytes entering and leaving the box to 32 bits and update the sums
+        __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&add[i]));
+        __m256i s = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&sub[i]));
+        _mm256_storeu_si256((__m256i*)&sums[i], _mm256_add_epi32(sum, _mm256_sub_epi32(a, s)));
+    }
+    
+    // Remaining channels
+    columnStep(&sums[i], &out[i], &add[i], &sub[i], count - i, inv);
+}
+#endif
+
+// Box blur columns x0 to x1 of src vertically into dst
+// Rows are walked top to bottom across the whole band of columns, so memory is read in order a row at a time
+static void boxBlurColumns(const Uint32* src, Uint32* dst, int w, int h, int x0, int x1, int r) {
+    float inv = 1.0f / (2 * r + 1);
+    int count = (x1 - x0) * 4;
+    
+    // Checked once, the answer never changes
+    static const bool use_avx2 = SDL_HasAVX2();
+    
+    // Row of the band as bytes, rows past the top or bottom are copies of the edge row
+    auto row = [&](int y) { return (const Uint8*)&src[std::clamp(y, 0, h - 1) * w + x0]; };
+    
+    // Start with the box centered on the first row
+    std::vector<int> sums(count, 0);
+    for (int i = -r; i <= r; i++) {
+        const Uint8* in = row(i);
+        for (int c = 0; c < count; c++) sums[c] += in[c];
+    }
+    
+    for (int y = 0; y < h; y++) {
+        Uint8* out = (Uint8*)&dst[y * w + x0];
+#ifdef FILTERS_AVX2
+        if (use_avx2) {
+            columnStepAVX2(sums.data(), out, row(y + r + 1), row(y - r), count, inv);
+            continue;
+        }
+#endif
+        columnStep(sums.data(), out, row(y + r + 1), row(y - r), count, inv);
+    }
+}
+
+// Gaussian blur, approximated by three box blurs in a row
+void gaussianBlur(Uint32* pixels, int w, int h, float radius) {
+    PROFILE_SCOPE("gaussianBlur");
+    
+    if (w == 0 || h == 0 || radius <= 0) return;
+    
+    int radii[3];
+    boxRadii(radius, radii);
+    
+    // Every pass reads one buffer and writes the other, since the running sums need the unblurred pixels
+    // There's an even number of passes, so the result ends up back in pixels
+    PooledBuffer scratch((size_t)w * h * sizeof(Uint32));
+    Uint32* a = pixels;
+    Uint32* b = scratch.pixels();
+    
+    // A 2D box blur is a horizontal box blur followed by a vertical one
+    for (int i = 0; i < 3; i++) {
+        parallelFor(h, [&](int y0, int y1) {
+            TRACE_SCOPE("blurRows");
+            boxBlurRows(a, b, w, y0, y1, radii[i]);
+        });
+        std::swap(a, b);
+    }
+    for (int i = 0; i < 3; i++) {
+        parallelFor(w, [&](int x0, int x1) {
+            TRACE_SCOPE("blurColumns");
+            boxBlurColumns(a, b, w, h, x0, x1, radii[i]);
+        });
+        std::swap(a, b);
+    }
+}
+
+// Sharpen by adding back the difference between the image and a blurred copy of it
+void unsharpMask(Uint32* pixels, int w, int h, float radius, float amount, int threshold) {
+    PROFILE_SCOPE("unsharpMask");
+    
+    if (w == 0 || h == 0) return;
+    
+    PooledBuffer blurred((size_t)w * h * sizeof(Uint32));
+    std::memcpy(blurred.data(), pixels, blurred.size());
+    gaussianBlur(blurred.pixels(), w, h, radius);
+    
+    parallelFor(h, [&](int y0, int y1) {
+        TRACE_SCOPE("unsharpRows");
+        
+        for (int i = y0 * w; i < y1 * w; i++) {
+            Uint32 original = pixels[i], blur = blurred.pixels()[i];
+            
+            // Sharpen a single channel, differences under the threshold are left alone so noise isn't sharpened
+            auto sharpen = [&](int shift, int max) {
+                int o = (original >> shift) & 0xFF, b = (blur >> shift) & 0xFF;
+                int diff = o - b;
+                if (std::abs(diff) >= threshold) o = std::lround(o + diff * amount);
+                return std::clamp(o, 0, max);
+            };
+            
+            // Alpha goes first, since premultiplied colors can't be bigger than it
+            int alpha = sharpen(0, 255);
+            pixels[i] = ((Uint32)sharpen(24, alpha) << 24) | ((Uint32)sharpen(16, alpha) << 16) | ((Uint32)sharpen(8, alpha) << 8) | alpha;
+        }
+    });
+}
+
+// Replace every pixel with how strongly each color channel changes around it
+void sobelEdges(Uint32* pixels, int w, int h) {
+    PROFILE_SCOPE("sobelEdges");
+    
+    if (w == 0 || h == 0) return;
+    
+    // Neighbors have to be read from the original image, not from pixels that were already replaced
+    PooledBuffer original((size_t)w * h * sizeof(Uint32));
+    std::memcpy(original.data(), pixels, original.size());
+    const Uint32* src = original.pixels();
+    
+    parallelFor(h, [&](int y0, int y1) {
+        TRACE_SCOPE("sobelRows");
+        
+        for (int y = y0; y < y1; y++) {
+            // Rows above and below, the edge rows are their own neighbors
+            const Uint32* rows[3] = {&src[std::max(y - 1, 0) * w], &src[y * w], &src[std::min(y + 1, h - 1) * w]};
+            
+            for (int x = 0; x < w; x++) {
+                int xs[3] = {std::max(x - 1, 0), x, std::min(x + 1, w - 1)};
+                int alpha = src[y * w + x] & 0xFF;
+                
+                Uint32 result = alpha;
+                for (int shift = 8; shift <= 24; shift += 8) {
+                    auto p = [&](int row, int col) { return (int)((rows[row][xs[col]] >> shift) & 0xFF); };
+                    
+                    // Horizontal and vertical gradient of the channel
+                    int gx = (p(0, 2) + 2 * p(1, 2) + p(2, 2)) - (p(0, 0) + 2 * p(1, 0) + p(2, 0));
+                    int gy = (p(2, 0) + 2 * p(2, 1) + p(2, 2)) - (p(0, 0) + 2 * p(0, 1) + p(0, 2));
+                    
+                    // Capped at alpha so the pixel stays properly premultiplied
+                    int magnitude = std::min((int)std::lround(std::sqrt((float)(gx * gx + gy * gy))), alpha);
+                    result |= (Uint32)magnitude << shift;
+                }
+                pixels[y * w + x] = result;
+            }
+        }
+    });
+}
+
+// Run the filter the settings describe
+void applyFilter(Uint32* pixels, int w, int h, const FilterSettings& settings) {
+    switch (settings.type) {
+        case FilterType::GaussianBlur:
+            gaussianBlur(pixels, w, h, settings.radius);
+            break;
+        case FilterType::UnsharpMask:
+            unsharpMask(pixels, w, h, settings.radius, settings.amount, settings.threshold);
+            break;
+        case FilterType::EdgeDetect:
+            sobelEdges(pixels, w, h);
+            break;
+    }
+}
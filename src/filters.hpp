@@ -0,0 +1,37 @@
+#pragma once
+
+#include <SDL3/SDL.h>
+
+// Convolution filters that run on the CPU on a flat image of w*h premultiplied RGBA8888 pixels with no padding
+// Every filter splits the image between one thread per CPU core. Pixels past the edge of the image count as
+// copies of the nearest edge pixel, so the edges of the image don't get darker.
+
+// Which filter to run
+enum class FilterType {
+    GaussianBlur,
+    UnsharpMask,
+    EdgeDetect
+};
+
+// Names of each filter, in the same order as the enum
+extern const char* filter_names[3];
+
+// Everything a filter needs to know, not every filter uses every setting
+struct FilterSettings {
+    FilterType type = FilterType::GaussianBlur;
+    float radius = 2;       // Standard deviation of the blur in pixels, for the blur and unsharp mask
+    float amount = 1;       // How much of the difference from the blurred image is added back, for unsharp mask
+    int threshold = 0;      // Smallest difference from the blurred image that gets sharpened (0 to 255), for unsharp mask
+};
+
+// Gaussian blur, approximated by three box blurs in a row which takes the same time no matter how big the radius is
+void gaussianBlur(Uint32* pixels, int w, int h, float radius);
+
+// Sharpen by adding back the difference between the image and a blurred copy of it
+void unsharpMask(Uint32* pixels, int w, int h, float radius, float amount, int threshold);
+
+// Replace every pixel with how strongly each color channel changes around it, alpha stays the same
+void sobelEdges(Uint32* pixels, int w, int h);
+
+// Run the filter the settings describe
+void applyFilter(Uint32* pixels, int w, int h, const FilterSettings& settings);
@@ -1,15 +1,23 @@
 #include "gui.hpp"
 #include "utils.hpp"
+#include "profiler.hpp"
 
 #include <imgui.h>
 #include <imgui_impl_sdl3.h>
 #include <imgui_impl_sdlrenderer3.h>
 #include <SDL3/SDL.h>
 
+#include <cmath>
+#include <vector>
+#include <string>
+#include <algorithm>
+
 
 // Updates the state with meta information about the graphical state and window, such as window events and mouse position
 // Should be called after ImGui frame is created, since some values aren't valid if not inside a frame
 void guiUpdateStateMeta(State* state) {
+    PROFILE_SCOPE("guiUpdateStateMeta");
+    
     // Iterate over any events that occured since last frame e.g. keyboard/mouse input
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
@@ -18,8 +26,19 @@ void guiUpdateStateMeta(State* state) {
         if (event.type == SDL_EVENT_QUIT)
             // If user clicked the X in the top right of the window
             state->should_quit = true;
+        else if (event.type == SDL_EVENT_PEN_DOWN)
+            // Pen started touching the tablet
+            state->pen_info.down = true;
+        else if (event.type == SDL_EVENT_PEN_UP)
+            // Pen was lifted off the tablet, so the mouse fallback of full pressure is used again
+            state->pen_info.down = false;
+        else if (event.type == SDL_EVENT_PEN_AXIS && event.paxis.axis == SDL_PEN_AXIS_PRESSURE)
+            // Pen pressure changed
+            state->pen_info.pressure = event.paxis.value;
     }
     
+    // SDL also sends mouse events for the pen, so the mouse position below follows the pen as well
+    
     // Save the window width and height in the state struct
     SDL_GetWindowSize(state->gui_resource->window, &state->window_width, &state->window_height);
     
@@ -64,8 +83,24 @@ void drawMainMenuBar(State* state) {
             // "Open" button
             if (ImGui::MenuItem("Open")) state->file_action_info.status = FileActionInfo::DoOpen;
             
-            // "Save As" button
-            if (ImGui::MenuItem("Save As")) state->file_action_info.status = FileActionInfo::DoSaveAs;
+            // "Save As" button, opens a window with format options before asking where to save
+            if (ImGui::MenuItem("Save As")) {
+                state->show_save_window = true;
+                state->save_estimate_dirty = true;
+            }
+            
+            // Export buttons, save a bigger copy without changing the canvas
+            if (ImGui::MenuItem("Export at 2x")) {
+                state->file_action_info.status = FileActionInfo::DoExportScaled;
+                state->file_action_info.export_scale = 2;
+            }
+            if (ImGui::MenuItem("Export at 4x")) {
+                state->file_action_info.status = FileActionInfo::DoExportScaled;
+                state->file_action_info.export_scale = 4;
+            }
+            
+            // Export with a reduced palette, opens a window with palette options
+            if (ImGui::MenuItem("Export Indexed PNG")) state->show_export_indexed_window = true;
             
             // "Exit" button
             if (ImGui::MenuItem("Exit")) state->should_quit = true; // Quit the program
@@ -74,28 +109,154 @@ void drawMainMenuBar(State* state) {
             ImGui::EndMenu();
         }
         
+        // Edit menu, the same actions can also be done with the keyboard shortcuts shown next to them
+        if (ImGui::BeginMenu("Edit")) {
+            if (ImGui::MenuItem("Copy", "Ctrl+C")) state->edit_action_info.status = EditActionInfo::DoCopy;
+            if (ImGui::MenuItem("Paste", "Ctrl+V")) state->edit_action_info.status = EditActionInfo::DoPaste;
+            
+            // Only enabled while a paste is floating
+            if (ImGui::MenuItem("Commit Paste", "Enter", false, state->paste.active())) state->edit_action_info.status = EditActionInfo::DoCommitPaste;
+            if (ImGui::MenuItem("Discard Paste", "Esc", false, state->paste.active())) state->edit_action_info.status = EditActionInfo::DoDiscardPaste;
+            
+            // End of Edit menu
+            ImGui::EndMenu();
+        }
+        
         // Image menu
         if (ImGui::BeginMenu("Image")) {
             // "Resize" button
             if (ImGui::MenuItem("Resize")) state->show_resize_window = true; // Open window with resize options if clicked
             
+            // "Canvas Size" button
+            if (ImGui::MenuItem("Canvas Size")) state->show_canvas_size_window = true; // Open window with canvas size options if clicked
+            
+            // Rotate and flip buttons
+            auto transformItem = [state](const char* label, ImageTransform transform) {
+                if (ImGui::MenuItem(label)) {
+                    state->image_action_info.status = ImageActionInfo::DoTransform;
+                    state->image_action_info.transform = transform;
+                }
+            };
+            ImGui::Separator();
+            transformItem("Rotate 90 Clockwise", ImageTransform::Rotate90);
+            transformItem("Rotate 180", ImageTransform::Rotate180);
+            transformItem("Rotate 90 Counter-Clockwise", ImageTransform::Rotate270);
+            transformItem("Flip Horizontal", ImageTransform::FlipHorizontal);
+            transformItem("Flip Vertical", ImageTransform::FlipVertical);
+            ImGui::Separator();
+            
+            // "Adjustments" button
+            if (ImGui::MenuItem("Adjustments")) {
+                state->image_action_info.adjust_info = AdjustmentSettings{}; // Start from no change every time
+                state->show_adjust_window = true;
+                state->adjust_preview_dirty = true;
+            }
+            
+            // Filters submenu, every filter opens the filter window with its own settings
+            if (ImGui::BeginMenu("Filters")) {
+                for (int i = 0; i < 3; i++) {
+                    if (ImGui::MenuItem(filter_names[i])) {
+                        state->image_action_info.filter_info.type = (FilterType)i;
+                        state->show_filter_window = true;
+                        state->filter_preview_dirty = true;
+                    }
+                }
+                ImGui::EndMenu();
+            }
+            
             // End of Image menu
             ImGui::EndMenu();
         }
         
-        // Now that we've rendered the menu at the top, we can fill in some more parameters about the viewport size.
-        state->viewport.y = ImGui::GetWindowHeight(); // Y coordinate is at the bottom of this window (menu bar).
+        // Select menu
+        if (ImGui::BeginMenu("Select")) {
+            if (ImGui::MenuItem("All")) state->select_action_info.status = SelectActionInfo::DoSelectAll;
+            if (ImGui::MenuItem("Deselect")) state->select_action_info.status = SelectActionInfo::DoDeselect;
+            if (ImGui::MenuItem("Invert")) state->select_action_info.status = SelectActionInfo::DoInvert;
+            
+            // End of Select menu
+            ImGui::EndMenu();
+        }
         
-        // Bottom of the viewport is the bottom of the window, so total height is window height - y coordinate.
-        // Note that the ImVec4 struct stores its values as x, y, z, w and we're using it as x, y, width, height,
-        // so the "w" represents height and not width here.
-        state->viewport.w = state->window_height - ImGui::GetWindowHeight();
+        // View menu, only has debugging tools for now
+        if (ImGui::BeginMenu("View")) {
+#ifdef PAINT_PROFILER
+            ImGui::MenuItem("Profiler", nullptr, &state->show_profiler_window);
+#endif
+            ImGui::MenuItem("Memory", nullptr, &state->show_memory_window);
+            
+            // End of View menu
+            ImGui::EndMenu();
+        }
+
+        // Now that we've rendered the menu at the top, we know where the document tabs go
+        state->menu_bar_height = ImGui::GetWindowHeight();
         
         // End of menu bar
         ImGui::EndMainMenuBar();
     }
 }
 
+// Check the keyboard shortcuts of the Edit menu
+// Ignored while the user is typing into a text field, so they don't get in the way of copying text
+void handleShortcuts(State* state) {
+    if (ImGui::GetIO().WantTextInput) return;
+    
+    bool ctrl = ImGui::GetIO().KeyCtrl;
+    if (ctrl && ImGui::IsKeyPressed(ImGuiKey_C, false)) state->edit_action_info.status = EditActionInfo::DoCopy;
+    if (ctrl && ImGui::IsKeyPressed(ImGuiKey_V, false)) state->edit_action_info.status = EditActionInfo::DoPaste;
+    
+    if (!state->paste.active()) return;
+    if (ImGui::IsKeyPressed(ImGuiKey_Enter, false) || ImGui::IsKeyPressed(ImGuiKey_KeypadEnter, false)) state->edit_action_info.status = EditActionInfo::DoCommitPaste;
+    if (ImGui::IsKeyPressed(ImGuiKey_Escape, false)) state->edit_action_info.status = EditActionInfo::DoDiscardPaste;
+}
+
+// Draw a tab for every open document under the menu bar, to the left of the right menu
+// Clicking a tab switches to that document, and its close button closes it
+void drawDocumentTabs(State* state) {
+    ImGui::SetNextWindowPos(ImVec2(0, state->menu_bar_height));
+    ImGui::SetNextWindowSize(ImVec2(state->window_width - state->right_menu_width, 0));
+    
+    ImGui::Begin("Documents", nullptr,
+        ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoScrollbar | ImGuiWindowFlags_NoBringToFrontOnFocus);
+    
+    if (ImGui::BeginTabBar("DocumentTabs", ImGuiTabBarFlags_Reorderable | ImGuiTabBarFlags_FittingPolicyScroll)) {
+        for (int i = 0; i < (int)state->documents.size(); i++) {
+            Document& document = *state->documents[i];
+            
+            // The ID after ### stays the same when documents are renamed or the ones before it are closed
+            std::string label = document.name + "###Document" + std::to_string(document.id);
+            
+            // Force the active document's tab to be selected if the backend switched to it, e.g. after opening a file
+            ImGuiTabItemFlags flags = (state->select_tab && i == state->active_document) ? ImGuiTabItemFlags_SetSelected : 0;
+            
+            bool open = true;
+            bool selected = ImGui::BeginTabItem(label.c_str(), &open, flags);
+            if (selected) ImGui::EndTabItem();
+            
+            // Closing takes priority over switching, since the tab being closed might also be the one that's selected
+            if (!open) {
+                state->document_action_info.status = DocumentActionInfo::DoClose;
+                state->document_action_info.index = i;
+            } else if (selected && i != state->active_document && !state->select_tab && state->document_action_info.status == DocumentActionInfo::None) {
+                state->document_action_info.status = DocumentActionInfo::DoSwitch;
+                state->document_action_info.index = i;
+            }
+        }
+        ImGui::EndTabBar();
+    }
+    state->select_tab = false;
+    
+    // The viewport starts under the tabs and goes to the bottom of the window
+    // Note that the ImVec4 struct stores its values as x, y, z, w and we're using it as x, y, width, height,
+    // so the "w" represents height and not width here.
+    state->viewport.y = state->menu_bar_height + ImGui::GetWindowHeight();
+    state->viewport.w = state->window_height - state->viewport.y;
+    
+    // End of document tabs
+    ImGui::End();
+}
+
 // Draw the resize window if the user select Image->Resize in the menu bar
 void drawResizeWindow(State* state) {
     // Exit early if window is hidden
@@ -145,6 +306,181 @@ void drawResizeWindow(State* state) {
     ImGui::End();
 }
 
+// Draw the canvas size window if the user selects Image->Canvas Size in the menu bar
+// Similar to the resize window, but the content is cropped or extended instead of stretched
+void drawCanvasSizeWindow(State* state) {
+    // Exit early if window is hidden
+    if (!state->show_canvas_size_window) {
+        return;
+    }
+    
+    // Let ImGui determine best window size based on contents
+    ImGui::SetNextWindowSize(ImVec2(0, 0));
+    
+    // Start of window
+    ImGui::Begin("Canvas Size", &state->show_canvas_size_window);
+    
+    // Variable aliases
+    auto& info = state->image_action_info.canvas_size_info;
+    float& width_f = info.size.x;
+    float& height_f = info.size.y;
+    
+    // The text box should accept an int but it needs to be converted to a float
+    int width_i = width_f, height_i = height_f;
+    
+    // Input text boxes
+    ImGui::InputInt("New Width", &width_i, 0, 0, 0);
+    ImGui::InputInt("New Height", &height_i, 0, 0, 0);
+    
+    // Make sure size is at least 1x1
+    if (width_i < 1) width_i = 1;
+    if (height_i < 1) height_i = 1;
+    
+    // Save text box values back to canvas_size_info.size
+    width_f = width_i, height_f = height_i;
+    
+    // 3x3 grid of buttons to pick the anchor, the selected one is marked with an "X"
+    ImGui::Text("Anchor");
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            // Anchor that this button represents, as a fraction of the canvas size
+            ImVec2 this_anchor{col / 2.0f, row / 2.0f};
+            bool selected = info.anchor.x == this_anchor.x && info.anchor.y == this_anchor.y;
+            
+            // Buttons need unique IDs even though some share the same label
+            ImGui::PushID(row * 3 + col);
+            if (col > 0) ImGui::SameLine();
+            if (ImGui::Button(selected ? "X" : " ", ImVec2(24, 24))) info.anchor = this_anchor;
+            ImGui::PopID();
+        }
+    }
+    
+    // Color used for any newly added area
+    ImGui::ColorEdit3("Fill color", (float*)&info.fill_color);
+    
+    // "OK" button
+    if (ImGui::Button("OK")) {
+        // Let backend know that we want to change the canvas size
+        state->image_action_info.status = ImageActionInfo::DoCanvasSize;
+        state->show_canvas_size_window = false;
+    }
+    
+    // Create "Cancel" button on same line as "OK" button
+    ImGui::SameLine();
+    if (ImGui::Button("Cancel")) state->show_canvas_size_window = false; // Hide window without changing the canvas size
+    
+    // End of canvas size window
+    ImGui::End();
+}
+
+// Draw the filter window if the user selects a filter from Image->Filters in the menu bar
+// Shows a small preview of the active layer with the filter applied, which updates as the settings are changed
+void drawFilterWindow(State* state) {
+    // Exit early if window is hidden
+    if (!state->show_filter_window) {
+        return;
+    }
+    
+    // Let ImGui determine best window size based on contents
+    ImGui::SetNextWindowSize(ImVec2(0, 0));
+    
+    // Alias
+    FilterSettings& info = state->image_action_info.filter_info;
+    
+    // Start of window, the ID after ### stays the same so switching filters doesn't open a new window
+    std::string title = std::string(filter_names[(int)info.type]) + "###Filter";
+    ImGui::Begin(title.c_str(), &state->show_filter_window);
+    
+    // Only show the settings this filter uses, and update the preview if any of them changed
+    bool changed = false;
+    if (info.type == FilterType::GaussianBlur || info.type == FilterType::UnsharpMask) {
+        changed |= ImGui::SliderFloat("Radius", &info.radius, 0.1f, 250, "%.1f px", ImGuiSliderFlags_Logarithmic);
+    }
+    if (info.type == FilterType::UnsharpMask) {
+        changed |= ImGui::SliderFloat("Amount", &info.amount, 0, 5, "%.2f");
+        changed |= ImGui::SliderInt("Threshold", &info.threshold, 0, 255);
+    }
+    if (changed) state->filter_preview_dirty = true;
+    
+    // Preview, which is a scaled down copy so it stays quick to update even on a huge canvas
+    if (state->filter_preview.get() != nullptr) {
+        ImGui::Image((ImTextureID)state->filter_preview.get(), state->filter_preview.size());
+    }
+    
+    // "OK" button
+    if (ImGui::Button("OK")) {
+        // Let backend know that we want to run the filter on the full size layer
+        state->image_action_info.status = ImageActionInfo::DoFilter;
+        state->show_filter_window = false;
+    }
+    
+    // Create "Cancel" button on same line as "OK" button
+    ImGui::SameLine();
+    if (ImGui::Button("Cancel")) state->show_filter_window = false; // Hide window without changing the layer
+    
+    // End of filter window
+    ImGui::End();
+}
+
+// Draw the adjustments window if the user selects Image->Adjustments in the menu bar
+// The adjustments are previewed on the canvas while this window is open
+void drawAdjustWindow(State* state) {
+    // Exit early if window is hidden
+    if (!state->show_adjust_window) {
+        return;
+    }
+    
+    // Let ImGui determine best window size based on contents
+    ImGui::SetNextWindowSize(ImVec2(0, 0));
+    
+    // Start of window
+    ImGui::Begin("Adjustments", &state->show_adjust_window);
+    
+    // Alias
+    AdjustmentSettings& info = state->image_action_info.adjust_info;
+    
+    // Update the preview if any setting changed
+    bool changed = false;
+    
+    ImGui::SeparatorText("Hue/Saturation");
+    changed |= ImGui::SliderFloat("Hue", &info.hue, -180, 180, "%.0f deg");
+    changed |= ImGui::SliderFloat("Saturation", &info.saturation, -100, 100, "%.0f%%");
+    
+    ImGui::SeparatorText("Levels");
+    changed |= ImGui::SliderInt("Input black", &info.input_black, 0, 254);
+    changed |= ImGui::SliderInt("Input white", &info.input_white, 1, 255);
+    changed |= ImGui::SliderFloat("Gamma", &info.gamma, 0.1f, 10, "%.2f", ImGuiSliderFlags_Logarithmic);
+    changed |= ImGui::SliderInt("Output black", &info.output_black, 0, 255);
+    changed |= ImGui::SliderInt("Output white", &info.output_white, 0, 255);
+    
+    // Keep the input range from being empty
+    if (info.input_white <= info.input_black) info.input_white = info.input_black + 1;
+    
+    ImGui::SeparatorText("Curves");
+    changed |= ImGui::SliderInt("Shadows", &info.curve[0], 0, 255);
+    changed |= ImGui::SliderInt("Midtones", &info.curve[1], 0, 255);
+    changed |= ImGui::SliderInt("Highlights", &info.curve[2], 0, 255);
+    
+    ImGui::Separator();
+    changed |= ImGui::Checkbox("Invert", &info.invert);
+    
+    if (changed) state->adjust_preview_dirty = true;
+    
+    // "OK" button
+    if (ImGui::Button("OK")) {
+        // Let backend know that we want to apply the adjustments to the full size layer
+        state->image_action_info.status = ImageActionInfo::DoAdjust;
+        state->show_adjust_window = false;
+    }
+    
+    // Create "Cancel" button on same line as "OK" button
+    ImGui::SameLine();
+    if (ImGui::Button("Cancel")) state->show_adjust_window = false; // Hide window, the preview goes away with it
+    
+    // End of adjustments window
+    ImGui::End();
+}
+
 // Draw the "New File" window if user selects File->New in the menu bar
 // Most of this is pretty similar to the resize window dialog
 void drawNewFileWindow(State* state) {
@@ -192,14 +528,330 @@ void drawNewFileWindow(State* state) {
     ImGui::End();
 }
 
+// Draw the save window if the user selects File->Save As in the menu bar
+// Shows an estimate of the file size and encode time, which updates whenever an option is changed
+void drawSaveWindow(State* state) {
+    // Exit early if window is hidden
+    if (!state->show_save_window) {
+        return;
+    }
+    
+    // Let ImGui determine best window size based on contents
+    ImGui::SetNextWindowSize(ImVec2(0, 0));
+    
+    // Start of window
+    ImGui::Begin("Save As", &state->show_save_window);
+    
+    // Alias
+    SaveOptions& options = state->file_action_info.save_options;
+    
+    // Sliders and color pickers only update the estimate once they're let go of, since encoding the sample isn't free
+    bool changed = false;
+    
+    // Format buttons
+    int format = (int)options.format;
+    changed |= ImGui::RadioButton("PNG", &format, (int)ImageFormat::PNG);
+    ImGui::SameLine();
+    changed |= ImGui::RadioButton("JPG", &format, (int)ImageFormat::JPG);
+    options.format = (ImageFormat)format;
+    
+    // Only show the options this format uses
+    if (options.format == ImageFormat::JPG) {
+        ImGui::SliderInt("Quality", &options.jpg_quality, 1, 100);
+        changed |= ImGui::IsItemDeactivatedAfterEdit();
+        
+        // stb_image_write picks chroma subsampling from the quality
+        ImGui::Text("Chroma subsampling: %s", options.jpg_quality <= 90 ? "4:2:0" : "4:4:4 (above quality 90)");
+    } else {
+        ImGui::SliderInt("Compression", &options.png_compression, 5, 20);
+        changed |= ImGui::IsItemDeactivatedAfterEdit();
+        
+        changed |= ImGui::Checkbox("Flatten Alpha", &options.flatten_alpha);
+    }
+    
+    // Transparent pixels are blended over this color, JPGs are always flattened
+    if (options.flatten_alpha || options.format == ImageFormat::JPG) {
+        ImGui::ColorEdit3("Background", options.background);
+        changed |= ImGui::IsItemDeactivatedAfterEdit();
+    }
+    
+    if (changed) state->save_estimate_dirty = true;
+    
+    // Estimate from the last time an option changed
+    ImGui::Separator();
+    ImGui::Text("Estimated size: %.1f KiB", state->save_estimate.bytes / 1024.0);
+    ImGui::Text("Estimated encode time: %.0f ms", state->save_estimate.ms);
+    
+    // "OK" button
+    if (ImGui::Button("OK")) {
+        // Let backend know that we want to save, it asks where to save the file
+        state->file_action_info.status = FileActionInfo::DoSaveAs;
+        state->show_save_window = false;
+    }
+    
+    // Create "Cancel" button on same line as "OK" button
+    ImGui::SameLine();
+    if (ImGui::Button("Cancel")) state->show_save_window = false; // Hide window without saving
+    
+    // End of save window
+    ImGui::End();
+}
+
+// Draw the recovery window on startup if the last session didn't close properly
+// It has no close button, since autosave doesn't start until one of the options is picked
+void drawRecoverWindow(State* state) {
+    // Exit early if window is hidden
+    if (!state->show_recover_window) {
+        return;
+    }
+    
+    // Let ImGui determine best window size based on contents
+    ImGui::SetNextWindowSize(ImVec2(0, 0));
+    
+    // Start of window
+    ImGui::Begin("Recover Session");
+    ImGui::Text("Paint didn't close properly last time.");
+    ImGui::Text("Recover the autosaved images from that session?");
+    
+    // "Recover" button
+    if (ImGui::Button("Recover")) {
+        state->file_action_info.status = FileActionInfo::DoRecover;
+        state->show_recover_window = false;
+    }
+    
+    // Create "Discard" button on same line as "Recover" button
+    ImGui::SameLine();
+    if (ImGui::Button("Discard")) {
+        state->file_action_info.status = FileActionInfo::DoDiscardRecovery;
+        state->show_recover_window = false;
+    }
+    
+    // End of recovery window
+    ImGui::End();
+}
+
+// Draw the indexed export window if the user selects File->Export Indexed PNG in the menu bar
+void drawExportIndexedWindow(State* state) {
+    // Exit early if window is hidden
+    if (!state->show_export_indexed_window) {
+        return;
+    }
+    
+    // Let ImGui determine best window size based on contents
+    ImGui::SetNextWindowSize(ImVec2(0, 0));
+    
+    // Start of window
+    ImGui::Begin("Export Indexed PNG", &state->show_export_indexed_window);
+    
+    // Alias
+    SaveOptions& options = state->file_action_info.indexed_options;
+    
+    // Palette options, images with few enough colors keep them exactly and aren't dithered
+    ImGui::SliderInt("Colors", &options.palette_colors, 2, 256);
+    ImGui::Checkbox("Dither", &options.dither);
+    
+    // "OK" button
+    if (ImGui::Button("OK")) {
+        // Let backend know that we want to export, it asks where to save the file
+        state->file_action_info.status = FileActionInfo::DoExportIndexed;
+        state->show_export_indexed_window = false;
+    }
+    
+    // Create "Cancel" button on same line as "OK" button
+    ImGui::SameLine();
+    if (ImGui::Button("Cancel")) state->show_export_indexed_window = false; // Hide window without exporting
+    
+    // End of export window
+    ImGui::End();
+}
+
+#ifdef PAINT_PROFILER
+// Window with frame times and how long each stage of the frame takes, opened from "View->Profiler"
+void drawProfilerWindow(State* state) {
+    if (!state->show_profiler_window) return;
+    
+    // Copy the history so it can be sorted for percentiles
+    // Static since it's too big to put on the stack every frame
+    static ProfilerFrame frames[profiler_history];
+    Profiler& profiler = Profiler::get();
+    int count = profiler.copyFrames(frames, profiler_history);
+    
+    if (ImGui::Begin("Profiler", &state->show_profiler_window) && count > 0) {
+        // Frame time graph in milliseconds
+        float frame_ms[profiler_history];
+        for (int i = 0; i < count; i++) frame_ms[i] = Profiler::toMs(frames[i].duration);
+        ImGui::PlotLines("##Frame times", frame_ms, count, 0, "Frame time (ms)", 0, 50, ImVec2(0, 80));
+        
+        // Pick a percentile out of an array of times, the array gets reordered
+        auto percentile = [](float* values, int n, float p) {
+            int index = std::min((int)(p * n), n - 1);
+            std::nth_element(values, values + index, values + n);
+            return values[index];
+        };
+        
+        // Stalls are frames that took much longer than usual
+        float sorted_ms[profiler_history];
+        std::copy(frame_ms, frame_ms + count, sorted_ms);
+        float median = percentile(sorted_ms, count, 0.5f);
+        int stalls = 0;
+        int last_stall = -1;
+        for (int i = 0; i < count; i++) {
+            if (frame_ms[i] > median * 2) {
+                stalls++;
+                last_stall = i;
+            }
+        }
+        
+        ImGui::Text("Median %.2f ms, %d stalls (over 2x median)", median, stalls);
+        
+        // Trace events are only written when the buffer fills up, this writes them out right away
+        // e.g. right after a stutter so it can be looked at without quitting
+        Tracer& tracer = Tracer::get();
+        if (tracer.enabled()) {
+            if (ImGui::Button("Flush trace")) tracer.flush();
+            ImGui::SameLine();
+            ImGui::Text("%zu events buffered", tracer.bufferedEvents());
+        }
+        
+        // Show which stage was the slowest in the most recent stall
+        if (last_stall >= 0) {
+            int worst = 0;
+            for (int s = 1; s < profiler.stageCount(); s++) {
+                if (frames[last_stall].stage_time[s] > frames[last_stall].stage_time[worst]) worst = s;
+            }
+            ImGui::Text("Last stall: %.2f ms, %d frames ago, mostly %s (%.2f ms)",
+                frame_ms[last_stall], count - 1 - last_stall, profiler.stageName(worst), Profiler::toMs(frames[last_stall].stage_time[worst]));
+        }
+        
+        // Percentiles of every stage
+        if (ImGui::BeginTable("Stages", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+            ImGui::TableSetupColumn("Stage");
+            ImGui::TableSetupColumn("p50 ms");
+            ImGui::TableSetupColumn("p95 ms");
+            ImGui::TableSetupColumn("p99 ms");
+            ImGui::TableSetupColumn("max ms");
+            ImGui::TableHeadersRow();
+            
+            float stage_ms[profiler_history];
+            for (int s = 0; s < profiler.stageCount(); s++) {
+                for (int i = 0; i < count; i++) stage_ms[i] = Profiler::toMs(frames[i].stage_time[s]);
+                
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn(); ImGui::TextUnformatted(profiler.stageName(s));
+                ImGui::TableNextColumn(); ImGui::Text("%.3f", percentile(stage_ms, count, 0.5f));
+                ImGui::TableNextColumn(); ImGui::Text("%.3f", percentile(stage_ms, count, 0.95f));
+                ImGui::TableNextColumn(); ImGui::Text("%.3f", percentile(stage_ms, count, 0.99f));
+                ImGui::TableNextColumn(); ImGui::Text("%.3f", *std::max_element(stage_ms, stage_ms + count));
+            }
+            ImGui::EndTable();
+        }
+    }
+    ImGui::End();
+}
+#endif
+
+// Window with how much pixel memory is in use, opened from "View->Memory"
+void drawMemoryWindow(State* state) {
+    if (!state->show_memory_window) return;
+    
+    if (ImGui::Begin("Memory", &state->show_memory_window)) {
+        if (ImGui::BeginTable("Memory", 4, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+            ImGui::TableSetupColumn("Category");
+            ImGui::TableSetupColumn("Current");
+            ImGui::TableSetupColumn("Count");
+            ImGui::TableSetupColumn("Peak");
+            ImGui::TableHeadersRow();
+            
+            // Sizes are shown in MiB, which is the right scale for canvases
+            const float mib = 1024.0f * 1024.0f;
+            size_t total = 0;
+            for (int i = 0; i < (int)MemoryCategory::Count; i++) {
+                MemoryStats stats = memoryStats((MemoryCategory)i);
+                total += stats.bytes;
+                
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn(); ImGui::TextUnformatted(memory_category_names[i]);
+                ImGui::TableNextColumn(); ImGui::Text("%.2f MiB", stats.bytes / mib);
+                ImGui::TableNextColumn(); ImGui::Text("%zu", stats.count);
+                ImGui::TableNextColumn(); ImGui::Text("%.2f MiB", stats.peak_bytes / mib);
+            }
+            
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn(); ImGui::TextUnformatted("Total");
+            ImGui::TableNextColumn(); ImGui::Text("%.2f MiB", total / mib);
+            ImGui::EndTable();
+        }
+    }
+    ImGui::End();
+}
+
+// Draw the list of layers along with buttons to edit them, as part of the right menu
+void drawLayersPanel(State* state) {
+    // Alias
+    LayerStack& layers = state->doc().layers;
+    
+    ImGui::SeparatorText("Layers");
+    
+    // Buttons that change the layer stack, handled by the backend
+    if (ImGui::Button("Add")) state->layer_action_info.status = LayerActionInfo::DoAdd;
+    ImGui::SameLine();
+    if (ImGui::Button("Delete")) state->layer_action_info.status = LayerActionInfo::DoDelete;
+    ImGui::SameLine();
+    if (ImGui::Button("Up")) state->layer_action_info.status = LayerActionInfo::DoMoveUp;
+    ImGui::SameLine();
+    if (ImGui::Button("Down")) state->layer_action_info.status = LayerActionInfo::DoMoveDown;
+    
+    // Show the top layer first, like every other image editor
+    for (int i = (int)layers.layers.size() - 1; i >= 0; i--) {
+        Layer& layer = layers.layers[i];
+        
+        // Layer names don't have to be unique, so use the index as the ID
+        ImGui::PushID(i);
+        
+        // Hiding or showing a layer changes the composite
+        if (ImGui::Checkbox("##Visible", &layer.visible)) state->layer_action_info.status = LayerActionInfo::DoChanged;
+        ImGui::SameLine();
+        
+        // Clicking the name makes it the layer that tools draw on
+        // A floating paste moves to the new active layer, so the area under it needs compositing again,
+        // and the filter preview is of the old active layer
+        if (ImGui::Selectable(layer.name.c_str(), i == layers.active)) {
+            layers.active = i;
+            layers.markDirty(state->paste.area());
+            state->filter_preview_dirty = true;
+        }
+        
+        ImGui::PopID();
+    }
+    
+    // Settings of the active layer
+    Layer& active = layers.activeLayer();
+    
+    // Layer opacity slider, shown as a percent like the brush opacity
+    int opacity = std::round(active.opacity * 100);
+    ImGui::Text("Layer opacity");
+    if (ImGui::SliderInt("##Layer opacity", &opacity, 0, 100, "%d%%")) {
+        active.opacity = opacity / 100.0f;
+        state->layer_action_info.status = LayerActionInfo::DoChanged;
+    }
+    
+    // Blend mode dropdown
+    int mode = (int)active.blend_mode;
+    ImGui::Text("Blend mode");
+    if (ImGui::Combo("##Blend mode", &mode, blend_mode_names, IM_ARRAYSIZE(blend_mode_names))) {
+        active.blend_mode = (BlendMode)mode;
+        state->layer_action_info.status = LayerActionInfo::DoChanged;
+    }
+}
+
 // Draw menu on the right side of the screen where brush settings are
 void drawRightMenu(State* state) {
     // Set window position so that the right edge is aligned with the window,
     // and the top edge is aligned with the bottom of the menu bar
-    ImGui::SetNextWindowPos(ImVec2(state->window_width, state->viewport.y), 0, ImVec2(1, 0));
+    ImGui::SetNextWindowPos(ImVec2(state->window_width, state->menu_bar_height), 0, ImVec2(1, 0));
     
     // Force width to be preset amount and height to be full height of window
-    ImGui::SetNextWindowSize(ImVec2(state->right_menu_width, state->window_height - state->viewport.y));
+    ImGui::SetNextWindowSize(ImVec2(state->right_menu_width, state->window_height - state->menu_bar_height));
     
     // Create a window called "Hello, world!" and append into it.
     ImGui::Begin("Hello, world!", nullptr,
@@ -240,18 +892,125 @@ void drawRightMenu(State* state) {
         state->drawing_tool = DrawingTool::Fill;
     }
     
+    // Use "selected" color if eyedropper tool is set
+    this_icon_color = state->drawing_tool == DrawingTool::Eyedropper ? state->selected_icon_color : state->unselected_icon_color;
+    
+    // Create eyedropper tool button on same line
+    ImGui::SameLine();
+    if (ImGui::ImageButton("Eyedropper", (ImTextureID)state->icons.eyedropper.get(), state->icons.eyedropper.size(), {0, 0}, ImVec2(1, 1), this_icon_color)) {
+        // Use eyedropper tool if button is clicked
+        state->drawing_tool = DrawingTool::Eyedropper;
+    }
+    
+    // Shape tools go on their own line
+    this_icon_color = state->drawing_tool == DrawingTool::Rectangle ? state->selected_icon_color : state->unselected_icon_color;
+    if (ImGui::ImageButton("Rectangle", (ImTextureID)state->icons.rectangle.get(), state->icons.rectangle.size(), {0, 0}, ImVec2(1, 1), this_icon_color)) {
+        state->drawing_tool = DrawingTool::Rectangle;
+    }
+    
+    this_icon_color = state->drawing_tool == DrawingTool::Ellipse ? state->selected_icon_color : state->unselected_icon_color;
+    ImGui::SameLine();
+    if (ImGui::ImageButton("Ellipse", (ImTextureID)state->icons.ellipse.get(), state->icons.ellipse.size(), {0, 0}, ImVec2(1, 1), this_icon_color)) {
+        state->drawing_tool = DrawingTool::Ellipse;
+    }
+    
+    this_icon_color = state->drawing_tool == DrawingTool::Polygon ? state->selected_icon_color : state->unselected_icon_color;
+    ImGui::SameLine();
+    if (ImGui::ImageButton("Polygon", (ImTextureID)state->icons.polygon.get(), state->icons.polygon.size(), {0, 0}, ImVec2(1, 1), this_icon_color)) {
+        state->drawing_tool = DrawingTool::Polygon;
+    }
+    
+    // Selection tools go on their own line
+    this_icon_color = state->drawing_tool == DrawingTool::RectSelect ? state->selected_icon_color : state->unselected_icon_color;
+    if (ImGui::ImageButton("Rectangle select", (ImTextureID)state->icons.rect_select.get(), state->icons.rect_select.size(), {0, 0}, ImVec2(1, 1), this_icon_color)) {
+        state->drawing_tool = DrawingTool::RectSelect;
+    }
+    
+    this_icon_color = state->drawing_tool == DrawingTool::Lasso ? state->selected_icon_color : state->unselected_icon_color;
+    ImGui::SameLine();
+    if (ImGui::ImageButton("Lasso", (ImTextureID)state->icons.lasso.get(), state->icons.lasso.size(), {0, 0}, ImVec2(1, 1), this_icon_color)) {
+        state->drawing_tool = DrawingTool::Lasso;
+    }
+    
+    this_icon_color = state->drawing_tool == DrawingTool::MagicWand ? state->selected_icon_color : state->unselected_icon_color;
+    ImGui::SameLine();
+    if (ImGui::ImageButton("Magic wand", (ImTextureID)state->icons.magic_wand.get(), state->icons.magic_wand.size(), {0, 0}, ImVec2(1, 1), this_icon_color)) {
+        state->drawing_tool = DrawingTool::MagicWand;
+    }
+    
     // End of buttons, restore original style
     ImGui::PopStyleVar();
     
+    // How new selections are combined with the current one, only shown for selection tools
+    if (state->drawing_tool == DrawingTool::RectSelect || state->drawing_tool == DrawingTool::Lasso || state->drawing_tool == DrawingTool::MagicWand) {
+        int mode = (int)state->selection_mode;
+        ImGui::RadioButton("Replace", &mode, (int)SelectionMode::Replace);
+        ImGui::SameLine();
+        ImGui::RadioButton("Add", &mode, (int)SelectionMode::Add);
+        ImGui::RadioButton("Subtract", &mode, (int)SelectionMode::Subtract);
+        ImGui::SameLine();
+        ImGui::RadioButton("Intersect", &mode, (int)SelectionMode::Intersect);
+        state->selection_mode = (SelectionMode)mode;
+    }
+    
+    // Shapes are either filled in or outlined with the brush size as the width
+    if (state->drawing_tool == DrawingTool::Rectangle || state->drawing_tool == DrawingTool::Ellipse || state->drawing_tool == DrawingTool::Polygon) {
+        ImGui::Checkbox("Filled", &state->shape_filled);
+    }
+    
+    // Size of the area the eyedropper averages, and the color currently under the cursor
+    if (state->drawing_tool == DrawingTool::Eyedropper) {
+        static const char* sample_size_names[] = {"Point", "3x3 average", "5x5 average", "11x11 average", "31x31 average"};
+        static const int sample_sizes[] = {1, 3, 5, 11, 31};
+        int current = 0;
+        for (int i = 0; i < IM_ARRAYSIZE(sample_sizes); i++) {
+            if (sample_sizes[i] == state->eyedropper_size) current = i;
+        }
+        
+        ImGui::Text("Sample size");
+        if (ImGui::Combo("##Sample size", &current, sample_size_names, IM_ARRAYSIZE(sample_size_names))) {
+            state->eyedropper_size = sample_sizes[current];
+        }
+        
+        // Swatch of the color that would be picked, or the draw color if the cursor isn't over the canvas
+        ImVec4 swatch = state->eyedropper_hovering ? state->eyedropper_color : state->draw_color;
+        ImGui::ColorButton("##Sampled color", swatch, ImGuiColorEditFlags_NoTooltip, ImVec2(state->right_menu_width - 16, 24));
+    }
+    
     // Brush size slider
     // For style, I want the "Brush size" label to be above the slider and not to the size
     ImGui::Text("Brush size");
     // Adding ## to the start hides the label
-    // Cap brush size between 1 and 100
-    if(ImGui::SliderInt("##Brush size", &state->brush_size, 1, 100)) {
+    // Cap brush size between 1 and 500, logarithmic so small sizes are still easy to pick
+    if(ImGui::SliderInt("##Brush size", &state->brush_size, 1, 500, "%d", ImGuiSliderFlags_Logarithmic)) {
         // Let backend know to recreate the brush texture
         state->brush_details_changed = true;
     }
+    
+    // Brush hardness slider, same style as the brush size slider
+    ImGui::Text("Brush hardness");
+    if (ImGui::SliderInt("##Brush hardness", &state->brush_hardness, 0, 100, "%d%%")) {
+        // Let backend know to recreate the brush texture
+        state->brush_details_changed = true;
+    }
+    
+    // Toggle smoothing of the brush edge
+    if (ImGui::Checkbox("Anti-alias", &state->brush_anti_alias)) {
+        // Let backend know to recreate the brush texture
+        state->brush_details_changed = true;
+    }
+    
+    // Brush engine settings, these are read when a stroke starts so the brush texture doesn't need updating
+    ImGui::Text("Opacity");
+    ImGui::SliderInt("##Opacity", &state->brush_opacity, 1, 100, "%d%%");
+    ImGui::Text("Flow");
+    ImGui::SliderInt("##Flow", &state->brush_flow, 1, 100, "%d%%");
+    ImGui::Text("Spacing");
+    ImGui::SliderInt("##Spacing", &state->brush_spacing, 1, 200, "%d%%");
+    
+    // What pen pressure affects, only used with a graphics tablet
+    ImGui::Checkbox("Pressure size", &state->pressure_size);
+    ImGui::Checkbox("Pressure flow", &state->pressure_flow);
 
     ImGui::Text("Brush color");
     // Edit 3 floats representing a color
@@ -261,10 +1020,13 @@ void drawRightMenu(State* state) {
         state->brush_details_changed = true;
     }
     
+    // List of layers and their settings
+    drawLayersPanel(state);
+    
     // Skip to the bottom of the window
-    // viewport.y is the height of the top menu bar, or the y position that this right menu starts at
+    // menu_bar_height is the y position that this right menu starts at
     // GetFrameHeightWithSpacing() is the height of one element
-    ImGui::SetCursorPosY(state->window_height - state->viewport.y - ImGui::GetFrameHeightWithSpacing());
+    ImGui::SetCursorPosY(state->window_height - state->menu_bar_height - ImGui::GetFrameHeightWithSpacing());
     
     // Print FPS
     ImGui::Text("%.1f FPS", state->framerate);
@@ -291,9 +1053,21 @@ void guiDraw(State* state) {
     
     // Draw various windows
     drawMainMenuBar(state);
+    handleShortcuts(state);
+    drawDocumentTabs(state);
     drawResizeWindow(state);
+    drawCanvasSizeWindow(state);
+    drawFilterWindow(state);
+    drawAdjustWindow(state);
     drawNewFileWindow(state);
+    drawSaveWindow(state);
+    drawRecoverWindow(state);
+    drawExportIndexedWindow(state);
     drawRightMenu(state);
+    drawMemoryWindow(state);
+#ifdef PAINT_PROFILER
+    drawProfilerWindow(state);
+#endif
 }
 
 // Renders and presents the GUI and canvas to the screen
@@ -314,15 +1088,17 @@ void guiPresent(State* state) {
     
     // Canvas rendering
     {
+        PROFILE_SCOPE("renderCanvas");
+        
         // Calculate the placement of the canvas on the screen by converting the top-left and bottom-right corners of the canvas from canvas-space to screen-space
-        ImVec2 canvas_dest_tl = canvasToScreenPos(state->canvas.size(), state->viewport, state->viewport_offset, state->scale, {0, 0});
-        ImVec2 canvas_dest_br = canvasToScreenPos(state->canvas.size(), state->viewport, state->viewport_offset, state->scale, state->canvas.size());
+        ImVec2 canvas_dest_tl = canvasToScreenPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, {0, 0});
+        ImVec2 canvas_dest_br = canvasToScreenPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, state->doc().canvas.size());
 
         // Finalize the destination rect by converting from x1,y1,x2,y2 format to x,y,w,h
         SDL_FRect canvas_dest_rect{canvas_dest_tl.x, canvas_dest_tl.y, canvas_dest_br.x - canvas_dest_tl.x, canvas_dest_br.y - canvas_dest_tl.y};
 
         // Render the canvas to the screen
-        SDL_RenderTexture(renderer, state->canvas.get(), NULL, &canvas_dest_rect);
+        SDL_RenderTexture(renderer, state->doc().canvas.get(), NULL, &canvas_dest_rect);
     }
     
     // Brush tool preview rendering, only makes sense for brush and line tool modes
@@ -331,10 +1107,10 @@ void guiPresent(State* state) {
         
         // Make sure brush preview texture is centered around the cursor
         SDL_FRect brush_dest_rect{
-            state->mouse_pos.screen.x - brush_preview_size.x / 2 * state->scale,
-            state->mouse_pos.screen.y - brush_preview_size.y / 2 * state->scale,
-            brush_preview_size.x * state->scale,
-            brush_preview_size.y * state->scale
+            state->mouse_pos.screen.x - brush_preview_size.x / 2 * state->doc().scale,
+            state->mouse_pos.screen.y - brush_preview_size.y / 2 * state->doc().scale,
+            brush_preview_size.x * state->doc().scale,
+            brush_preview_size.y * state->doc().scale
         };
         
         // Render brush texture preview to the screen
@@ -350,7 +1126,7 @@ void guiPresent(State* state) {
         // Start screen position might have changed if user scrolled canvas while drawing line
         // Get original canvas position of start pos and then map that back into screen space
         ImVec2 start_canvas = state->draw_line_start.canvas;
-        ImVec2 start_screen = canvasToScreenPos(state->canvas.size(), state->viewport, state->viewport_offset, state->scale, start_canvas);
+        ImVec2 start_screen = canvasToScreenPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, start_canvas);
         
         // End position of line
         ImVec2 end = state->draw_line_end.screen;
@@ -359,9 +1135,92 @@ void guiPresent(State* state) {
         SDL_RenderLine(renderer, start_screen.x, start_screen.y, end.x, end.y);
     }
     
+    // Show preview of the shape currently being drawn, in the draw color like the line preview
+    if (state->drawing_shape || !state->polygon_points.empty()) {
+        SDL_SetRenderDrawColorFloat(renderer, state->draw_color.x, state->draw_color.y, state->draw_color.z, state->draw_color.w);
+        
+        // Start screen position might have changed if user scrolled canvas while drawing, same as the line tool
+        ImVec2 start = canvasToScreenPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, state->shape_start.canvas);
+        ImVec2 end = state->mouse_pos.screen;
+        
+        if (state->drawing_tool == DrawingTool::Rectangle) {
+            SDL_FRect rect{std::min(start.x, end.x), std::min(start.y, end.y), std::abs(end.x - start.x), std::abs(end.y - start.y)};
+            SDL_RenderRect(renderer, &rect);
+        } else if (state->drawing_tool == DrawingTool::Ellipse) {
+            // Approximate the ellipse with enough segments that it looks smooth
+            SDL_FPoint points[65];
+            for (int i = 0; i <= 64; i++) {
+                float angle = 2 * M_PI * i / 64;
+                points[i] = {(start.x + end.x) / 2 + (end.x - start.x) / 2 * std::cos(angle), (start.y + end.y) / 2 + (end.y - start.y) / 2 * std::sin(angle)};
+            }
+            SDL_RenderLines(renderer, points, 65);
+        } else if (state->drawing_tool == DrawingTool::Polygon) {
+            // Connect every corner placed so far, then the mouse
+            std::vector<SDL_FPoint> points;
+            for (const ImVec2& p : state->polygon_points) {
+                ImVec2 screen = canvasToScreenPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, p);
+                points.push_back({screen.x, screen.y});
+            }
+            points.push_back({end.x, end.y});
+            SDL_RenderLines(renderer, points.data(), points.size());
+        }
+    }
+    
+    // Outline of the selection, drawn in white with a black line next to it so it shows up on any color
+    for (const ImVec4& segment : state->doc().selection_outline) {
+        ImVec2 a = canvasToScreenPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, {segment.x, segment.y});
+        ImVec2 b = canvasToScreenPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, {segment.z, segment.w});
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        SDL_RenderLine(renderer, a.x, a.y, b.x, b.y);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderLine(renderer, a.x + 1, a.y + 1, b.x + 1, b.y + 1);
+    }
+    
+    // Outline of the floating paste, in the same colors as the selection outline
+    if (state->paste.active()) {
+        SDL_Rect area = state->paste.area();
+        ImVec2 a = canvasToScreenPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, {(float)area.x, (float)area.y});
+        ImVec2 b = canvasToScreenPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, {(float)(area.x + area.w), (float)(area.y + area.h)});
+        SDL_FRect rect{a.x, a.y, b.x - a.x, b.y - a.y};
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        SDL_RenderRect(renderer, &rect);
+        rect.x += 1;
+        rect.y += 1;
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderRect(renderer, &rect);
+    }
+    
+    // Show preview of the selection currently being dragged
+    if (state->selecting) {
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        
+        if (state->drawing_tool == DrawingTool::RectSelect) {
+            // Start screen position might have changed if user scrolled canvas while selecting, same as the line tool
+            ImVec2 start = canvasToScreenPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, state->select_start.canvas);
+            ImVec2 end = state->mouse_pos.screen;
+            SDL_FRect rect{std::min(start.x, end.x), std::min(start.y, end.y), std::abs(end.x - start.x), std::abs(end.y - start.y)};
+            SDL_RenderRect(renderer, &rect);
+        } else if (state->drawing_tool == DrawingTool::Lasso) {
+            // Connect every point of the lasso
+            std::vector<SDL_FPoint> points;
+            for (const ImVec2& p : state->lasso_points) {
+                ImVec2 screen = canvasToScreenPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, p);
+                points.push_back({screen.x, screen.y});
+            }
+            SDL_RenderLines(renderer, points.data(), points.size());
+        }
+    }
+    
     // Render the GUI on top of the canvas
-    ImGui_ImplSDLRenderer3_RenderDrawData(ImGui::GetDrawData(), renderer);
+    {
+        PROFILE_SCOPE("renderGui");
+        ImGui_ImplSDLRenderer3_RenderDrawData(ImGui::GetDrawData(), renderer);
+    }
     
     // Refreshes the screen with all the rendering since the last frame
-    SDL_RenderPresent(renderer);
+    // This is where the frame waits for vsync, so it's usually the biggest stage
+    {
+        PROFILE_SCOPE("SDL_RenderPresent");
+        SDL_RenderPresent(renderer);
+    }
 }
\ No newline at end of file
@@ -1,4 +1,7 @@
 #include "gui_resource.hpp"
+#include "pool.hpp"
+#include "utils.hpp"
+#include "startup.hpp"
 
 #include <stdexcept>
 
@@ -6,19 +9,20 @@
 #include <imgui_impl_sdl3.h>
 #include <imgui_impl_sdlrenderer3.h>
 #include <SDL3/SDL.h>
-#include <nfd.h>
 
 GuiResource::GuiResource(std::string window_name, int window_width, int window_height) {
     // Initialize SDL
     if (!SDL_Init(SDL_INIT_VIDEO))
         // Throw error if initialization failed
         throw std::runtime_error(std::string("Error: SDL_Init(): ") + SDL_GetError());
+    startupPhase("SDL_Init");
 
     // Create window that is resizable
     window = SDL_CreateWindow(  window_name.c_str(), window_width, window_height, SDL_WINDOW_RESIZABLE);
     if (window == nullptr)
         // Throw error if window creation failed
         throw std::runtime_error(std::string("Error: SDL_CreateWindow(): ") + SDL_GetError());
+    startupPhase("SDL_CreateWindow");
 
     // Create renderer used to draw objects to the window
     renderer = SDL_CreateRenderer(window, nullptr);
@@ -28,6 +32,7 @@ GuiResource::GuiResource(std::string window_name, int window_width, int window_h
     
     // Set vsync to match monitor refresh rate
     SDL_SetRenderVSync(renderer, 1);
+    startupPhase("SDL_CreateRenderer");
 
     // Make sure our ImGui header matches with the compiled ImGui library
     IMGUI_CHECKVERSION();
@@ -47,19 +52,23 @@ GuiResource::GuiResource(std::string window_name, int window_width, int window_h
     // Setup SDL backend for ImGui
     ImGui_ImplSDL3_InitForSDLRenderer(window, renderer);
     ImGui_ImplSDLRenderer3_Init(renderer);
+    startupPhase("ImGui init");
     
-    // Initialize native file dialog
-    NFD_Init();
+    // The native file dialog isn't initialized here, since on some platforms it loads a whole toolkit
+    // It's initialized by requestFileDialog() the first time a dialog is opened instead
 }
 
 GuiResource::~GuiResource() {
     // Cleanup
-    NFD_Quit();
+    quitFileDialog();
     
     ImGui_ImplSDLRenderer3_Shutdown();
     ImGui_ImplSDL3_Shutdown();
     ImGui::DestroyContext();
 
+    // Pooled textures belong to the renderer, so they have to go first
+    clearPools();
+
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
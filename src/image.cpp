@@ -0,0 +1,431 @@
+#include "image.hpp"
+#include "utils.hpp"
+#include "memory.hpp"
+#include "trace.hpp"
+
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+#include <atomic>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Size of a single tile in bytes
+static const size_t tile_bytes = tile_size * tile_size * sizeof(Uint32);
+
+// Tiles start on a cache line boundary, and since a tile row is a whole number of cache lines every row does too,
+// so SIMD loads in the blend loops never straddle two lines
+static const size_t tile_alignment = 64;
+
+// Frees a tile and removes it from the memory tracker
+void TileDeleter::operator()(Uint32* tile) const {
+    trackFree(MemoryCategory::Layers, tile_bytes);
+    SDL_aligned_free(tile);
+}
+
+// Allocate a transparent tile, counted by the memory tracker
+TilePtr allocateTile() {
+    Uint32* tile = (Uint32*)SDL_aligned_alloc(tile_alignment, tile_bytes);
+    
+    // Throw error if tile could not be allocated
+    if (tile == nullptr)
+        throw std::runtime_error(std::string("Error: SDL_aligned_alloc(): ") + SDL_GetError());
+    
+    trackAlloc(MemoryCategory::Layers, tile_bytes);
+    
+    // New tiles start out transparent
+    std::memset(tile, 0, tile_bytes);
+    return TilePtr(tile);
+}
+
+// Create a fully transparent image with the given size
+TiledImage::TiledImage(int w, int h) {
+    this->w = w;
+    this->h = h;
+    
+    // No tiles are allocated until something is drawn on them
+    tiles.resize(tilesX() * tilesY());
+    changed_tiles.resize(tiles.size(), 0);
+}
+
+// Get an id for a new image
+Uint64 TiledImage::newId() {
+    // Images can be created on worker threads
+    static std::atomic<Uint64> next_id{1};
+    return next_id++;
+}
+
+// Get a tile for writing, allocating a transparent one if it's empty
+Uint32* TiledImage::tileForWrite(int tx, int ty) {
+    changed_tiles[ty * tilesX() + tx] = 1;
+    TilePtr& tile = tiles[ty * tilesX() + tx];
+    if (!tile) tile = allocateTile();
+    
+    return tile.get();
+}
+
+// Get the color of a single pixel
+Uint32 TiledImage::pixel(int x, int y) const {
+    const Uint32* t = tile(x / tile_size, y / tile_size);
+    
+    // Empty tiles are transparent
+    if (t == nullptr) return 0;
+    
+    return t[(y % tile_size) * tile_size + x % tile_size];
+}
+
+// Copy a rect of the image into a flat array, pitch is in bytes
+void TiledImage::readRect(SDL_Rect rect, Uint32* dest, int pitch) const {
+    if (rect.w <= 0 || rect.h <= 0) return;
+    
+    // Go through every tile that overlaps the rect
+    for (int ty = rect.y / tile_size; ty <= (rect.y + rect.h - 1) / tile_size; ty++) {
+        for (int tx = rect.x / tile_size; tx <= (rect.x + rect.w - 1) / tile_size; tx++) {
+            // Part of the rect that is inside this tile
+            SDL_Rect part = intersectRect(rect, {tx * tile_size, ty * tile_size, tile_size, tile_size});
+            const Uint32* t = tile(tx, ty);
+            
+            for (int y = part.y; y < part.y + part.h; y++) {
+                Uint32* dest_row = getPixel(dest, pitch, part.x - rect.x, y - rect.y);
+                
+                if (t == nullptr) {
+                    // Empty tile, copy transparent pixels
+                    std::memset(dest_row, 0, part.w * sizeof(Uint32));
+                } else {
+                    std::memcpy(dest_row, &t[(y - ty * tile_size) * tile_size + part.x - tx * tile_size], part.w * sizeof(Uint32));
+                }
+            }
+        }
+    }
+}
+
+// Copy a flat array into a rect of the image, pitch is in bytes
+// Tiles that are empty stay unallocated if the pixels written to them are all transparent
+void TiledImage::writeRect(SDL_Rect rect, const Uint32* src, int pitch) {
+    if (rect.w <= 0 || rect.h <= 0) return;
+    
+    // Go through every tile that overlaps the rect
+    for (int ty = rect.y / tile_size; ty <= (rect.y + rect.h - 1) / tile_size; ty++) {
+        for (int tx = rect.x / tile_size; tx <= (rect.x + rect.w - 1) / tile_size; tx++) {
+            // Part of the rect that is inside this tile
+            SDL_Rect part = intersectRect(rect, {tx * tile_size, ty * tile_size, tile_size, tile_size});
+            
+            // Don't allocate an empty tile just to write transparent pixels to it
+            if (tile(tx, ty) == nullptr) {
+                bool all_transparent = true;
+                for (int y = part.y; y < part.y + part.h && all_transparent; y++) {
+                    const Uint32* src_row = getPixel((void*)src, pitch, part.x - rect.x, y - rect.y);
+                    all_transparent = std::all_of(src_row, src_row + part.w, [](Uint32 p) { return p == 0; });
+                }
+                if (all_transparent) continue;
+            }
+            
+            Uint32* t = tileForWrite(tx, ty);
+            for (int y = part.y; y < part.y + part.h; y++) {
+                const Uint32* src_row = getPixel((void*)src, pitch, part.x - rect.x, y - rect.y);
+                std::memcpy(&t[(y - ty * tile_size) * tile_size + part.x - tx * tile_size], src_row, part.w * sizeof(Uint32));
+            }
+        }
+    }
+}
+
+// Fill a rect of the image with a single color
+void TiledImage::fillRect(SDL_Rect rect, Uint32 color) {
+    // Only fill the part of the rect inside the image, so the area past the edge stays transparent
+    rect = intersectRect(rect, {0, 0, w, h});
+    if (rect.w == 0) return;
+    
+    for (int ty = rect.y / tile_size; ty <= (rect.y + rect.h - 1) / tile_size; ty++) {
+        for (int tx = rect.x / tile_size; tx <= (rect.x + rect.w - 1) / tile_size; tx++) {
+            // Filling an empty tile with transparent pixels doesn't change anything
+            if (color == 0 && tile(tx, ty) == nullptr) continue;
+            
+            SDL_Rect part = intersectRect(rect, {tx * tile_size, ty * tile_size, tile_size, tile_size});
+            Uint32* t = tileForWrite(tx, ty);
+            for (int y = part.y; y < part.y + part.h; y++) {
+                Uint32* row = &t[(y - ty * tile_size) * tile_size + part.x - tx * tile_size];
+                std::fill(row, row + part.w, color);
+            }
+        }
+    }
+}
+
+// Amount of memory used by allocated tiles in bytes
+size_t TiledImage::allocatedBytes() const {
+    size_t count = std::count_if(tiles.begin(), tiles.end(), [](const auto& t) { return t != nullptr; });
+    return count * tile_bytes;
+}
+
+// Compress every tile
+void TiledImage::pack() {
+    if (is_packed) return;
+    
+    TRACE_SCOPE("TiledImage::pack");
+    
+    packed_tiles.resize(tiles.size());
+    parallelFor(tiles.size(), [&](int start, int end) {
+        TRACE_SCOPE("packTiles");
+        for (int i = start; i < end; i++) {
+            if (!tiles[i]) continue;
+            packed_tiles[i] = compressBytes(tiles[i].get(), tile_bytes);
+            tiles[i].reset();
+        }
+    });
+    
+    size_t bytes = 0;
+    for (const auto& tile : packed_tiles) bytes += tile.size();
+    packed_memory.set(bytes);
+    is_packed = true;
+}
+
+// Decompress every tile
+void TiledImage::unpack() {
+    if (!is_packed) return;
+    
+    TRACE_SCOPE("TiledImage::unpack");
+    
+    parallelFor(tiles.size(), [&](int start, int end) {
+        TRACE_SCOPE("unpackTiles");
+        for (int i = start; i < end; i++) {
+            if (packed_tiles[i].empty()) continue;
+            tiles[i] = allocateTile();
+            decompressBytes(packed_tiles[i], tiles[i].get(), tile_bytes);
+        }
+    });
+    
+    packed_tiles.clear();
+    packed_tiles.shrink_to_fit();
+    packed_memory.set(0);
+    is_packed = false;
+}
+
+// Create a copy of an image scaled to a new size, using the nearest pixel so nothing gets blurry
+TiledImage scaleImage(const TiledImage& image, int w, int h) {
+    TiledImage result(w, h);
+    
+    // Scaled tiles are built here first, and only kept if they aren't fully transparent
+    std::vector<Uint32> tile(tile_size * tile_size);
+    
+    for (int ty = 0; ty < result.tilesY(); ty++) {
+        for (int tx = 0; tx < result.tilesX(); tx++) {
+            bool all_transparent = true;
+            std::fill(tile.begin(), tile.end(), 0);
+            
+            // Only the part of the tile inside the image, the rest stays transparent
+            SDL_Rect part = intersectRect({tx * tile_size, ty * tile_size, tile_size, tile_size}, {0, 0, w, h});
+            for (int y = part.y; y < part.y + part.h; y++) {
+                // Source row of the nearest pixel
+                int src_y = (long long)y * image.height() / h;
+                for (int x = part.x; x < part.x + part.w; x++) {
+                    int src_x = (long long)x * image.width() / w;
+                    Uint32 p = image.pixel(src_x, src_y);
+                    tile[(y - part.y) * tile_size + x - part.x] = p;
+                    all_transparent = all_transparent && p == 0;
+                }
+            }
+            
+            if (!all_transparent) {
+                std::memcpy(result.tileForWrite(tx, ty), tile.data(), tile.size() * sizeof(Uint32));
+            }
+        }
+    }
+    
+    return result;
+}
+
+// Move an image into a new image of a different size without scaling, with its top-left corner at the given offset
+// Anything that doesn't fit is cropped and any new area is left transparent.
+// If the offset lines up with the tile grid, tiles are moved over as they are and no pixels are copied.
+TiledImage placeImage(TiledImage& image, int w, int h, int offset_x, int offset_y) {
+    TiledImage result(w, h);
+    
+    if (offset_x % tile_size == 0 && offset_y % tile_size == 0) {
+        // Offset is a whole number of tiles, so every tile can be moved over without touching its pixels
+        int offset_tx = offset_x / tile_size;
+        int offset_ty = offset_y / tile_size;
+        
+        for (int ty = 0; ty < image.tilesY(); ty++) {
+            for (int tx = 0; tx < image.tilesX(); tx++) {
+                int new_tx = tx + offset_tx;
+                int new_ty = ty + offset_ty;
+                
+                // Tiles that end up outside the new image are cropped away
+                if (new_tx < 0 || new_tx >= result.tilesX() || new_ty < 0 || new_ty >= result.tilesY()) continue;
+                
+                result.putTile(new_tx, new_ty, image.takeTile(tx, ty));
+            }
+        }
+        
+        // Tiles that are now on the right or bottom edge might have pixels past the edge of the new image,
+        // which have to be cleared so that they don't show up if the image grows again later
+        for (int ty = 0; ty < result.tilesY(); ty++) {
+            for (int tx = 0; tx < result.tilesX(); tx++) {
+                if (result.tile(tx, ty) == nullptr) continue;
+                
+                // Part of the tile past the right edge, and part past the bottom edge
+                int inside_w = std::min(w - tx * tile_size, tile_size);
+                int inside_h = std::min(h - ty * tile_size, tile_size);
+                if (inside_w == tile_size && inside_h == tile_size) continue;
+                
+                Uint32* t = result.tileForWrite(tx, ty);
+                for (int y = 0; y < tile_size; y++) {
+                    int keep = y < inside_h ? inside_w : 0;
+                    std::fill(&t[y * tile_size + keep], &t[(y + 1) * tile_size], 0);
+                }
+            }
+        }
+    } else {
+        // Otherwise copy only the overlapping area over, one tile-high band at a time
+        SDL_Rect dest_rect = intersectRect({offset_x, offset_y, image.width(), image.height()}, {0, 0, w, h});
+        if (dest_rect.w == 0) return result;
+        
+        std::vector<Uint32> band(dest_rect.w * tile_size);
+        for (int y = dest_rect.y; y < dest_rect.y + dest_rect.h; y += tile_size) {
+            int band_h = std::min(tile_size, dest_rect.y + dest_rect.h - y);
+            image.readRect({dest_rect.x - offset_x, y - offset_y, dest_rect.w, band_h}, band.data(), dest_rect.w * sizeof(Uint32));
+            result.writeRect({dest_rect.x, y, dest_rect.w, band_h}, band.data(), dest_rect.w * sizeof(Uint32));
+        }
+    }
+    
+    return result;
+}
+
+// Create a rotated or mirrored copy of an image
+TiledImage transformImage(const TiledImage& image, ImageTransform transform) {
+    int w = image.width(), h = image.height();
+    
+    // Every transform is a combination of swapping x and y, then mirroring the source horizontally and/or vertically
+    // e.g. rotating by 90 degrees clockwise takes the destination pixel (x, y) from the source pixel (y, h - 1 - x)
+    bool transpose = transform == ImageTransform::Rotate90 || transform == ImageTransform::Rotate270;
+    bool flip_x = transform == ImageTransform::Rotate180 || transform == ImageTransform::Rotate270 || transform == ImageTransform::FlipHorizontal;
+    bool flip_y = transform == ImageTransform::Rotate90 || transform == ImageTransform::Rotate180 || transform == ImageTransform::FlipVertical;
+    
+    TiledImage result = transpose ? TiledImage(h, w) : TiledImage(w, h);
+    
+    // Each thread gets its own band of destination tile rows, and no two threads ever write to the same tile
+    parallelFor(result.tilesY(), [&](int ty0, int ty1) {
+        TRACE_SCOPE("transformTiles");
+        
+        // Source and destination pixels of a single tile, small enough to stay in the cache while being rearranged
+        std::vector<Uint32> src(tile_size * tile_size), dest(tile_size * tile_size);
+        
+        for (int ty = ty0; ty < ty1; ty++) {
+            for (int tx = 0; tx < result.tilesX(); tx++) {
+                // Area of this destination tile that's inside the image
+                SDL_Rect dest_rect = intersectRect({tx * tile_size, ty * tile_size, tile_size, tile_size}, {0, 0, result.width(), result.height()});
+                
+                // Area of the source that ends up in it, which isn't always lined up with the source tiles
+                SDL_Rect src_rect = transpose ? SDL_Rect{dest_rect.y, dest_rect.x, dest_rect.h, dest_rect.w} : dest_rect;
+                if (flip_x) src_rect.x = w - src_rect.x - src_rect.w;
+                if (flip_y) src_rect.y = h - src_rect.y - src_rect.h;
+                
+                // Nothing to do if every source tile it overlaps is empty
+                bool empty = true;
+                for (int sy = src_rect.y / tile_size; sy <= (src_rect.y + src_rect.h - 1) / tile_size; sy++) {
+                    for (int sx = src_rect.x / tile_size; sx <= (src_rect.x + src_rect.w - 1) / tile_size; sx++) {
+                        if (image.tile(sx, sy) != nullptr) empty = false;
+                    }
+                }
+                if (empty) continue;
+                
+                // If both sides are a whole tile (which is every tile when the size is a multiple of the tile size),
+                // the pixels go straight from one tile to the other without being copied anywhere else
+                bool whole_tiles = dest_rect.w == tile_size && dest_rect.h == tile_size && src_rect.x % tile_size == 0 && src_rect.y % tile_size == 0;
+                
+                const Uint32* src_pixels = src.data();
+                Uint32* dest_pixels = dest.data();
+                int src_pitch = src_rect.w, dest_pitch = dest_rect.w;
+                if (whole_tiles) {
+                    src_pixels = image.tile(src_rect.x / tile_size, src_rect.y / tile_size);
+                    dest_pixels = result.tileForWrite(tx, ty);
+                    src_pitch = dest_pitch = tile_size;
+                } else {
+                    image.readRect(src_rect, src.data(), src_rect.w * sizeof(Uint32));
+                }
+                
+                // Rearrange the pixels, reading the source backwards along any mirrored axis
+                for (int y = 0; y < dest_rect.h; y++) {
+                    for (int x = 0; x < dest_rect.w; x++) {
+                        int u = transpose ? y : x, v = transpose ? x : y;
+                        if (flip_x) u = src_rect.w - 1 - u;
+                        if (flip_y) v = src_rect.h - 1 - v;
+                        dest_pixels[y * dest_pitch + x] = src_pixels[v * src_pitch + u];
+                    }
+                }
+                
+                // Only touches this tile, so it's safe while other threads write to other tiles
+                if (!whole_tiles) result.writeRect(dest_rect, dest.data(), dest_rect.w * sizeof(Uint32));
+            }
+        }
+    });
+    
+    return result;
+}
+
+// Convert from straight to premultiplied alpha for a single RGBA8888 pixel
+Uint32 premultiply(Uint32 rgba) {
+    Uint32 a = rgba & 0xFF;
+    
+    // Rounded x * a / 255
+    auto mul = [a](Uint32 x) { x = x * a + 128; return (x + (x >> 8)) >> 8; };
+    
+    return (mul(rgba >> 24) << 24) | (mul((rgba >> 16) & 0xFF) << 16) | (mul((rgba >> 8) & 0xFF) << 8) | a;
+}
+
+// Convert from premultiplied to straight alpha for a single RGBA8888 pixel
+Uint32 unpremultiply(Uint32 rgba) {
+    Uint32 a = rgba & 0xFF;
+    
+    // Color of a fully transparent pixel doesn't matter
+    if (a == 0) return 0;
+    
+    // Rounded x * 255 / a, capped in case the pixel wasn't properly premultiplied
+    auto div = [a](Uint32 x) { return std::min((x * 255 + a / 2) / a, 255u); };
+    
+    return (div(rgba >> 24) << 24) | (div((rgba >> 16) & 0xFF) << 16) | (div((rgba >> 8) & 0xFF) << 8) | a;
+}
+
+// Average color of a rect of a flat RGBA8888 image with no padding
+Uint32 averageRect(const Uint32* pixels, int image_w, SDL_Rect rect) {
+    // Sum of each channel, in the same order as the bytes of a pixel in memory
+    // Even a whole 4K image can't overflow 32 bits per channel
+    Uint32 sums[4] = {0, 0, 0, 0};
+    
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        const Uint32* row = &pixels[y * image_w + rect.x];
+        int i = 0;
+
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc = zero;
+        
+        // Widen 4 pixels at a time to 32 bits per channel and add them all into one set of sums
+        for (; i + 4 <= rect.w; i += 4) {
+            __m128i p = _mm_loadu_si128((const __m128i*)&row[i]);
+            __m128i lo = _mm_unpacklo_epi8(p, zero), hi = _mm_unpackhi_epi8(p, zero);
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero)));
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)));
+        }
+        
+        Uint32 row_sums[4];
+        _mm_storeu_si128((__m128i*)row_sums, acc);
+        for (int c = 0; c < 4; c++) sums[c] += row_sums[c];
+#endif
+
+        // Scalar version for the remaining pixels, or every pixel if SSE2 isn't available
+        for (; i < rect.w; i++) {
+            for (int c = 0; c < 4; c++) sums[c] += (row[i] >> (c * 8)) & 0xFF;
+        }
+    }
+    
+    // Divide each sum by the number of pixels, rounding to the nearest value
+    Uint32 count = rect.w * rect.h;
+    if (count == 0) return 0;
+    
+    Uint32 result = 0;
+    for (int c = 0; c < 4; c++) result |= ((sums[c] + count / 2) / count) << (c * 8);
+    return result;
+}
\ No newline at end of file
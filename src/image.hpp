@@ -0,0 +1,135 @@
+#pragma once
+
+#include "memory.hpp"
+
+#include <SDL3/SDL.h>
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+// Width and height of a single tile in pixels
+const int tile_size = 64;
+
+// Frees a tile and removes it from the memory tracker
+struct TileDeleter {
+    void operator()(Uint32* tile) const;
+};
+
+// Owning pointer to the tile_size*tile_size pixels of a tile, aligned to a cache line
+using TilePtr = std::unique_ptr<Uint32[], TileDeleter>;
+
+// Allocate a transparent tile, counted by the memory tracker
+// Throws if the memory can't be allocated
+TilePtr allocateTile();
+
+// Image split into square tiles that are only allocated once something is drawn on them,
+// so an empty or mostly empty image takes up almost no memory
+// Pixels are RGBA8888 with premultiplied alpha, and an unallocated tile counts as fully transparent.
+// Pixels of edge tiles that are past the edge of the image are always kept transparent.
+class TiledImage {
+public:
+    // Default constructor, creates an empty 0x0 image
+    TiledImage() {}
+    
+    // Create a fully transparent image with the given size
+    TiledImage(int w, int h);
+    
+    // Getters for width, height, and number of tiles in each direction
+    int width() const { return w; }
+    int height() const { return h; }
+    int tilesX() const { return (w + tile_size - 1) / tile_size; }
+    int tilesY() const { return (h + tile_size - 1) / tile_size; }
+    
+    // Get a tile for reading, returns nullptr if the tile is empty
+    // Tiles are tile_size*tile_size pixels with no padding
+    const Uint32* tile(int tx, int ty) const { return tiles[ty * tilesX() + tx].get(); }
+    
+    // Get a tile for writing, allocating a transparent one if it's empty
+    Uint32* tileForWrite(int tx, int ty);
+    
+    // Free a tile, making it transparent again
+    void clearTile(int tx, int ty) { changed_tiles[ty * tilesX() + tx] = 1; tiles[ty * tilesX() + tx].reset(); }
+    
+    // Move a tile out of the image, leaving it empty
+    TilePtr takeTile(int tx, int ty) { changed_tiles[ty * tilesX() + tx] = 1; return std::move(tiles[ty * tilesX() + tx]); }
+    
+    // Put a tile into the image, replacing any existing one
+    void putTile(int tx, int ty, TilePtr tile) { changed_tiles[ty * tilesX() + tx] = 1; tiles[ty * tilesX() + tx] = std::move(tile); }
+    
+    // Has a tile been written to since the last call to clearChanged()?
+    // Used by the autosave journal so it only saves tiles that changed. Getting a tile for writing counts as a change.
+    bool changed(int tx, int ty) const { return changed_tiles[ty * tilesX() + tx]; }
+    void clearChanged() { std::fill(changed_tiles.begin(), changed_tiles.end(), 0); }
+    
+    // Number that's different for every image ever created, so replacing a layer's image with a new one can be told apart
+    // from changing some of its tiles. Moving an image keeps its id.
+    Uint64 id() const { return image_id; }
+    
+    // Get the color of a single pixel
+    Uint32 pixel(int x, int y) const;
+    
+    // Copy a rect of the image into a flat array, pitch is in bytes
+    void readRect(SDL_Rect rect, Uint32* dest, int pitch) const;
+    
+    // Copy a flat array into a rect of the image, pitch is in bytes
+    // Tiles that are empty stay unallocated if the pixels written to them are all transparent
+    void writeRect(SDL_Rect rect, const Uint32* src, int pitch);
+    
+    // Fill a rect of the image with a single color
+    void fillRect(SDL_Rect rect, Uint32 color);
+    
+    // Amount of memory used by allocated tiles in bytes
+    size_t allocatedBytes() const;
+    
+    // Compress every tile, to keep an image that isn't being used in less memory
+    // The image counts as empty until it's unpacked again, which brings back every tile as it was.
+    // Each thread compresses a share of the tiles, one thread per CPU core.
+    void pack();
+    void unpack();
+    bool packed() const { return is_packed; }
+
+private:
+    // Get an id for a new image
+    static Uint64 newId();
+    
+    int w = 0, h = 0;
+    std::vector<TilePtr> tiles;
+    std::vector<Uint8> changed_tiles; // One flag per tile, bytes instead of bits so threads writing different tiles don't clash
+    Uint64 image_id = newId();
+    
+    // Compressed tiles while the image is packed, empty for tiles that were empty
+    bool is_packed = false;
+    std::vector<std::vector<unsigned char>> packed_tiles;
+    MemoryUsage packed_memory{MemoryCategory::Packed};
+};
+
+// Create a copy of an image scaled to a new size, using the nearest pixel so nothing gets blurry
+TiledImage scaleImage(const TiledImage& image, int w, int h);
+
+// Move an image into a new image of a different size without scaling, with its top-left corner at the given offset
+// Anything that doesn't fit is cropped and any new area is left transparent.
+// If the offset lines up with the tile grid, tiles are moved over as they are and no pixels are copied.
+TiledImage placeImage(TiledImage& image, int w, int h, int offset_x, int offset_y);
+
+// Ways an image can be rotated or mirrored, rotations are clockwise
+enum class ImageTransform {
+    Rotate90,
+    Rotate180,
+    Rotate270,
+    FlipHorizontal,
+    FlipVertical
+};
+
+// Create a rotated or mirrored copy of an image, rotating by 90 or 270 degrees swaps the width and height
+// Works one destination tile at a time so every tile is transposed or reversed inside the cache, with one thread per CPU core.
+// Tiles that only come from empty tiles stay unallocated.
+TiledImage transformImage(const TiledImage& image, ImageTransform transform);
+
+// Convert between premultiplied and straight alpha for a single RGBA8888 pixel
+Uint32 premultiply(Uint32 rgba);
+Uint32 unpremultiply(Uint32 rgba);
+
+// Average color of a rect of a flat RGBA8888 image with no padding, rounded to the nearest value
+// The rect must be inside the image. Premultiplied pixels give a premultiplied average, which is the correct way to average them.
+Uint32 averageRect(const Uint32* pixels, int image_w, SDL_Rect rect);
@@ -0,0 +1,570 @@
+#include "journal.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The file starts with these bytes, the last four are the version of the format
+// After that it's a list of checkpoints, each one starting with its size in bytes (not counting the size itself)
+// A checkpoint is the layer list followed by the tiles that changed, and every number is in the byte order of the machine
+// since the file is never moved to a different one
+static const char file_magic[8] = {'P', 'J', 'N', 'L', 1, 0, 0, 0};
+
+// Once the file is bigger than twice its size after the last compaction plus this many bytes, it gets compacted
+static const size_t compact_threshold = 32 * 1024 * 1024;
+
+// How a tile is stored in a checkpoint
+enum TileKind : Uint8 {
+    TileEmpty,  // Fully transparent and unallocated, no pixels follow
+    TileSolid,  // Every pixel inside the image is the same color, only that color follows
+    TilePixels  // Every pixel of the tile follows
+};
+
+// Pixels and bytes in a single tile
+static const int tile_pixels = tile_size * tile_size;
+static const size_t tile_bytes = tile_pixels * sizeof(Uint32);
+
+// Everything about a layer except its pixels
+struct JournalLayer {
+    Uint64 image;               // Id of the layer's image, which tiles refer to
+    std::string name;
+    float opacity;
+    BlendMode blend_mode;
+    bool visible;
+};
+
+// Document as it's read back from a journal
+struct JournalDocument {
+    int w = 0, h = 0, active = 0;
+    std::vector<JournalLayer> layers;
+    std::unordered_map<Uint64, TiledImage> images; // Image of every layer, by id
+};
+
+// Add a value to the end of a checkpoint
+template <typename T>
+static void put(std::vector<unsigned char>& out, T value) {
+    const unsigned char* bytes = (const unsigned char*)&value;
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+// Reads values out of a checkpoint in the same order they were put in, throwing if it runs out of bytes
+class Reader {
+public:
+    Reader(const std::vector<unsigned char>& data) : data(data) {}
+    
+    template <typename T>
+    T get() {
+        T value;
+        std::memcpy(&value, bytes(sizeof(T)), sizeof(T));
+        return value;
+    }
+    
+    const unsigned char* bytes(size_t count) {
+        if (count > data.size() - pos)
+            throw std::runtime_error("Error: Reader::bytes(): journal checkpoint is cut short");
+        pos += count;
+        return &data[pos - count];
+    }
+    
+    bool atEnd() const { return pos == data.size(); }
+
+private:
+    const std::vector<unsigned char>& data;
+    size_t pos = 0;
+};
+
+// Start a checkpoint with the layer list, leaving room at the front for its size
+static void putLayers(std::vector<unsigned char>& out, int w, int h, int active, const std::vector<JournalLayer>& layers) {
+    put<Uint64>(out, 0);
+    put<Sint32>(out, w);
+    put<Sint32>(out, h);
+    put<Sint32>(out, active);
+    put<Uint32>(out, layers.size());
+    for (const JournalLayer& layer : layers) {
+        put(out, layer.image);
+        put<Uint32>(out, layer.name.size());
+        out.insert(out.end(), layer.name.begin(), layer.name.end());
+        put(out, layer.opacity);
+        put<Uint8>(out, (Uint8)layer.blend_mode);
+        put<Uint8>(out, layer.visible);
+    }
+}
+
+// Add a tile of an image to a checkpoint
+static void putTile(std::vector<unsigned char>& out, const TiledImage& image, Uint64 id, int tx, int ty) {
+    put(out, id);
+    put<Sint32>(out, tx);
+    put<Sint32>(out, ty);
+    
+    const Uint32* tile = image.tile(tx, ty);
+    if (tile == nullptr) {
+        put<Uint8>(out, TileEmpty);
+        return;
+    }
+    
+    // Solid tiles, like most of a freshly filled background, only need their color
+    // Only the part inside the image counts, so tiles on the right and bottom edges can be solid too
+    int inside_w = std::min(tile_size, image.width() - tx * tile_size);
+    int inside_h = std::min(tile_size, image.height() - ty * tile_size);
+    bool solid = true;
+    for (int y = 0; y < inside_h && solid; y++) {
+        const Uint32* row = &tile[y * tile_size];
+        solid = std::all_of(row, row + inside_w, [tile](Uint32 pixel) { return pixel == tile[0]; });
+    }
+    if (solid) {
+        put<Uint8>(out, TileSolid);
+        put(out, tile[0]);
+        return;
+    }
+    
+    put<Uint8>(out, TilePixels);
+    out.insert(out.end(), (const unsigned char*)tile, (const unsigned char*)(tile + tile_pixels));
+}
+
+// Fill in the size at the front of a finished checkpoint
+static void finishCheckpoint(std::vector<unsigned char>& checkpoint) {
+    Uint64 size = checkpoint.size() - sizeof(Uint64);
+    std::memcpy(checkpoint.data(), &size, sizeof(size));
+}
+
+// Write bytes to a file, mode is passed to fopen so the file can be replaced or appended to
+static void writeBytes(const std::string& path, const char* mode, const void* data, size_t size) {
+    FILE* file = fopen(path.c_str(), mode);
+    if (file == nullptr)
+        throw std::runtime_error("Error: writeBytes(): could not open " + path);
+    
+    // Closing the file flushes it, which can fail too
+    bool written = fwrite(data, 1, size, file) == size;
+    if (fclose(file) != 0 || !written)
+        throw std::runtime_error("Error: writeBytes(): could not write " + path);
+}
+
+// Apply a single checkpoint (without the size at its front) to a document
+static void applyCheckpoint(const std::vector<unsigned char>& checkpoint, JournalDocument& doc) {
+    Reader in(checkpoint);
+    
+    // Layer list, which replaces the old one completely
+    doc.w = in.get<Sint32>();
+    doc.h = in.get<Sint32>();
+    doc.active = in.get<Sint32>();
+    Uint32 count = in.get<Uint32>();
+    if (doc.w <= 0 || doc.h <= 0 || count == 0)
+        throw std::runtime_error("Error: applyCheckpoint(): journal checkpoint has no canvas");
+    
+    doc.layers.clear();
+    for (Uint32 i = 0; i < count; i++) {
+        JournalLayer layer;
+        layer.image = in.get<Uint64>();
+        Uint32 name_size = in.get<Uint32>();
+        const unsigned char* name = in.bytes(name_size);
+        layer.name.assign(name, name + name_size);
+        layer.opacity = in.get<float>();
+        layer.blend_mode = (BlendMode)std::min<Uint8>(in.get<Uint8>(), (Uint8)BlendMode::Add);
+        layer.visible = in.get<Uint8>();
+        doc.layers.push_back(layer);
+        
+        // An image that wasn't in the last checkpoint is new, and starts out transparent
+        auto image = doc.images.find(layer.image);
+        if (image == doc.images.end()) {
+            doc.images.emplace(layer.image, TiledImage(doc.w, doc.h));
+        } else if (image->second.width() != doc.w || image->second.height() != doc.h) {
+            throw std::runtime_error("Error: applyCheckpoint(): journal layer changed size");
+        }
+    }
+    
+    // Tiles that changed, until the end of the checkpoint
+    while (!in.atEnd()) {
+        Uint64 id = in.get<Uint64>();
+        int tx = in.get<Sint32>();
+        int ty = in.get<Sint32>();
+        Uint8 kind = in.get<Uint8>();
+        
+        auto image = doc.images.find(id);
+        if (image == doc.images.end() || tx < 0 || ty < 0 || tx >= image->second.tilesX() || ty >= image->second.tilesY())
+            throw std::runtime_error("Error: applyCheckpoint(): journal tile is outside of every layer");
+        
+        switch (kind) {
+            case TileEmpty:
+                image->second.clearTile(tx, ty);
+                break;
+            case TileSolid:
+                // The image keeps the part past its edge transparent
+                image->second.fillRect({tx * tile_size, ty * tile_size, tile_size, tile_size}, in.get<Uint32>());
+                break;
+            case TilePixels:
+                std::memcpy(image->second.tileForWrite(tx, ty), in.bytes(tile_bytes), tile_bytes);
+                break;
+            default:
+                throw std::runtime_error("Error: applyCheckpoint(): unknown journal tile kind " + std::to_string(kind));
+        }
+    }
+    
+    // Images of layers that were deleted won't be needed again
+    for (auto image = doc.images.begin(); image != doc.images.end();) {
+        bool used = std::any_of(doc.layers.begin(), doc.layers.end(), [&](const JournalLayer& layer) { return layer.image == image->first; });
+        image = used ? std::next(image) : doc.images.erase(image);
+    }
+}
+
+// Read every complete checkpoint of a journal into a document
+// A checkpoint that's cut short was being written when the app crashed, so it's left out along with anything after it
+// Returns false if there are no complete checkpoints
+static bool readJournal(const std::string& path, JournalDocument& doc) {
+    std::error_code error;
+    size_t remaining = std::filesystem::file_size(path, error);
+    if (error) return false;
+    
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) return false;
+    
+    // Not a journal, or one written by a different version
+    char magic[sizeof(file_magic)];
+    if (remaining < sizeof(magic) || fread(magic, 1, sizeof(magic), file) != sizeof(magic) || std::memcmp(magic, file_magic, sizeof(magic)) != 0) {
+        fclose(file);
+        return false;
+    }
+    remaining -= sizeof(magic);
+    
+    bool any = false;
+    std::vector<unsigned char> checkpoint;
+    try {
+        Uint64 size;
+        while (remaining >= sizeof(size) && fread(&size, sizeof(size), 1, file) == 1) {
+            remaining -= sizeof(size);
+            if (size > remaining) break;
+            
+            checkpoint.resize(size);
+            if (fread(checkpoint.data(), 1, size, file) != size) break;
+            remaining -= size;
+            
+            applyCheckpoint(checkpoint, doc);
+            any = true;
+        }
+    } catch (...) {
+        fclose(file);
+        throw;
+    }
+    
+    fclose(file);
+    return any;
+}
+
+// Every journal has a lock file next to it, which the instance of the app writing the journal keeps open and locked
+// The OS lets go of the lock when the instance closes, even if it crashed, so a journal whose lock can be taken again
+// isn't being written by anyone anymore
+
+// Lock file of the journal at the path, autosave-<number>.lock
+static std::string lockPath(const std::string& path) {
+    return std::filesystem::path(path).replace_extension(".lock").string();
+}
+
+// Open and lock a lock file, creating it if it doesn't exist
+// Returns -1 if another instance holds the lock, and throws if the file couldn't be opened at all
+static intptr_t takeLock(const std::string& path) {
+#ifdef _WIN32
+    // Opening the file without sharing it is the lock, nobody else can open it until it's closed
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        if (GetLastError() == ERROR_SHARING_VIOLATION) return -1;
+        throw std::runtime_error("Error: takeLock(): could not open " + path);
+    }
+    return (intptr_t)file;
+#else
+    int file = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (file < 0)
+        throw std::runtime_error("Error: takeLock(): could not open " + path);
+    if (flock(file, LOCK_EX | LOCK_NB) != 0) {
+        close(file);
+        return -1;
+    }
+    
+    // The last owner may have deleted the file between it being opened and locked here, and nobody else can see that file
+    // anymore, so count it as taken
+    struct stat opened, current;
+    if (fstat(file, &opened) != 0 || stat(path.c_str(), &current) != 0 || opened.st_dev != current.st_dev || opened.st_ino != current.st_ino) {
+        close(file);
+        return -1;
+    }
+    return file;
+#endif
+}
+
+// Let go of a lock taken by takeLock() and delete the lock file
+static void releaseLock(const std::string& path, intptr_t lock) {
+    std::error_code error;
+#ifdef _WIN32
+    // Windows can't delete a file that's open, and if another instance opens it in between, deleting it fails instead
+    CloseHandle((HANDLE)lock);
+    std::filesystem::remove(path, error);
+#else
+    // Deleted while it's still locked, so nobody can lock the file once it's gone
+    std::filesystem::remove(path, error);
+    close((int)lock);
+#endif
+}
+
+// Locks of journals returned by leftOver(), held until they're discarded
+static std::unordered_map<std::string, intptr_t> left_over_locks;
+
+// Waits for the background thread and lets go of the lock, but leaves the file alone
+Journal::~Journal() {
+    if (thread.joinable()) thread.join();
+    if (running()) releaseLock(lockPath(path), lock);
+}
+
+// Folder that journals are kept in, the user's preferences folder
+static std::string journalFolder() {
+    char* folder = SDL_GetPrefPath("", "Paint");
+    
+    // Throw error if the folder could not be found or created
+    if (folder == nullptr)
+        throw std::runtime_error(std::string("Error: SDL_GetPrefPath(): ") + SDL_GetError());
+    
+    std::string path = folder;
+    SDL_free(folder);
+    return path;
+}
+
+// Journals are called autosave-<number>.journal
+static const std::string journal_prefix = "autosave-";
+static const std::string journal_extension = ".journal";
+
+// Journals left in the user's preferences folder by an earlier session that's no longer running
+std::vector<std::string> Journal::leftOver() {
+    std::vector<std::string> paths;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(journalFolder(), error)) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind(journal_prefix, 0) != 0 || entry.path().extension() != journal_extension) continue;
+        std::string path = entry.path().string();
+        
+        // Another instance that's still running is writing this one
+        if (left_over_locks.count(path) == 0) {
+            intptr_t lock = takeLock(lockPath(path));
+            if (lock == -1) continue;
+            left_over_locks[path] = lock;
+        }
+        
+        // A journal that was started but never got a checkpoint has nothing to recover
+        std::error_code size_error;
+        size_t size = std::filesystem::file_size(entry.path(), size_error);
+        if (size_error || size <= sizeof(file_magic)) {
+            discard(path);
+            continue;
+        }
+        paths.push_back(path);
+    }
+    
+    // Oldest first, so recovered documents open in the same order as before
+    std::sort(paths.begin(), paths.end(), [](const std::string& a, const std::string& b) {
+        return a.size() != b.size() ? a.size() < b.size() : a < b;
+    });
+    return paths;
+}
+
+// Delete a journal that isn't needed anymore, along with its lock
+void Journal::discard(const std::string& path) {
+    std::error_code error;
+    std::filesystem::remove(path, error);
+    
+    auto lock = left_over_locks.find(path);
+    if (lock != left_over_locks.end()) {
+        releaseLock(lockPath(path), lock->second);
+        left_over_locks.erase(lock);
+    }
+}
+
+// Read the journal at the path back into a layer stack
+bool Journal::recover(const std::string& path, LayerStack& layers) {
+    PROFILE_SCOPE("Journal::recover");
+    
+    JournalDocument doc;
+    if (!readJournal(path, doc)) return false;
+    
+    std::vector<Layer> recovered;
+    for (const JournalLayer& info : doc.layers) {
+        Layer layer;
+        layer.name = info.name;
+        layer.opacity = info.opacity;
+        layer.blend_mode = info.blend_mode;
+        layer.visible = info.visible;
+        layer.image = std::move(doc.images.at(info.image));
+        layer.forgetStrokes();
+        recovered.push_back(std::move(layer));
+    }
+    layers.replace(std::move(recovered), doc.w, doc.h, doc.active);
+    return true;
+}
+
+// Start a new journal at a path that no other journal or instance of the app is using
+void Journal::start() {
+    stop(false);
+    
+    // Take the first number whose lock nobody holds, skipping journals left over by a crash so they can still be recovered
+    // The lock is taken before checking, so another instance can't start a journal with the same number in between
+    static int next_number = 1;
+    std::string folder = journalFolder();
+    std::string new_path;
+    intptr_t new_lock = -1;
+    while (new_lock == -1) {
+        new_path = folder + journal_prefix + std::to_string(next_number++) + journal_extension;
+        new_lock = takeLock(lockPath(new_path));
+        if (new_lock != -1 && std::filesystem::exists(new_path)) {
+            releaseLock(lockPath(new_path), new_lock);
+            new_lock = -1;
+        }
+    }
+    
+    try {
+        writeBytes(new_path, "wb", file_magic, sizeof(file_magic));
+    } catch (...) {
+        releaseLock(lockPath(new_path), new_lock);
+        throw;
+    }
+    path = new_path;
+    lock = new_lock;
+    full = true;
+    last_layers.clear();
+    file_bytes = compacted_bytes = sizeof(file_magic);
+}
+
+// Append the tiles that changed since the last checkpoint on the background thread
+void Journal::checkpoint(LayerStack& layers) {
+    // Try again next time if the last checkpoint is still being written
+    // Packed layers can't be read, their changes were already written by flush() before they were packed
+    if (!running() || layers.packed() || !finish(false)) return;
+    
+    PROFILE_SCOPE("Journal::checkpoint");
+    
+    std::vector<JournalLayer> infos;
+    for (const Layer& layer : layers.layers) {
+        infos.push_back(JournalLayer{layer.image.id(), layer.name, layer.opacity, layer.blend_mode, layer.visible});
+    }
+    std::vector<unsigned char> checkpoint;
+    putLayers(checkpoint, layers.width(), layers.height(), layers.active, infos);
+    size_t layers_size = checkpoint.size();
+    bool layers_changed = !std::equal(checkpoint.begin(), checkpoint.end(), last_layers.begin(), last_layers.end());
+    
+    // Copy the tiles that changed, which is all the main thread has to do
+    for (Layer& layer : layers.layers) {
+        TiledImage& image = layer.image;
+        for (int ty = 0; ty < image.tilesY(); ty++) {
+            for (int tx = 0; tx < image.tilesX(); tx++) {
+                // New images start out transparent when they're read back, so empty tiles only need to be written once they've changed
+                if (full ? image.tile(tx, ty) != nullptr : image.changed(tx, ty)) putTile(checkpoint, image, image.id(), tx, ty);
+            }
+        }
+        image.clearChanged();
+    }
+    
+    // Nothing to write if nothing changed
+    if (!layers_changed && checkpoint.size() == layers_size) return;
+    
+    last_layers.assign(checkpoint.begin(), checkpoint.begin() + layers_size);
+    finishCheckpoint(checkpoint);
+    
+    // Write the checkpoint on the background thread, which takes it over
+    bool was_full = full;
+    full = false;
+    done = false;
+    thread = std::thread([this, checkpoint = std::move(checkpoint), was_full]() {
+        try {
+            write(checkpoint, was_full);
+        } catch (...) {
+            // Exceptions can't cross threads, so hand it to the main thread
+            error = std::current_exception();
+        }
+        done = true;
+    });
+}
+
+// Wait for the last checkpoint to be written, then make a new one
+void Journal::flush(LayerStack& layers) {
+    finish(true);
+    checkpoint(layers);
+}
+
+// Wait for the background thread and stop journaling
+void Journal::stop(bool remove) {
+    finish(true);
+    
+    if (running()) {
+        if (remove) discard(path);
+        releaseLock(lockPath(path), lock);
+    }
+    path.clear();
+    lock = -1;
+}
+
+// Join the background thread once it has finished, or wait for it to finish if wait is true
+bool Journal::finish(bool wait) {
+    if (!thread.joinable()) return true;
+    if (!wait && !done) return false;
+    
+    thread.join();
+    
+    if (error) {
+        std::exception_ptr e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+    return true;
+}
+
+// Append a checkpoint to the file, and compact the file if it has grown too big
+void Journal::write(const std::vector<unsigned char>& checkpoint, bool full) {
+    TRACE_SCOPE("Journal::write");
+    
+    writeBytes(path, "ab", checkpoint.data(), checkpoint.size());
+    file_bytes += checkpoint.size();
+    
+    // A checkpoint with every tile is as small as the file gets
+    if (full) compacted_bytes = file_bytes;
+    else if (file_bytes > 2 * compacted_bytes + compact_threshold) compact();
+}
+
+// Rewrite the file with a single checkpoint that has the latest version of every tile
+void Journal::compact() {
+    TRACE_SCOPE("Journal::compact");
+    
+    // Read the whole journal back, which only this thread writes to
+    JournalDocument doc;
+    if (!readJournal(path, doc)) return;
+    
+    // Write it out again as one checkpoint, skipping empty tiles since every image is new to the compacted file
+    std::vector<unsigned char> data(file_magic, file_magic + sizeof(file_magic));
+    std::vector<unsigned char> checkpoint;
+    putLayers(checkpoint, doc.w, doc.h, doc.active, doc.layers);
+    for (const JournalLayer& layer : doc.layers) {
+        const TiledImage& image = doc.images.at(layer.image);
+        for (int ty = 0; ty < image.tilesY(); ty++) {
+            for (int tx = 0; tx < image.tilesX(); tx++) {
+                if (image.tile(tx, ty) != nullptr) putTile(checkpoint, image, layer.image, tx, ty);
+            }
+        }
+    }
+    finishCheckpoint(checkpoint);
+    data.insert(data.end(), checkpoint.begin(), checkpoint.end());
+    
+    // Write to a separate file first and then swap it in, so a crash halfway through still leaves a complete journal
+    std::string temp_path = path + ".tmp";
+    writeBytes(temp_path, "wb", data.data(), data.size());
+    std::filesystem::rename(temp_path, path);
+    
+    file_bytes = compacted_bytes = data.size();
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "layers.hpp"
+
+#include <SDL3/SDL.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <cstdint>
+
+// Autosave journal that keeps a copy of the document on disk, so it can be recovered if the app crashes
+// Every checkpoint appends only the tiles that changed since the last one to the end of the file, along with the list of
+// layers, so the cost of a checkpoint depends on how much was drawn and not on the size of the canvas. The file is written
+// on a background thread, which also rewrites it with only the latest version of every tile once it has grown too big.
+// Every open document has a journal of its own. The file is deleted when the document is closed or the app closes normally,
+// so finding one on startup means the last session didn't. Several instances of the app can run at once, so every journal
+// also has a lock file that its instance keeps locked while it's running, and only journals nobody holds the lock of count
+// as left over.
+class Journal {
+public:
+    // Default constructor, the journal doesn't write anything until it's started
+    Journal() {}
+    
+    // Waits for the background thread and lets go of the lock, but leaves the file alone
+    ~Journal();
+    
+    // Journals left in the user's preferences folder by an earlier session that's no longer running
+    // Their locks are held from here on, so another instance can't recover them too, until they're discarded
+    static std::vector<std::string> leftOver();
+    
+    // Delete a journal that isn't needed anymore, along with its lock
+    static void discard(const std::string& path);
+    
+    // Read the journal at the path back into a layer stack, up to the last checkpoint that was written completely
+    // Layers are only pixels afterwards, since strokes aren't journaled
+    // Returns false and leaves the layer stack alone if the file has no complete checkpoint
+    static bool recover(const std::string& path, LayerStack& layers);
+    
+    // Start a new journal in the user's preferences folder, at a path that no other journal or instance of the app is using
+    // The first checkpoint writes every tile of the document, later ones only the tiles that changed
+    void start();
+    
+    // Copy every tile that changed since the last checkpoint and append them to the file on the background thread
+    // If the previous checkpoint is still being written nothing happens, and the changed tiles go in the next one instead
+    // Rethrows any error from the background thread
+    void checkpoint(LayerStack& layers);
+    
+    // Wait for the last checkpoint to be written, then make a new one
+    // Used before a document is packed away, so the journal has everything that changed while it was viewed
+    void flush(LayerStack& layers);
+    
+    // Wait for the background thread and stop journaling, deleting the file if remove is true
+    // The lock is let go of either way
+    void stop(bool remove);
+    
+    // Has the journal been started?
+    bool running() const { return !path.empty(); }
+
+private:
+    // Join the background thread once it has finished, or wait for it to finish if wait is true
+    // Returns false if it's still running, rethrows any error from it
+    bool finish(bool wait);
+    
+    // Append a checkpoint to the file, and compact the file if it has grown too big
+    // Runs on the background thread
+    void write(const std::vector<unsigned char>& checkpoint, bool full);
+    
+    // Rewrite the file with a single checkpoint that has the latest version of every tile
+    // Runs on the background thread
+    void compact();
+    
+    std::string path;
+    intptr_t lock = -1; // Lock file held open while the journal is running, or -1
+    std::thread thread;
+    std::atomic<bool> done{true}; // Has the background thread finished?
+    std::exception_ptr error; // Error thrown by the background thread, rethrown on the main thread once it's finished
+    
+    // Write every tile in the next checkpoint, not only the ones that changed
+    bool full = true;
+    
+    // Layer list of the last checkpoint, so nothing is written if neither the layers nor any tiles changed
+    std::vector<unsigned char> last_layers;
+    
+    // Size of the file, and its size right after it was last compacted (or started)
+    // Only touched by the background thread while it's running
+    size_t file_bytes = 0, compacted_bytes = 0;
+};
@@ -0,0 +1,401 @@
+#include "layers.hpp"
+#include "stroke.hpp"
+#include "clipboard.hpp"
+#include "utils.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Names of each blend mode, in the same order as the enum
+const char* blend_mode_names[4] = {"Normal", "Multiply", "Screen", "Add"};
+
+// Replace all layers with a single opaque background layer of the given size and color
+void LayerStack::reset(int w, int h, Uint32 background) {
+    layers.clear();
+    layers_created = 0;
+    resize(w, h);
+    
+    // Start with a background layer filled with a solid color
+    Layer layer;
+    layer.name = "Background";
+    layer.image = TiledImage(w, h);
+    layer.image.fillRect({0, 0, w, h}, background);
+    layer.base_color = background;
+    layers.push_back(std::move(layer));
+    active = 0;
+}
+
+// Replace all layers with the given ones, which must all have the given size
+void LayerStack::replace(std::vector<Layer> layers, int w, int h, int active) {
+    this->layers = std::move(layers);
+    this->active = std::clamp(active, 0, (int)this->layers.size() - 1);
+    
+    // New layers shouldn't get the same name as one of these
+    layers_created = this->layers.size();
+    resize(w, h);
+}
+
+// Scale every layer to a new size
+void LayerStack::scale(int w, int h) {
+    for (Layer& layer : layers) {
+        layer = scaledLayer(layer, w, h);
+    }
+    resize(w, h);
+}
+
+// Copy of every visible layer scaled to a new size, with the composite already worked out
+LayerStack LayerStack::scaledCopy(int w, int h) const {
+    LayerStack result;
+    for (const Layer& layer : layers) {
+        if (layer.visible) result.layers.push_back(scaledLayer(layer, w, h));
+    }
+    result.resize(w, h);
+    result.recomposite(nullptr);
+    return result;
+}
+
+// Scale the pixels and strokes of a single layer to a new size
+Layer LayerStack::scaledLayer(const Layer& layer, int w, int h) const {
+    Layer result;
+    result.name = layer.name;
+    result.opacity = layer.opacity;
+    result.blend_mode = layer.blend_mode;
+    result.visible = layer.visible;
+    
+    if (!layer.has_strokes) {
+        // Only pixels, so the best that can be done is stretching them
+        result.forgetStrokes();
+        result.image = scaleImage(layer.image, w, h);
+        return result;
+    }
+    
+    // Scale every stroke's path along with the canvas, then paint them all again at the new size
+    float sx = (float)w / this->w, sy = (float)h / this->h;
+    result.base_color = layer.base_color;
+    result.strokes = layer.strokes;
+    for (StrokeRecord& stroke : result.strokes) {
+        stroke.scale = {stroke.scale.x * sx, stroke.scale.y * sy};
+        stroke.offset = {stroke.offset.x * sx, stroke.offset.y * sy};
+    }
+    result.image = rasterizeStrokes(result.strokes, result.base_color, w, h);
+    return result;
+}
+
+// Crop or extend every layer to a new size without scaling, with the old top-left corner at the given offset
+// New area is transparent, except on the bottom layer where it is filled with the given color
+void LayerStack::place(int w, int h, int offset_x, int offset_y, Uint32 fill) {
+    // Strokes would paint the part that was cropped off again the next time they're repainted, like after extending the
+    // canvas back and then resizing it, so they only describe the layer if nothing was cut off
+    bool cropped = offset_x < 0 || offset_y < 0 || offset_x + this->w > w || offset_y + this->h > h;
+    
+    for (Layer& layer : layers) {
+        layer.image = placeImage(layer.image, w, h, offset_x, offset_y);
+        
+        // Strokes move along with the pixels
+        if (cropped) layer.forgetStrokes();
+        for (StrokeRecord& stroke : layer.strokes) {
+            stroke.offset = {stroke.offset.x + offset_x, stroke.offset.y + offset_y};
+        }
+    }
+    
+    // New area of the bottom layer is only described by the strokes if it's the same color as the base
+    if (fill != layers[0].base_color) layers[0].forgetStrokes();
+    
+    // Fill the area around the old content on the bottom layer, as a band above, below, left, and right of it
+    SDL_Rect old_rect = intersectRect({offset_x, offset_y, this->w, this->h}, {0, 0, w, h});
+    TiledImage& bottom = layers[0].image;
+    if (old_rect.w == 0) {
+        bottom.fillRect({0, 0, w, h}, fill);
+    } else {
+        bottom.fillRect({0, 0, w, old_rect.y}, fill);
+        bottom.fillRect({0, old_rect.y + old_rect.h, w, h - old_rect.y - old_rect.h}, fill);
+        bottom.fillRect({0, old_rect.y, old_rect.x, old_rect.h}, fill);
+        bottom.fillRect({old_rect.x + old_rect.w, old_rect.y, w - old_rect.x - old_rect.w, old_rect.h}, fill);
+    }
+    
+    resize(w, h);
+}
+
+// Rotate or mirror every layer
+void LayerStack::transform(ImageTransform transform) {
+    for (Layer& layer : layers) {
+        layer.image = transformImage(layer.image, transform);
+        layer.forgetStrokes();
+    }
+    resize(layers[0].image.width(), layers[0].image.height());
+}
+
+// Add a new transparent layer above the active layer and make it active
+void LayerStack::addLayer() {
+    Layer layer;
+    layer.name = "Layer " + std::to_string(++layers_created);
+    layer.image = TiledImage(w, h);
+    
+    // Nothing needs to be recomposited since the new layer is transparent
+    layers.insert(layers.begin() + active + 1, std::move(layer));
+    active++;
+}
+
+// Delete the active layer, the last layer can't be deleted
+void LayerStack::deleteLayer() {
+    if (layers.size() <= 1) return;
+    
+    layers.erase(layers.begin() + active);
+    active = std::min(active, (int)layers.size() - 1);
+    markAllDirty();
+}
+
+// Move the active layer up or down in the stack by swapping it with its neighbor
+void LayerStack::moveLayer(int direction) {
+    int other = active + direction;
+    if (other < 0 || other >= (int)layers.size()) return;
+    
+    std::swap(layers[active], layers[other]);
+    active = other;
+    markAllDirty();
+}
+
+// Keep a stroke that was just committed to the active layer
+void LayerStack::recordStroke(const BrushStroke& stroke) {
+    Layer& layer = activeLayer();
+    if (!layer.has_strokes) return;
+    
+    // The selection a stroke was limited to isn't kept, so it couldn't be painted the same way again
+    if (stroke.masked()) {
+        layer.forgetStrokes();
+        return;
+    }
+    layer.strokes.push_back(stroke.record());
+}
+
+// Mark an area that needs to be recomposited
+void LayerStack::markDirty(SDL_Rect rect) {
+    dirty = unionRect(dirty, intersectRect(rect, {0, 0, w, h}));
+}
+
+// Recomposite the dirty area, including the stroke currently being painted on the active layer (if there is one)
+// and the paste floating above it (if there is one)
+// Returns the area that changed, which has a width of 0 if nothing changed
+SDL_Rect LayerStack::recomposite(const BrushStroke* stroke, const FloatingPaste* paste) {
+    SDL_Rect changed = dirty;
+    dirty = {0, 0, 0, 0};
+    if (changed.w == 0) return changed;
+    
+    compositeRect(changed, &composite_pixels[changed.y * w + changed.x], w * sizeof(Uint32), stroke, nullptr, paste);
+    return changed;
+}
+
+// Composite an area of the layers into pixels, along with the stroke, paste and adjustment preview (if there are any)
+void LayerStack::compositeRect(SDL_Rect rect, Uint32* pixels, int pitch, const BrushStroke* stroke, const ColorAdjustment* preview, const FloatingPaste* paste) const {
+    if (rect.w <= 0 || rect.h <= 0) return;
+    
+    bool painting = stroke != nullptr && stroke->active();
+    bool pasting = paste != nullptr && paste->active();
+    
+    // Row of the active layer with the stroke blended on top and the preview applied
+    Uint32 stroke_row[tile_size];
+    
+    // Work one tile at a time, so empty tiles of each layer can be skipped entirely
+    for (int ty = rect.y / tile_size; ty <= (rect.y + rect.h - 1) / tile_size; ty++) {
+        for (int tx = rect.x / tile_size; tx <= (rect.x + rect.w - 1) / tile_size; tx++) {
+            // Part of the dirty area inside this tile
+            SDL_Rect part = intersectRect(rect, {tx * tile_size, ty * tile_size, tile_size, tile_size});
+            bool stroke_here = painting && intersectRect(part, stroke->area()).w > 0;
+            bool paste_here = pasting && intersectRect(part, paste->area()).w > 0;
+            
+            for (int y = part.y; y < part.y + part.h; y++) {
+                // Start from transparent and blend each layer on top, bottom to top
+                Uint32* out = getPixel(pixels, pitch, part.x - rect.x, y - rect.y);
+                std::fill(out, out + part.w, 0);
+                
+                for (int i = 0; i < (int)layers.size(); i++) {
+                    const Layer& layer = layers[i];
+                    if (!layer.visible || layer.opacity <= 0) continue;
+                    
+                    const Uint32* t = layer.image.tile(tx, ty);
+                    bool with_stroke = stroke_here && i == active;
+                    bool with_paste = paste_here && i == active;
+                    
+                    // Empty tile, nothing to blend
+                    if (t == nullptr && !with_stroke && !with_paste) continue;
+                    
+                    const Uint32* src = t ? &t[(y - ty * tile_size) * tile_size + part.x - tx * tile_size] : nullptr;
+                    
+                    // The stroke being painted isn't part of the layer yet, so blend it onto a copy of the row
+                    if (with_stroke) {
+                        if (src) std::copy(src, src + part.w, stroke_row);
+                        else std::fill(stroke_row, stroke_row + part.w, 0);
+                        stroke->blendOver(stroke_row, part.x, y, part.w);
+                        src = stroke_row;
+                    }
+                    
+                    // The paste isn't part of the layer until it's committed either
+                    if (with_paste) {
+                        if (src == nullptr) std::fill(stroke_row, stroke_row + part.w, 0);
+                        else if (src != stroke_row) std::copy(src, src + part.w, stroke_row);
+                        paste->blendOver(stroke_row, part.x, y, part.w);
+                        src = stroke_row;
+                    }
+                    
+                    // Same for the preview, which only changes the copy of the row
+                    if (preview != nullptr && i == active) {
+                        if (src != stroke_row) std::copy(src, src + part.w, stroke_row);
+                        preview->apply(stroke_row, part.w);
+                        src = stroke_row;
+                    }
+                    
+                    blendRow(layer.blend_mode, out, src, part.w, std::round(layer.opacity * 255));
+                }
+            }
+        }
+    }
+}
+
+// Compress every layer and free the composite
+void LayerStack::pack() {
+    for (Layer& layer : layers) layer.image.pack();
+    
+    composite_pixels.clear();
+    composite_pixels.shrink_to_fit();
+    composite_memory.set(0);
+    dirty = {0, 0, 0, 0};
+}
+
+// Decompress every layer and recomposite everything
+void LayerStack::unpack() {
+    if (!packed()) return;
+    
+    for (Layer& layer : layers) layer.image.unpack();
+    resize(w, h);
+}
+
+// Change the size of the document, every layer should already have the new size
+void LayerStack::resize(int w, int h) {
+    this->w = w;
+    this->h = h;
+    composite_pixels.assign(w * h, 0);
+    composite_memory.set(composite_pixels.size() * sizeof(Uint32));
+    markAllDirty();
+}
+
+// Blending formulas, all colors are premultiplied and between 0 and 255
+// Normal:      s + d * (255 - sa)
+// Multiply:    s * d + s * (255 - da) + d * (255 - sa)
+// Screen:      s + d - s * d
+// Add:         s + d
+// Every product is divided by 255 afterwards, and alpha uses the same formulas which always give sa + da - sa * da
+// (except for Add, which is just capped at 255)
+
+#ifdef __SSE2__
+// Rounded x / 255 for each 16 bit lane, exact for 0 <= x <= 255*255
+static inline __m128i div255(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Copy the alpha of each pixel into all four of its 16 bit lanes
+// RGBA8888 has alpha in the lowest byte, which is the first lane of each pixel
+static inline __m128i broadcastAlpha(__m128i x) {
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0), 0);
+}
+
+// Blend two pixels that are widened to 16 bits per channel
+template <BlendMode mode>
+static inline __m128i blendPixels(__m128i s, __m128i d) {
+    const __m128i v255 = _mm_set1_epi16(255);
+    __m128i sa = broadcastAlpha(s);
+    
+    switch (mode) {
+        case BlendMode::Normal:
+            return _mm_add_epi16(s, div255(_mm_mullo_epi16(d, _mm_sub_epi16(v255, sa))));
+        case BlendMode::Multiply: {
+            __m128i da = broadcastAlpha(d);
+            __m128i sd = div255(_mm_mullo_epi16(s, d));
+            __m128i s_only = div255(_mm_mullo_epi16(s, _mm_sub_epi16(v255, da)));
+            __m128i d_only = div255(_mm_mullo_epi16(d, _mm_sub_epi16(v255, sa)));
+            return _mm_add_epi16(sd, _mm_add_epi16(s_only, d_only));
+        }
+        case BlendMode::Screen:
+            return _mm_sub_epi16(_mm_add_epi16(s, d), div255(_mm_mullo_epi16(s, d)));
+        case BlendMode::Add:
+            return _mm_add_epi16(s, d);
+    }
+    return d;
+}
+#endif
+
+// Blend a single channel, same formulas as above
+template <BlendMode mode>
+static inline int blendChannel(int s, int d, int sa, int da) {
+    auto div = [](int x) { x += 128; return (x + (x >> 8)) >> 8; };
+    
+    switch (mode) {
+        case BlendMode::Normal: return s + div(d * (255 - sa));
+        case BlendMode::Multiply: return div(s * d) + div(s * (255 - da)) + div(d * (255 - sa));
+        case BlendMode::Screen: return s + d - div(s * d);
+        case BlendMode::Add: return s + d;
+    }
+    return d;
+}
+
+// Blend a row with a fixed blend mode, so the switch above is resolved at compile time
+template <BlendMode mode>
+static void blendRowMode(Uint32* dest, const Uint32* src, int count, int opacity) {
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i opacity_16 = _mm_set1_epi16(opacity);
+    
+    // Process 4 pixels at a time, widened to 16 bits per channel so multiplications don't overflow
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)&src[i]);
+        __m128i d = _mm_loadu_si128((const __m128i*)&dest[i]);
+        
+        __m128i s_lo = _mm_unpacklo_epi8(s, zero), s_hi = _mm_unpackhi_epi8(s, zero);
+        __m128i d_lo = _mm_unpacklo_epi8(d, zero), d_hi = _mm_unpackhi_epi8(d, zero);
+        
+        // Scale the source by the layer opacity
+        if (opacity < 255) {
+            s_lo = div255(_mm_mullo_epi16(s_lo, opacity_16));
+            s_hi = div255(_mm_mullo_epi16(s_hi, opacity_16));
+        }
+        
+        // Pack back down to 8 bits, which also caps every channel at 255
+        __m128i result = _mm_packus_epi16(blendPixels<mode>(s_lo, d_lo), blendPixels<mode>(s_hi, d_hi));
+        _mm_storeu_si128((__m128i*)&dest[i], result);
+    }
+#endif
+
+    // Scalar version for the remaining pixels, or every pixel if SSE2 isn't available
+    auto div = [](int x) { x += 128; return (x + (x >> 8)) >> 8; };
+    for (; i < count; i++) {
+        int s[4], d[4];
+        for (int c = 0; c < 4; c++) {
+            s[c] = div(((src[i] >> (c * 8)) & 0xFF) * opacity);
+            d[c] = (dest[i] >> (c * 8)) & 0xFF;
+        }
+        
+        // Alpha is the lowest byte (c = 0)
+        Uint32 result = 0;
+        for (int c = 0; c < 4; c++) {
+            int value = std::clamp(blendChannel<mode>(s[c], d[c], s[0], d[0]), 0, 255);
+            result |= (Uint32)value << (c * 8);
+        }
+        dest[i] = result;
+    }
+}
+
+// Blend a row of premultiplied pixels onto another row using a blend mode, with src scaled by opacity (0 to 255)
+void blendRow(BlendMode mode, Uint32* dest, const Uint32* src, int count, int opacity) {
+    switch (mode) {
+        case BlendMode::Normal: blendRowMode<BlendMode::Normal>(dest, src, count, opacity); break;
+        case BlendMode::Multiply: blendRowMode<BlendMode::Multiply>(dest, src, count, opacity); break;
+        case BlendMode::Screen: blendRowMode<BlendMode::Screen>(dest, src, count, opacity); break;
+        case BlendMode::Add: blendRowMode<BlendMode::Add>(dest, src, count, opacity); break;
+    }
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "image.hpp"
+#include "stroke.hpp"
+#include "adjustments.hpp"
+#include "memory.hpp"
+
+#include <SDL3/SDL.h>
+
+#include <string>
+#include <vector>
+
+// Forward declaration
+class FloatingPaste;
+
+// How a layer is combined with the layers below it
+enum class BlendMode {
+    Normal,
+    Multiply,
+    Screen,
+    Add
+};
+
+// Names of each blend mode, in the same order as the enum
+extern const char* blend_mode_names[4];
+
+// A single layer of the document
+struct Layer {
+    std::string name;
+    TiledImage image;                           // Pixels of the layer, only painted tiles take up memory
+    float opacity = 1;                          // Opacity of the whole layer between 0 and 1
+    BlendMode blend_mode = BlendMode::Normal;   // How the layer is combined with the layers below it
+    bool visible = true;                        // Hidden layers aren't part of the composite
+    
+    // Every stroke painted on the layer, so it can be painted again crisply at a new size instead of being stretched
+    // Only kept while the layer is nothing but strokes on top of a solid base color. Anything else that changes
+    // the pixels (fills, opened images, strokes limited by a selection...) has to call forgetStrokes().
+    bool has_strokes = true;                    // Are the strokes still a complete description of the layer?
+    Uint32 base_color = 0;                      // Color under all of the strokes, premultiplied
+    std::vector<StrokeRecord> strokes;
+    
+    // The layer has been changed in a way the strokes can't describe, so from now on it's only pixels
+    // Has to be called before any change to the pixels that isn't a recorded stroke, like shapes, fills, filters,
+    // adjustments and pastes, otherwise resizing would paint the strokes again and lose the change
+    void forgetStrokes() { has_strokes = false; strokes.clear(); strokes.shrink_to_fit(); }
+};
+
+// Stack of layers that make up the document, along with a cached composite of all of them
+// The composite is only recalculated inside areas that were marked dirty, so a frame where nothing
+// changed doesn't touch any pixels and a brush stroke only recomposites the area under the brush
+class LayerStack {
+public:
+    // Replace all layers with a single opaque background layer of the given size and color
+    void reset(int w, int h, Uint32 background);
+    
+    // Replace all layers with the given ones, which must all have the given size
+    void replace(std::vector<Layer> layers, int w, int h, int active);
+    
+    // Scale every layer to a new size
+    // Layers that are only strokes are painted again at the new size, the rest are stretched
+    void scale(int w, int h);
+    
+    // Copy of every visible layer scaled to a new size in the same way as scale(), with the composite already worked out
+    // Used to export at a higher resolution without touching the document
+    LayerStack scaledCopy(int w, int h) const;
+    
+    // Crop or extend every layer to a new size without scaling, with the old top-left corner at the given offset
+    // New area is transparent, except on the bottom layer where it is filled with the given color
+    // Cropping anything off makes every layer plain pixels
+    void place(int w, int h, int offset_x, int offset_y, Uint32 fill);
+    
+    // Rotate or mirror every layer, rotating by 90 or 270 degrees swaps the width and height
+    // Strokes can only be moved and scaled, not rotated or mirrored, so every layer becomes plain pixels
+    void transform(ImageTransform transform);
+    
+    // Getters for width and height of the document
+    int width() const { return w; }
+    int height() const { return h; }
+    
+    // Layers from bottom to top
+    std::vector<Layer> layers;
+    
+    // Index of the layer that drawing tools paint on
+    int active = 0;
+    Layer& activeLayer() { return layers[active]; }
+    
+    // Add a new transparent layer above the active layer and make it active
+    void addLayer();
+    
+    // Delete the active layer, the last layer can't be deleted
+    void deleteLayer();
+    
+    // Move the active layer up or down in the stack by swapping it with its neighbor
+    void moveLayer(int direction);
+    
+    // Keep a stroke that was just committed to the active layer, so the layer can be painted again at another size
+    void recordStroke(const BrushStroke& stroke);
+    
+    // Mark an area that needs to be recomposited
+    void markDirty(SDL_Rect rect);
+    void markAllDirty() { markDirty({0, 0, w, h}); }
+    
+    // Recomposite the dirty area, including the stroke currently being painted on the active layer (if there is one)
+    // If a paste is given, it's blended on top of the active layer without changing the layer
+    // Returns the area that changed, which has a width of 0 if nothing changed
+    SDL_Rect recomposite(const BrushStroke* stroke, const FloatingPaste* paste = nullptr);
+    
+    // Composite an area of the layers into pixels, which has the given pitch in bytes, the same way recomposite() does
+    // If an adjustment is given, it's applied to the active layer as a preview, leaving both the layer and the cached
+    // composite alone, so anything that reads the composite never sees the preview
+    void compositeRect(SDL_Rect rect, Uint32* pixels, int pitch, const BrushStroke* stroke, const ColorAdjustment* preview, const FloatingPaste* paste) const;
+    
+    // Cached composite of all visible layers, w*h premultiplied RGBA8888 pixels with no padding
+    const Uint32* composite() const { return composite_pixels.data(); }
+    
+    // Compress every layer and free the composite, for a document that isn't being viewed
+    // Nothing can be drawn or composited until the stack is unpacked again, which recomposites everything
+    void pack();
+    void unpack();
+    bool packed() const { return !layers.empty() && layers[0].image.packed(); }
+
+private:
+    // Scale the pixels and strokes of a single layer to a new size
+    Layer scaledLayer(const Layer& layer, int w, int h) const;
+    
+    // Change the size of the document, every layer should already have the new size
+    void resize(int w, int h);
+    
+    int w = 0, h = 0;
+    
+    // Number of layers ever created, so new layers get unique names
+    int layers_created = 0;
+    
+    std::vector<Uint32> composite_pixels;
+    MemoryUsage composite_memory{MemoryCategory::Canvas};
+    SDL_Rect dirty{0, 0, 0, 0};
+};
+
+// Blend a row of premultiplied pixels onto another row using a blend mode, with src scaled by opacity (0 to 255)
+void blendRow(BlendMode mode, Uint32* dest, const Uint32* src, int count, int opacity);
@@ -2,9 +2,34 @@
 #include "gui.hpp"
 #include "backend.hpp"
 #include "texture.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+#include "memory.hpp"
+#include "startup.hpp"
 
-int main(int, char**)
+#include <cstring>
+#include <iostream>
+
+int main(int argc, char** argv)
 {
+    // Command line options
+    for (int i = 1; i < argc; i++) {
+        // --trace out.json records a timeline of every frame that can be opened in a trace viewer
+        if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+#ifdef PAINT_PROFILER
+            Tracer::get().start(argv[++i]);
+#else
+            std::cout << "Tracing is not available, build with PAINT_PROFILER turned on" << std::endl;
+            i++;
+#endif
+        }
+        // --startup-trace prints how long each phase of startup takes to stderr
+        else if (std::strcmp(argv[i], "--startup-trace") == 0) {
+            enableStartupTrace();
+        }
+    }
+    startupPhase("Command line parsed");
+    
     // Create object which represents lifetime of GUI libraries.
     // This initializes SDL and ImGui, along with creating a window and SDL renderer.
     // SDL and ImGui will be cleaned up when this object goes out of scope.
@@ -15,19 +40,47 @@ int main(int, char**)
 
     // Initializes the state and creates some required objects e.g. canvas and icon textures
     backendInit(&state);
+    startupPhase("backendInit");
     
     // Main loop
+    // The three parts of each frame are only traced, not profiled. They contain every other stage, so as profiler
+    // stages they would always be the biggest ones and hide which stage inside them was actually slow
     while (!state.should_quit) {
         // Draw the GUI to the screen
-        guiDraw(&state);
+        {
+            TRACE_SCOPE("guiDraw");
+            guiDraw(&state);
+        }
         
         // Renders the GUI to the window
-        guiPresent(&state);
+        {
+            TRACE_SCOPE("guiPresent");
+            guiPresent(&state);
+        }
+        
+        // Report startup time once the first frame has been presented
+        startupFinished();
         
         // Process events that happened e.g. if user dragged mouse to draw
-        backendProcess(&state);
+        {
+            TRACE_SCOPE("backendProcess");
+            backendProcess(&state);
+        }
+        
+        // Push this frame's timings into the profiler history
+        PROFILE_FRAME_END();
     }
+    
+    // Let a save that is still being written finish before anything is destroyed
+    backendShutdown(&state);
 
+    // Print how much memory is still in use and the peaks, so leaks and spikes show up after a session
+    // The open document is still alive at this point, so it counts as in use
+    dumpMemoryStats(std::cout);
+    
+    // Write out anything left in the trace buffer, does nothing if tracing wasn't turned on
+    Tracer::get().stop();
+    
     // Return no error if application quit normally
     return 0;
 }
\ No newline at end of file
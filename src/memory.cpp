@@ -0,0 +1,112 @@
+#include "memory.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <string>
+#include <stdexcept>
+
+// Names of each category, in the same order as the enum
+const char* memory_category_names[(int)MemoryCategory::Count] = {"Canvas", "Layers", "Brush", "Icons", "Temporary", "Pool", "Packed", "Clipboard"};
+
+// Counters for each category, atomic so allocations can be tracked from worker threads without a lock
+struct CategoryCounters {
+    std::atomic<size_t> bytes{0};
+    std::atomic<size_t> count{0};
+    std::atomic<size_t> peak_bytes{0};
+};
+static CategoryCounters counters[(int)MemoryCategory::Count];
+
+// Category and size of every surface created with createSurface(), so destroySurface() knows what to subtract
+static std::mutex surfaces_mutex;
+static std::unordered_map<SDL_Surface*, std::pair<MemoryCategory, size_t>> surfaces;
+
+// Record an allocation of pixel memory
+void trackAlloc(MemoryCategory category, size_t bytes) {
+    if (bytes == 0) return;
+    
+    CategoryCounters& c = counters[(int)category];
+    size_t now = c.bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    c.count.fetch_add(1, std::memory_order_relaxed);
+    
+    // Raise the peak if this is a new high, retrying if another thread changed it in the meantime
+    size_t peak = c.peak_bytes.load(std::memory_order_relaxed);
+    while (now > peak && !c.peak_bytes.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {}
+}
+
+// Record a free of pixel memory
+void trackFree(MemoryCategory category, size_t bytes) {
+    if (bytes == 0) return;
+    
+    CategoryCounters& c = counters[(int)category];
+    c.bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    c.count.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Get the current usage of a category
+MemoryStats memoryStats(MemoryCategory category) {
+    CategoryCounters& c = counters[(int)category];
+    return {c.bytes.load(std::memory_order_relaxed), c.count.load(std::memory_order_relaxed), c.peak_bytes.load(std::memory_order_relaxed)};
+}
+
+// Print the usage of every category
+void dumpMemoryStats(std::ostream& out) {
+    out << "Pixel memory (current / peak):" << std::endl;
+    for (int i = 0; i < (int)MemoryCategory::Count; i++) {
+        MemoryStats stats = memoryStats((MemoryCategory)i);
+        out << "  " << memory_category_names[i] << ": "
+            << stats.bytes / 1024 << " KiB in " << stats.count << " allocations / "
+            << stats.peak_bytes / 1024 << " KiB peak" << std::endl;
+    }
+}
+
+// Moving takes over the tracked bytes, since the buffer it describes moves too
+MemoryUsage& MemoryUsage::operator=(MemoryUsage&& other) {
+    if (this != &other) {
+        set(0);
+        category = other.category;
+        bytes = other.bytes;
+        other.bytes = 0;
+    }
+    return *this;
+}
+
+// Change the number of bytes in the buffer
+void MemoryUsage::set(size_t new_bytes) {
+    if (new_bytes == bytes) return;
+    
+    // Counted as a new allocation replacing the old one, which is what resizing a vector does anyway
+    trackFree(category, bytes);
+    trackAlloc(category, new_bytes);
+    bytes = new_bytes;
+}
+
+// Create a surface and record its pixels under a category
+SDL_Surface* createSurface(int w, int h, SDL_PixelFormat format, MemoryCategory category) {
+    SDL_Surface* surface = SDL_CreateSurface(w, h, format);
+    
+    // Throw error if surface could not be created
+    if (surface == nullptr)
+        throw std::runtime_error(std::string("Error: SDL_CreateSurface(): ") + SDL_GetError());
+    
+    size_t bytes = (size_t)surface->pitch * surface->h;
+    trackAlloc(category, bytes);
+    
+    std::lock_guard<std::mutex> lock(surfaces_mutex);
+    surfaces[surface] = {category, bytes};
+    return surface;
+}
+
+// Destroy a surface that was created with createSurface()
+void destroySurface(SDL_Surface* surface) {
+    {
+        std::lock_guard<std::mutex> lock(surfaces_mutex);
+        auto found = surfaces.find(surface);
+        if (found != surfaces.end()) {
+            trackFree(found->second.first, found->second.second);
+            surfaces.erase(found);
+        }
+    }
+    SDL_DestroySurface(surface);
+}
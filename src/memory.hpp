@@ -0,0 +1,69 @@
+#pragma once
+
+#include <SDL3/SDL.h>
+
+#include <cstddef>
+#include <ostream>
+
+// What a block of pixel memory is used for
+enum class MemoryCategory {
+    Canvas,     // Canvas texture and the composite of all layers
+    Layers,     // Tiles of every layer
+    Brush,      // Brush masks, previews, and the stroke coverage buffer
+    Icons,      // Tool icons
+    Temporary,  // Short-lived buffers e.g. loading and saving images, fill readbacks
+    Pool,       // Idle textures and buffers kept around to be reused
+    Packed,     // Compressed tiles of documents that aren't being viewed
+    Clipboard,  // Pixels that were copied, shared with any pastes of them
+    Count       // Number of categories, not a category itself
+};
+
+// Names of each category, in the same order as the enum
+extern const char* memory_category_names[(int)MemoryCategory::Count];
+
+// Memory usage of a single category
+struct MemoryStats {
+    size_t bytes;       // Bytes currently allocated
+    size_t count;       // Number of allocations currently alive
+    size_t peak_bytes;  // Most bytes ever allocated at once
+};
+
+// Record an allocation or free of pixel memory, safe to call from any thread
+void trackAlloc(MemoryCategory category, size_t bytes);
+void trackFree(MemoryCategory category, size_t bytes);
+
+// Get the current usage of a category
+MemoryStats memoryStats(MemoryCategory category);
+
+// Print the usage of every category
+void dumpMemoryStats(std::ostream& out);
+
+// Keeps track of the size of a buffer that is owned by something else, such as a std::vector member
+// Call set() whenever the buffer is resized and the tracker stays in sync, the memory is counted as freed when this is destroyed
+class MemoryUsage {
+public:
+    MemoryUsage(MemoryCategory category) : category(category) {}
+    ~MemoryUsage() { set(0); }
+    
+    // Moving takes over the tracked bytes, since the buffer it describes moves too
+    MemoryUsage(MemoryUsage&& other) : category(other.category), bytes(other.bytes) { other.bytes = 0; }
+    MemoryUsage& operator=(MemoryUsage&& other);
+    
+    // Copying isn't allowed, since it would count the same buffer twice
+    MemoryUsage(const MemoryUsage&) = delete;
+    MemoryUsage& operator=(const MemoryUsage&) = delete;
+    
+    // Change the number of bytes in the buffer
+    void set(size_t new_bytes);
+
+private:
+    MemoryCategory category;
+    size_t bytes = 0;
+};
+
+// Create a surface and record its pixels under a category, must be destroyed with destroySurface()
+// Throws if the surface can't be created
+SDL_Surface* createSurface(int w, int h, SDL_PixelFormat format, MemoryCategory category);
+
+// Destroy a surface that was created with createSurface()
+void destroySurface(SDL_Surface* surface);
@@ -0,0 +1,163 @@
+#include "pool.hpp"
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <stdexcept>
+
+// Most idle memory kept in each pool, enough for a few full-size scratch buffers of a large canvas
+static const size_t max_idle_bytes = 256 * 1024 * 1024;
+
+// Everything that has to match for a pooled texture to be reused
+struct TextureKey {
+    SDL_Renderer* renderer;
+    SDL_PixelFormat format;
+    SDL_TextureAccess access;
+    int w, h;
+    
+    bool operator==(const TextureKey& other) const {
+        return std::tie(renderer, format, access, w, h) == std::tie(other.renderer, other.format, other.access, other.w, other.h);
+    }
+};
+
+// Idle textures and buffers, most recently returned at the front
+// Pools only hold a handful of entries, so walking the list is cheaper than keeping an index
+static std::mutex pool_mutex;
+static std::list<std::pair<TextureKey, SDL_Texture*>> idle_textures;
+static std::list<std::pair<size_t, std::unique_ptr<Uint8[]>>> idle_buffers;
+static size_t idle_texture_bytes = 0;
+static size_t idle_buffer_bytes = 0;
+
+// Bytes used by a pooled texture, always 4 bytes per pixel
+static size_t textureBytes(const TextureKey& key) {
+    return (size_t)key.w * key.h * sizeof(Uint32);
+}
+
+// Get a texture from the pool, or create a new one if there's no idle texture that matches
+SDL_Texture* acquireTexture(SDL_Renderer* renderer, SDL_PixelFormat format, SDL_TextureAccess access, int w, int h) {
+    TextureKey key{renderer, format, access, w, h};
+    SDL_Texture* texture = nullptr;
+    
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        for (auto it = idle_textures.begin(); it != idle_textures.end(); it++) {
+            if (it->first == key) {
+                texture = it->second;
+                idle_textures.erase(it);
+                idle_texture_bytes -= textureBytes(key);
+                trackFree(MemoryCategory::Pool, textureBytes(key));
+                break;
+            }
+        }
+    }
+    
+    if (texture == nullptr) {
+        // Nothing to reuse, so this is the only place a driver allocation happens
+        texture = SDL_CreateTexture(renderer, format, access, w, h);
+        if (texture == nullptr)
+            throw std::runtime_error(std::string("Error: SDL_CreateTexture(): ") + SDL_GetError());
+    }
+    
+    // Whoever used the texture last might have changed how it's drawn, so put everything back to the defaults
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    SDL_SetTextureColorModFloat(texture, 1, 1, 1);
+    SDL_SetTextureAlphaModFloat(texture, 1);
+    SDL_SetTextureScaleMode(texture, SDL_SCALEMODE_LINEAR);
+    
+    return texture;
+}
+
+// Return a texture to the pool
+void releaseTexture(SDL_Texture* texture) {
+    // Access mode isn't a field of SDL_Texture, but it's stored in the texture's properties
+    SDL_TextureAccess access = (SDL_TextureAccess)SDL_GetNumberProperty(SDL_GetTextureProperties(texture), SDL_PROP_TEXTURE_ACCESS_NUMBER, SDL_TEXTUREACCESS_STATIC);
+    TextureKey key{SDL_GetRendererFromTexture(texture), texture->format, access, texture->w, texture->h};
+    
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    idle_textures.emplace_front(key, texture);
+    idle_texture_bytes += textureBytes(key);
+    trackAlloc(MemoryCategory::Pool, textureBytes(key));
+    
+    // Free the textures that have been idle the longest until the pool is under its cap
+    while (idle_texture_bytes > max_idle_bytes) {
+        auto& [old_key, old_texture] = idle_textures.back();
+        idle_texture_bytes -= textureBytes(old_key);
+        trackFree(MemoryCategory::Pool, textureBytes(old_key));
+        SDL_DestroyTexture(old_texture);
+        idle_textures.pop_back();
+    }
+}
+
+// Get a block of memory from the pool, or allocate a new one if there's no idle block with the same size
+std::unique_ptr<Uint8[]> acquireBuffer(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        for (auto it = idle_buffers.begin(); it != idle_buffers.end(); it++) {
+            if (it->first == bytes) {
+                std::unique_ptr<Uint8[]> buffer = std::move(it->second);
+                idle_buffers.erase(it);
+                idle_buffer_bytes -= bytes;
+                trackFree(MemoryCategory::Pool, bytes);
+                return buffer;
+            }
+        }
+    }
+    
+    // Not initialized, since every user overwrites it anyway
+    return std::unique_ptr<Uint8[]>(new Uint8[bytes]);
+}
+
+// Return a block of memory of the given size to the pool
+void releaseBuffer(std::unique_ptr<Uint8[]> buffer, size_t bytes) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    idle_buffers.emplace_front(bytes, std::move(buffer));
+    idle_buffer_bytes += bytes;
+    trackAlloc(MemoryCategory::Pool, bytes);
+    
+    // Free the buffers that have been idle the longest until the pool is under its cap
+    while (idle_buffer_bytes > max_idle_bytes) {
+        idle_buffer_bytes -= idle_buffers.back().first;
+        trackFree(MemoryCategory::Pool, idle_buffers.back().first);
+        idle_buffers.pop_back();
+    }
+}
+
+// Free every idle texture and buffer
+void clearPools() {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    
+    for (auto& [key, texture] : idle_textures) {
+        trackFree(MemoryCategory::Pool, textureBytes(key));
+        SDL_DestroyTexture(texture);
+    }
+    idle_textures.clear();
+    idle_texture_bytes = 0;
+    
+    for (auto& [bytes, buffer] : idle_buffers) {
+        trackFree(MemoryCategory::Pool, bytes);
+    }
+    idle_buffers.clear();
+    idle_buffer_bytes = 0;
+}
+
+// Borrow a buffer from the pool
+PooledBuffer::PooledBuffer(size_t bytes, MemoryCategory category) : buffer(acquireBuffer(bytes)), bytes(bytes), usage(category) {
+    usage.set(bytes);
+}
+
+// Give the buffer back to the pool, unless it was moved out
+PooledBuffer::~PooledBuffer() {
+    if (buffer) releaseBuffer(std::move(buffer), bytes);
+}
+
+// Give the current buffer back to the pool before taking over the other one, so it isn't freed
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) {
+    if (this == &other) return *this;
+    
+    if (buffer) releaseBuffer(std::move(buffer), bytes);
+    buffer = std::move(other.buffer);
+    bytes = other.bytes;
+    usage = std::move(other.usage);
+    return *this;
+}
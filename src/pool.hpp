@@ -0,0 +1,53 @@
+#pragma once
+
+#include "memory.hpp"
+
+#include <SDL3/SDL.h>
+
+#include <memory>
+#include <cstddef>
+
+// Pools of textures and pixel buffers that are reused instead of being freed, so that operations which need a
+// full-size scratch buffer every time (fill, save, brush previews...) don't go back to the driver or the heap.
+// Both pools are keyed by exact size (and format for textures), since the canvas size rarely changes.
+// Idle memory in the pools is capped, and the least recently returned entries are freed first once it's over the cap.
+
+// Get a texture from the pool, or create a new one if there's no idle texture with the same renderer, format, access and size
+// Blend mode, color and alpha modulation, and scale mode are reset to their defaults. The pixels are not.
+// Throws if a new texture can't be created
+SDL_Texture* acquireTexture(SDL_Renderer* renderer, SDL_PixelFormat format, SDL_TextureAccess access, int w, int h);
+
+// Return a texture to the pool
+void releaseTexture(SDL_Texture* texture);
+
+// Get a block of memory from the pool, or allocate a new one if there's no idle block with the same size
+std::unique_ptr<Uint8[]> acquireBuffer(size_t bytes);
+
+// Return a block of memory of the given size to the pool
+void releaseBuffer(std::unique_ptr<Uint8[]> buffer, size_t bytes);
+
+// Free every idle texture and buffer
+// Must be called before the renderer is destroyed, since pooled textures belong to it
+void clearPools();
+
+// Scratch pixel buffer borrowed from the pool and given back when it goes out of scope
+// Its memory is counted under the given category while borrowed. The contents start out undefined.
+class PooledBuffer {
+public:
+    PooledBuffer(size_t bytes, MemoryCategory category = MemoryCategory::Temporary);
+    ~PooledBuffer();
+    
+    // Move-only, since only one owner can give the buffer back
+    PooledBuffer(PooledBuffer&& other) = default;
+    PooledBuffer& operator=(PooledBuffer&& other);
+    
+    // Getters for the memory, the memory as RGBA8888 pixels, and the size in bytes
+    void* data() { return buffer.get(); }
+    Uint32* pixels() { return (Uint32*)buffer.get(); }
+    size_t size() const { return bytes; }
+
+private:
+    std::unique_ptr<Uint8[]> buffer;
+    size_t bytes;
+    MemoryUsage usage;
+};
@@ -0,0 +1,69 @@
+#include "profiler.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+// The one profiler used by the whole program
+Profiler& Profiler::get() {
+    // Created the first time it's used, so it exists before any static stage IDs are registered
+    static Profiler profiler;
+    return profiler;
+}
+
+Profiler::Profiler() {
+    last_frame_end = SDL_GetPerformanceCounter();
+}
+
+// Get an ID for a named stage
+int Profiler::registerStage(const char* name) {
+    // Reuse the ID if a stage with this name already exists, e.g. the same stage timed in two places
+    for (int i = 0; i < stage_count; i++) {
+        if (std::strcmp(stage_names[i], name) == 0) return i;
+    }
+    
+    // Out of room, profiler_max_stages needs raising since stages sharing a slot would report each other's times
+    // If the assert is ignored, share the last stage rather than writing past the end
+    SDL_assert_always(stage_count < profiler_max_stages);
+    if (stage_count == profiler_max_stages) return profiler_max_stages - 1;
+    
+    stage_names[stage_count] = name;
+    return stage_count++;
+}
+
+// Finish the current frame and push it into the history
+void Profiler::endFrame() {
+    Uint64 now = SDL_GetPerformanceCounter();
+    current.duration = now - last_frame_end;
+    
+    // The whole frame is an event too, so stages line up under it in the trace
+    Tracer& tracer = Tracer::get();
+    if (tracer.enabled()) tracer.addEvent("frame", last_frame_end, now);
+    last_frame_end = now;
+    
+    // Write the frame into the next slot, and only then publish it by bumping the count
+    Uint64 count = frame_count.load(std::memory_order_relaxed);
+    frames[count % profiler_history] = current;
+    frame_count.store(count + 1, std::memory_order_release);
+    
+    current = ProfilerFrame();
+}
+
+// Copy up to max of the most recent finished frames into out, oldest first
+int Profiler::copyFrames(ProfilerFrame* out, int max) const {
+    Uint64 count = frame_count.load(std::memory_order_acquire);
+    
+    // The oldest slot is the next one to be overwritten, so leave it out in case it's being written right now
+    int available = (int)std::min<Uint64>(count, profiler_history - 1);
+    int n = std::min(available, max);
+    
+    for (int i = 0; i < n; i++) {
+        out[i] = frames[(count - n + i) % profiler_history];
+    }
+    return n;
+}
+
+// Convert performance counter ticks to milliseconds
+float Profiler::toMs(Uint64 ticks) {
+    static const double ms_per_tick = 1000.0 / SDL_GetPerformanceFrequency();
+    return ticks * ms_per_tick;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "trace.hpp"
+
+#include <SDL3/SDL.h>
+
+#include <atomic>
+
+// Maximum number of different stages that can be timed
+// Well above the number of PROFILE_SCOPE names in the program, registering more than this fails an assert
+const int profiler_max_stages = 128;
+
+// Number of frames kept in the history, older frames are overwritten
+const int profiler_history = 256;
+
+// Timings of a single frame, in performance counter ticks
+struct ProfilerFrame {
+    Uint64 duration = 0;                            // Time from the end of the last frame to the end of this one
+    Uint64 stage_time[profiler_max_stages] = {};    // Total time spent in each stage during the frame
+};
+
+// Collects how long each stage of the main loop takes, frame by frame
+// Stages are only timed on the main thread, worker threads should use TRACE_SCOPE instead. Finished frames go into a ring buffer with a single writer,
+// so the overlay (or anything else) can read the history without taking a lock.
+class Profiler {
+public:
+    // The one profiler used by the whole program
+    static Profiler& get();
+    
+    // Get an ID for a named stage, the name must be a string literal or otherwise live forever
+    // Calling this again with the same name returns the same ID
+    int registerStage(const char* name);
+    
+    // Add time spent in a stage to the current frame
+    void addTime(int stage, Uint64 ticks) { current.stage_time[stage] += ticks; }
+    
+    // Finish the current frame and push it into the history
+    void endFrame();
+    
+    // Number of stages registered so far, and their names
+    int stageCount() const { return stage_count; }
+    const char* stageName(int stage) const { return stage_names[stage]; }
+    
+    // Copy up to max of the most recent finished frames into out, oldest first
+    // Returns the number of frames copied
+    int copyFrames(ProfilerFrame* out, int max) const;
+    
+    // Convert performance counter ticks to milliseconds
+    static float toMs(Uint64 ticks);
+
+private:
+    Profiler();
+    
+    const char* stage_names[profiler_max_stages];
+    int stage_count = 0;
+    
+    // Frame currently being timed, and when the last frame ended
+    ProfilerFrame current;
+    Uint64 last_frame_end;
+    
+    // Ring buffer of finished frames and the total number of frames ever written to it
+    ProfilerFrame frames[profiler_history];
+    std::atomic<Uint64> frame_count{0};
+};
+
+// Times the scope it is created in and adds it to a stage of the current frame
+// Also records it as a trace event if tracing is turned on
+class ProfileScope {
+public:
+    ProfileScope(int stage, const char* name) : stage(stage), name(name), start(SDL_GetPerformanceCounter()) {}
+    ~ProfileScope() {
+        Uint64 end = SDL_GetPerformanceCounter();
+        Profiler::get().addTime(stage, end - start);
+        
+        Tracer& tracer = Tracer::get();
+        if (tracer.enabled()) tracer.addEvent(name, start, end);
+    }
+
+private:
+    int stage;
+    const char* name;
+    Uint64 start;
+};
+
+// Time the rest of the current scope as a named stage, e.g. PROFILE_SCOPE("handleDrawBrush")
+// The stage ID is looked up once and kept in a static, so each time through only reads the performance counter twice.
+// If PAINT_PROFILER isn't defined this expands to nothing, so the profiler costs nothing when compiled out.
+#ifdef PAINT_PROFILER
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) \
+    static const int PROFILE_CONCAT(profile_stage_, __LINE__) = Profiler::get().registerStage(name); \
+    ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(PROFILE_CONCAT(profile_stage_, __LINE__), name)
+#define PROFILE_FRAME_END() Profiler::get().endFrame()
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_FRAME_END()
+#endif
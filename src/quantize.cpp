@@ -0,0 +1,241 @@
+#include "quantize.hpp"
+#include "utils.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <mutex>
+#include <unordered_map>
+
+// Histogram bins use the top 5 bits of red, green and blue and the top 4 bits of alpha
+// Colors in the same bin are close enough to look the same, and every thread can still afford a histogram of its own
+static const int bin_count = 1 << 19;
+
+// Marks a bin that isn't part of any box yet
+static const Uint16 no_index = 0xFFFF;
+
+// Get the bin a color goes in
+static inline int binOf(Uint32 color) {
+    return ((color >> 27) << 14) | (((color >> 19) & 31) << 9) | (((color >> 11) & 31) << 4) | ((color >> 4) & 15);
+}
+
+// Position of a bin along an axis (0 is red, 1 green, 2 blue, 3 alpha)
+// Alpha only has 4 bits, so it's doubled to be on the same scale as the other axes
+static inline int binAxis(int bin, int axis) {
+    switch (axis) {
+        case 0: return bin >> 14;
+        case 1: return (bin >> 9) & 31;
+        case 2: return (bin >> 4) & 31;
+        default: return (bin & 15) * 2;
+    }
+}
+
+// Get a channel of a straight alpha RGBA8888 color, in the same order as the axes
+static inline int channel(Uint32 color, int c) {
+    return (color >> (24 - c * 8)) & 0xFF;
+}
+
+// Collect the distinct colors of the image, giving up as soon as there are more than max_colors
+// Flat color art usually has long runs of the same color, so the previous pixel is checked before the map
+static bool exactPalette(const Uint32* pixels, size_t count, int max_colors, std::unordered_map<Uint32, Uint8>& colors) {
+    Uint32 previous = 0;
+    bool have_previous = false;
+    
+    for (size_t i = 0; i < count; i++) {
+        if (have_previous && pixels[i] == previous) continue;
+        previous = pixels[i];
+        have_previous = true;
+        
+        if (colors.count(previous)) continue;
+        if ((int)colors.size() == max_colors) return false;
+        colors.emplace(previous, (Uint8)colors.size());
+    }
+    return true;
+}
+
+// Group of histogram bins that becomes a single palette color
+// Bins are stored in one array, and each box owns a range of it
+struct Box {
+    int begin, end;     // Range of bins in the box
+    int axis;           // Axis the bins are spread out the most along
+    int range;          // How far they're spread out along it
+};
+
+// Reduce a flat image to a palette of at most max_colors colors
+IndexedImage quantizeImage(const Uint32* pixels, int w, int h, int max_colors, bool dither) {
+    TRACE_SCOPE("quantizeImage");
+    
+    IndexedImage result;
+    result.w = w;
+    result.h = h;
+    result.indices.resize((size_t)w * h);
+    max_colors = std::clamp(max_colors, 2, 256);
+    
+    // Keep the colors exactly if there are few enough of them, which is often the case for flat color art
+    std::unordered_map<Uint32, Uint8> exact;
+    if (exactPalette(pixels, (size_t)w * h, max_colors, exact)) {
+        result.palette.resize(exact.size());
+        for (auto& [color, index] : exact) result.palette[index] = color;
+        
+        parallelFor(h, [&](int y0, int y1) {
+            for (size_t i = (size_t)y0 * w; i < (size_t)y1 * w; i++) result.indices[i] = exact.at(pixels[i]);
+        });
+        return result;
+    }
+    
+    // Count the pixels in each bin, every thread builds a histogram of its own rows and they're added together at the end
+    std::vector<Uint32> histogram(bin_count, 0);
+    std::mutex histogram_mutex;
+    parallelFor(h, [&](int y0, int y1) {
+        TRACE_SCOPE("quantizeHistogram");
+        
+        std::vector<Uint32> local(bin_count, 0);
+        for (size_t i = (size_t)y0 * w; i < (size_t)y1 * w; i++) local[binOf(pixels[i])]++;
+        
+        std::lock_guard<std::mutex> lock(histogram_mutex);
+        for (int bin = 0; bin < bin_count; bin++) histogram[bin] += local[bin];
+    });
+    
+    // Bins that have any pixels in them, with their counts
+    std::vector<std::pair<int, Uint32>> bins;
+    for (int bin = 0; bin < bin_count; bin++) {
+        if (histogram[bin] > 0) bins.emplace_back(bin, histogram[bin]);
+    }
+    
+    // Find the axis a box is spread out the most along
+    auto measure = [&](Box& box) {
+        box.range = -1;
+        for (int axis = 0; axis < 4; axis++) {
+            int lo = 64, hi = -1;
+            for (int i = box.begin; i < box.end; i++) {
+                lo = std::min(lo, binAxis(bins[i].first, axis));
+                hi = std::max(hi, binAxis(bins[i].first, axis));
+            }
+            if (hi - lo > box.range) {
+                box.range = hi - lo;
+                box.axis = axis;
+            }
+        }
+    };
+    
+    // Median cut: keep splitting the most spread out box in half by pixel count, until there are enough boxes
+    std::vector<Box> boxes(1, Box{0, (int)bins.size(), 0, 0});
+    measure(boxes[0]);
+    while ((int)boxes.size() < max_colors) {
+        auto widest = std::max_element(boxes.begin(), boxes.end(), [](const Box& a, const Box& b) { return a.range < b.range; });
+        if (widest->range <= 0) break; // Every box is a single bin, so there's nothing left to split
+        
+        Box& box = *widest;
+        int axis = box.axis;
+        std::sort(bins.begin() + box.begin, bins.begin() + box.end, [axis](const std::pair<int, Uint32>& a, const std::pair<int, Uint32>& b) {
+            return binAxis(a.first, axis) < binAxis(b.first, axis);
+        });
+        
+        // Split where half the pixels are on each side, leaving at least one bin in each half
+        Uint64 total = 0, half = 0;
+        for (int i = box.begin; i < box.end; i++) total += bins[i].second;
+        int split = box.begin + 1;
+        for (int i = box.begin; i < box.end - 1; i++) {
+            half += bins[i].second;
+            split = i + 1;
+            if (half * 2 >= total) break;
+        }
+        
+        Box upper{split, box.end, 0, 0};
+        box.end = split;
+        measure(box);
+        measure(upper);
+        boxes.push_back(upper);
+    }
+    
+    // Palette index of every bin
+    std::vector<Uint16> bin_index(bin_count, no_index);
+    for (int b = 0; b < (int)boxes.size(); b++) {
+        for (int i = boxes[b].begin; i < boxes[b].end; i++) bin_index[bins[i].first] = b;
+    }
+    
+    // Each palette color is the average of the pixels in its box, so colors that are used a lot come out exactly
+    std::vector<Uint64> sums(boxes.size() * 5, 0);
+    std::mutex sums_mutex;
+    parallelFor(h, [&](int y0, int y1) {
+        TRACE_SCOPE("quantizeAverage");
+        
+        std::vector<Uint64> local(boxes.size() * 5, 0);
+        for (size_t i = (size_t)y0 * w; i < (size_t)y1 * w; i++) {
+            Uint64* box_sums = &local[bin_index[binOf(pixels[i])] * 5];
+            for (int c = 0; c < 4; c++) box_sums[c] += channel(pixels[i], c);
+            box_sums[4]++;
+        }
+        
+        std::lock_guard<std::mutex> lock(sums_mutex);
+        for (size_t i = 0; i < sums.size(); i++) sums[i] += local[i];
+    });
+    for (size_t b = 0; b < boxes.size(); b++) {
+        Uint64* box_sums = &sums[b * 5];
+        Uint32 color = 0;
+        for (int c = 0; c < 4; c++) color |= (Uint32)((box_sums[c] + box_sums[4] / 2) / box_sums[4]) << (24 - c * 8);
+        result.palette.push_back(color);
+    }
+    
+    if (!dither) {
+        // Every pixel gets the color of the box its bin is in
+        parallelFor(h, [&](int y0, int y1) {
+            for (size_t i = (size_t)y0 * w; i < (size_t)y1 * w; i++) result.indices[i] = bin_index[binOf(pixels[i])];
+        });
+        return result;
+    }
+    
+    // Palette color closest to a color, for bins that none of the image's pixels were in
+    auto nearest = [&](Uint32 color) {
+        int best = 0, best_distance = INT_MAX;
+        for (int p = 0; p < (int)result.palette.size(); p++) {
+            int distance = 0;
+            for (int c = 0; c < 4; c++) {
+                int d = channel(color, c) - channel(result.palette[p], c);
+                distance += d * d;
+            }
+            if (distance < best_distance) {
+                best = p;
+                best_distance = distance;
+            }
+        }
+        return best;
+    };
+    
+    // Floyd-Steinberg dithering, which has to go in order since every pixel depends on the error of the ones before it
+    // Errors are kept 16 times bigger so they can be spread out in whole numbers, with a pixel of padding on each side
+    // Only color is dithered, since dithering alpha would leave specks around the edges of transparent areas
+    std::vector<int> current((w + 2) * 3, 0), next((w + 2) * 3, 0);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            Uint32 pixel = pixels[y * w + x];
+            
+            // The color this pixel should have once the error from its neighbors is added
+            int wanted[3];
+            Uint32 color = pixel & 0xFF;
+            for (int c = 0; c < 3; c++) {
+                wanted[c] = std::clamp(channel(pixel, c) + current[(x + 1) * 3 + c] / 16, 0, 255);
+                color |= (Uint32)wanted[c] << (24 - c * 8);
+            }
+            
+            int bin = binOf(color);
+            if (bin_index[bin] == no_index) bin_index[bin] = nearest(color);
+            int index = bin_index[bin];
+            result.indices[y * w + x] = index;
+            
+            // Spread the difference between the wanted and the actual color to the pixels that haven't been done yet
+            for (int c = 0; c < 3; c++) {
+                int error = wanted[c] - channel(result.palette[index], c);
+                current[(x + 2) * 3 + c] += error * 7;
+                next[x * 3 + c] += error * 3;
+                next[(x + 1) * 3 + c] += error * 5;
+                next[(x + 2) * 3 + c] += error;
+            }
+        }
+        
+        std::swap(current, next);
+        std::fill(next.begin(), next.end(), 0);
+    }
+    
+    return result;
+}
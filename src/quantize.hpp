@@ -0,0 +1,18 @@
+#pragma once
+
+#include <SDL3/SDL.h>
+
+#include <vector>
+
+// Image where every pixel is an index into a palette of at most 256 colors
+struct IndexedImage {
+    int w = 0, h = 0;
+    std::vector<Uint32> palette;    // Colors in straight alpha RGBA8888
+    std::vector<Uint8> indices;     // w*h palette indices with no padding
+};
+
+// Reduce a flat image of w*h straight alpha RGBA8888 pixels to a palette of at most max_colors colors (2 to 256)
+// If the image already has few enough colors they're kept exactly. Otherwise the palette is picked with median cut
+// on a histogram of the image, built by one thread per CPU core, and dithering spreads out the error of each pixel
+// so gradients don't turn into bands.
+IndexedImage quantizeImage(const Uint32* pixels, int w, int h, int max_colors, bool dither);
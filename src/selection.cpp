@@ -0,0 +1,310 @@
+#include "selection.hpp"
+#include "utils.hpp"
+
+#include <cmath>
+#include <map>
+#include <utility>
+
+// Create a selection with the given size where nothing is selected
+Selection::Selection(int w, int h) {
+    this->w = w;
+    this->h = h;
+    rows.resize(h);
+}
+
+// Add a span to a row, which is cropped to the selection width
+void Selection::addSpan(int y, int start, int end) {
+    start = std::max(start, 0);
+    end = std::min(end, w);
+    if (y < 0 || y >= h || start >= end) return;
+    
+    rows[y].push_back({start, end});
+}
+
+// Sort and merge the spans of every row so they're valid again after addSpan()
+void Selection::normalize() {
+    for (std::vector<Span>& row : rows) {
+        if (row.size() < 2) continue;
+        
+        std::sort(row.begin(), row.end(), [](const Span& a, const Span& b) { return a.start < b.start; });
+        
+        // Merge spans that overlap or touch into the previous one
+        size_t count = 1;
+        for (size_t i = 1; i < row.size(); i++) {
+            Span& last = row[count - 1];
+            if (row[i].start <= last.end) {
+                last.end = std::max(last.end, row[i].end);
+            } else {
+                row[count++] = row[i];
+            }
+        }
+        row.resize(count);
+    }
+}
+
+// Is nothing selected?
+bool Selection::empty() const {
+    return std::all_of(rows.begin(), rows.end(), [](const std::vector<Span>& row) { return row.empty(); });
+}
+
+// Smallest rect containing every selected pixel, has a width of 0 if nothing is selected
+SDL_Rect Selection::bounds() const {
+    SDL_Rect result{0, 0, 0, 0};
+    for (int y = 0; y < h; y++) {
+        if (rows[y].empty()) continue;
+        
+        // Spans are sorted, so the first and last span give the extent of the row
+        int start = rows[y].front().start;
+        int end = rows[y].back().end;
+        result = unionRect(result, {start, y, end - start, 1});
+    }
+    return result;
+}
+
+// Is a single pixel selected?
+bool Selection::contains(int x, int y) const {
+    if (x < 0 || x >= w || y < 0 || y >= h) return false;
+    
+    // Binary search for the last span that starts at or before x
+    const std::vector<Span>& row = rows[y];
+    auto it = std::upper_bound(row.begin(), row.end(), x, [](int x, const Span& span) { return x < span.start; });
+    return it != row.begin() && x < std::prev(it)->end;
+}
+
+// Build a selection from a rectangle, cropped to the selection size
+Selection rectSelection(int w, int h, SDL_Rect rect) {
+    Selection result(w, h);
+    rect = intersectRect(rect, {0, 0, w, h});
+    
+    // One span per row, already sorted
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        result.addSpan(y, rect.x, rect.x + rect.w);
+    }
+    return result;
+}
+
+// Build a selection from a closed polygon such as a lasso, using the even-odd rule
+// A pixel is selected if its center is inside the polygon
+Selection polygonSelection(int w, int h, const std::vector<ImVec2>& points) {
+    return contourSelection(w, h, {points}, FillRule::EvenOdd);
+}
+
+// An edge of a contour, as used by the scanline rasterizer
+struct ScanEdge {
+    int first_row, last_row;    // Rows whose center the edge crosses
+    float top_x, top_y;         // Upper end of the edge
+    float dx_dy;                // Change in x for every row
+    int winding;                // +1 if the edge goes down, -1 if it goes up
+};
+
+// Build a selection from any number of closed contours with a scanline rasterizer
+Selection contourSelection(int w, int h, const std::vector<std::vector<ImVec2>>& contours, FillRule rule) {
+    Selection result(w, h);
+    
+    // Edge table, every non-horizontal edge that crosses at least one row center inside the selection
+    std::vector<ScanEdge> edges;
+    for (const std::vector<ImVec2>& points : contours) {
+        if (points.size() < 3) continue;
+        
+        for (size_t i = 0; i < points.size(); i++) {
+            ImVec2 a = points[i];
+            ImVec2 b = points[(i + 1) % points.size()];
+            if (a.y == b.y) continue;
+            
+            int winding = a.y < b.y ? 1 : -1;
+            if (b.y < a.y) std::swap(a, b);
+            
+            // Half-open, so a vertex exactly on a row center is only counted once
+            int first_row = std::max((int)std::ceil(a.y - 0.5f), 0);
+            int last_row = std::min((int)std::ceil(b.y - 0.5f) - 1, h - 1);
+            if (first_row > last_row) continue;
+            
+            edges.push_back({first_row, last_row, a.x, a.y, (b.x - a.x) / (b.y - a.y), winding});
+        }
+    }
+    if (edges.empty()) return result;
+    
+    // Edges are added to the active list in the order their first row comes up
+    std::sort(edges.begin(), edges.end(), [](const ScanEdge& a, const ScanEdge& b) { return a.first_row < b.first_row; });
+    
+    std::vector<const ScanEdge*> active;
+    std::vector<std::pair<float, int>> crossings;   // X position and winding of every active edge on the current row
+    size_t next_edge = 0;
+    
+    for (int y = edges[0].first_row; y < h && (next_edge < edges.size() || !active.empty()); y++) {
+        // Drop edges that ended above this row, and add the ones that start on it
+        active.erase(std::remove_if(active.begin(), active.end(), [y](const ScanEdge* e) { return e->last_row < y; }), active.end());
+        while (next_edge < edges.size() && edges[next_edge].first_row == y) active.push_back(&edges[next_edge++]);
+        if (active.empty()) continue;
+        
+        // Where every active edge crosses the center of the row
+        // Worked out from the top of the edge every time rather than stepped, so errors don't add up on long edges
+        float center = y + 0.5f;
+        crossings.clear();
+        for (const ScanEdge* e : active) {
+            crossings.push_back({e->top_x + (center - e->top_y) * e->dx_dy, e->winding});
+        }
+        std::sort(crossings.begin(), crossings.end());
+        
+        // Walk the crossings from left to right, keeping count of how many contours the current position is inside
+        // Pixels are selected if their center (x + 0.5) is inside
+        int inside = 0;
+        float start = 0;
+        for (const auto& [x, winding] : crossings) {
+            bool was_inside = rule == FillRule::EvenOdd ? (inside & 1) : inside != 0;
+            inside += rule == FillRule::EvenOdd ? 1 : winding;
+            bool is_inside = rule == FillRule::EvenOdd ? (inside & 1) : inside != 0;
+            
+            if (!was_inside && is_inside) start = x;
+            if (was_inside && !is_inside) result.addSpan(y, std::ceil(start - 0.5f), std::ceil(x - 0.5f));
+        }
+    }
+    
+    // Spans are sorted already, but neighbors can touch
+    result.normalize();
+    return result;
+}
+
+// Build a selection from the region that a paint bucket would fill, starting at pos (magic wand)
+Selection floodSelection(SDL_Surface* surface, ImVec2 pos) {
+    Selection result(surface->w, surface->h);
+    
+    // Runs come out of the flood fill in no particular order, so sort them afterwards
+    floodRegion(surface, pos, [&](int y, int start, int end) { result.addSpan(y, start, end); });
+    result.normalize();
+    
+    return result;
+}
+
+// Combine two rows of spans
+void unionSpans(const std::vector<Span>& a, const std::vector<Span>& b, std::vector<Span>& out) {
+    out.clear();
+    size_t i = 0, j = 0;
+    
+    // Walk through both rows at once, always taking the span that starts first
+    while (i < a.size() || j < b.size()) {
+        Span next;
+        if (j >= b.size() || (i < a.size() && a[i].start <= b[j].start)) next = a[i++];
+        else next = b[j++];
+        
+        // Merge into the last span if they overlap or touch
+        if (!out.empty() && next.start <= out.back().end) {
+            out.back().end = std::max(out.back().end, next.end);
+        } else {
+            out.push_back(next);
+        }
+    }
+}
+
+// Overlapping parts of two rows of spans
+void intersectSpans(const std::vector<Span>& a, const std::vector<Span>& b, std::vector<Span>& out) {
+    out.clear();
+    size_t i = 0, j = 0;
+    
+    while (i < a.size() && j < b.size()) {
+        int start = std::max(a[i].start, b[j].start);
+        int end = std::min(a[i].end, b[j].end);
+        if (start < end) out.push_back({start, end});
+        
+        // Move on from whichever span ends first, the other one might still overlap the next span
+        if (a[i].end < b[j].end) i++;
+        else j++;
+    }
+}
+
+// Gaps between the spans of a row, from 0 to width
+void invertSpans(const std::vector<Span>& a, int width, std::vector<Span>& out) {
+    out.clear();
+    int x = 0;
+    for (const Span& span : a) {
+        if (span.start > x) out.push_back({x, span.start});
+        x = span.end;
+    }
+    if (x < width) out.push_back({x, width});
+}
+
+// Combine two selections of the same size
+Selection selectionUnion(const Selection& a, const Selection& b) {
+    Selection result(a.width(), a.height());
+    for (int y = 0; y < a.height(); y++) {
+        unionSpans(a.row(y), b.row(y), result.rowForWrite(y));
+    }
+    return result;
+}
+
+Selection selectionIntersect(const Selection& a, const Selection& b) {
+    Selection result(a.width(), a.height());
+    for (int y = 0; y < a.height(); y++) {
+        intersectSpans(a.row(y), b.row(y), result.rowForWrite(y));
+    }
+    return result;
+}
+
+Selection selectionSubtract(const Selection& a, const Selection& b) {
+    Selection result(a.width(), a.height());
+    
+    // a - b is the same as a intersected with everything that isn't in b
+    std::vector<Span> not_b;
+    for (int y = 0; y < a.height(); y++) {
+        invertSpans(b.row(y), b.width(), not_b);
+        intersectSpans(a.row(y), not_b, result.rowForWrite(y));
+    }
+    return result;
+}
+
+// Select everything that isn't selected and the other way around
+Selection selectionInvert(const Selection& a) {
+    Selection result(a.width(), a.height());
+    for (int y = 0; y < a.height(); y++) {
+        invertSpans(a.row(y), a.width(), result.rowForWrite(y));
+    }
+    return result;
+}
+
+// Line segments along the edge of a selection for drawing its outline, in canvas coordinates
+std::vector<ImVec4> selectionOutline(const Selection& selection) {
+    std::vector<ImVec4> outline;
+    std::vector<Span> not_other, edge;
+    
+    // Vertical edges that reached the bottom of the previous row, by x position
+    // so an edge that continues straight down is one long segment instead of one per row
+    std::map<int, size_t> open_edges, next_open_edges;
+    
+    // Extend the vertical edge at x down through row y, or start a new one
+    auto addVerticalEdge = [&](int x, int y) {
+        auto it = open_edges.find(x);
+        if (it != open_edges.end()) {
+            outline[it->second].w = y + 1;
+            next_open_edges[x] = it->second;
+        } else {
+            next_open_edges[x] = outline.size();
+            outline.push_back({(float)x, (float)y, (float)x, (float)(y + 1)});
+        }
+    };
+    
+    const std::vector<Span> no_spans;
+    for (int y = 0; y < selection.height(); y++) {
+        const std::vector<Span>& row = selection.row(y);
+        const std::vector<Span>& above = y > 0 ? selection.row(y - 1) : no_spans;
+        const std::vector<Span>& below = y + 1 < selection.height() ? selection.row(y + 1) : no_spans;
+        
+        // Top edge is the part of this row that isn't selected in the row above, same for the bottom edge
+        invertSpans(above, selection.width(), not_other);
+        intersectSpans(row, not_other, edge);
+        for (const Span& span : edge) outline.push_back({(float)span.start, (float)y, (float)span.end, (float)y});
+        
+        invertSpans(below, selection.width(), not_other);
+        intersectSpans(row, not_other, edge);
+        for (const Span& span : edge) outline.push_back({(float)span.start, (float)(y + 1), (float)span.end, (float)(y + 1)});
+        
+        // Left and right side of every span
+        next_open_edges.clear();
+        for (const Span& span : row) {
+            addVerticalEdge(span.start, y);
+            addVerticalEdge(span.end, y);
+        }
+        std::swap(open_edges, next_open_edges);
+    }
+    
+    return outline;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <imgui.h>
+#include <SDL3/SDL.h>
+
+#include <vector>
+#include <algorithm>
+
+// A horizontal run of selected pixels from start up to (but not including) end
+struct Span {
+    int start;
+    int end;
+};
+
+// Selected area of the canvas, stored as a list of spans for every row
+// A big rectangle only costs one span per row no matter how wide it is, and masked operations can work on whole spans
+// instead of checking every pixel. Spans in a row are always sorted, don't overlap, and don't touch.
+class Selection {
+public:
+    // Default constructor, creates an empty 0x0 selection
+    Selection() {}
+    
+    // Create a selection with the given size where nothing is selected
+    Selection(int w, int h);
+    
+    // Getters for width and height
+    int width() const { return w; }
+    int height() const { return h; }
+    
+    // Spans of a single row
+    const std::vector<Span>& row(int y) const { return rows[y]; }
+    std::vector<Span>& rowForWrite(int y) { return rows[y]; }
+    
+    // Add a span to a row, which is cropped to the selection width
+    // The row might not be sorted afterwards, so normalize() should be called once all spans are added
+    void addSpan(int y, int start, int end);
+    
+    // Sort and merge the spans of every row so they're valid again after addSpan()
+    void normalize();
+    
+    // Is nothing selected?
+    bool empty() const;
+    
+    // Smallest rect containing every selected pixel, has a width of 0 if nothing is selected
+    SDL_Rect bounds() const;
+    
+    // Is a single pixel selected?
+    bool contains(int x, int y) const;
+    
+    // Call f(start, end) for every part of a row that is selected between x0 and x1
+    template <typename F>
+    void forEachSpan(int y, int x0, int x1, F f) const {
+        for (const Span& span : rows[y]) {
+            if (span.end <= x0) continue;
+            if (span.start >= x1) break;
+            f(std::max(span.start, x0), std::min(span.end, x1));
+        }
+    }
+
+private:
+    int w = 0, h = 0;
+    std::vector<std::vector<Span>> rows;
+};
+
+// Build a selection from a rectangle, cropped to the selection size
+Selection rectSelection(int w, int h, SDL_Rect rect);
+
+// Build a selection from a closed polygon such as a lasso, using the even-odd rule
+// A pixel is selected if its center is inside the polygon
+Selection polygonSelection(int w, int h, const std::vector<ImVec2>& points);
+
+// How overlapping contours are filled
+enum class FillRule {
+    EvenOdd,    // Inside if the number of edges to the left is odd, so overlapping parts cancel out
+    NonZero     // Inside if the edges to the left don't cancel out, so contours that go the same way add together
+};
+
+// Build a selection from any number of closed contours with a scanline rasterizer
+// Edges are sorted into an edge table once, and each row only looks at the edges that cross it,
+// so a large shape costs one pass over its rows no matter how many edges it has elsewhere
+Selection contourSelection(int w, int h, const std::vector<std::vector<ImVec2>>& contours, FillRule rule);
+
+// Build a selection from the region that a paint bucket would fill, starting at pos (magic wand)
+Selection floodSelection(SDL_Surface* surface, ImVec2 pos);
+
+// Combine two selections of the same size
+Selection selectionUnion(const Selection& a, const Selection& b);
+Selection selectionIntersect(const Selection& a, const Selection& b);
+Selection selectionSubtract(const Selection& a, const Selection& b);
+
+// Select everything that isn't selected and the other way around
+Selection selectionInvert(const Selection& a);
+
+// Combine or invert single rows of spans, the result is written to out
+void unionSpans(const std::vector<Span>& a, const std::vector<Span>& b, std::vector<Span>& out);
+void intersectSpans(const std::vector<Span>& a, const std::vector<Span>& b, std::vector<Span>& out);
+void invertSpans(const std::vector<Span>& a, int width, std::vector<Span>& out);
+
+// Line segments along the edge of a selection for drawing its outline, in canvas coordinates
+// Each ImVec4 is one segment stored as x1, y1, x2, y2
+std::vector<ImVec4> selectionOutline(const Selection& selection);
@@ -0,0 +1,145 @@
+#include "shapes.hpp"
+#include "layers.hpp"
+#include "utils.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+// Pixel rect between two corners, including the pixels both corners are on
+static SDL_Rect cornersToRect(ImVec2 a, ImVec2 b) {
+    int x0 = std::floor(std::min(a.x, b.x)), x1 = std::floor(std::max(a.x, b.x)) + 1;
+    int y0 = std::floor(std::min(a.y, b.y)), y1 = std::floor(std::max(a.y, b.y)) + 1;
+    return {x0, y0, x1 - x0, y1 - y0};
+}
+
+// Area of a rectangle between two corners
+Selection rectangleShape(int w, int h, ImVec2 a, ImVec2 b, bool filled, float width) {
+    SDL_Rect rect = cornersToRect(a, b);
+    if (filled) return rectSelection(w, h, rect);
+    
+    Selection result(w, h);
+    int edge = std::max((int)std::round(width), 1);
+    
+    // Rows in the top and bottom edge are one whole span, the rest are a span on each side
+    for (int y = std::max(rect.y, 0); y < std::min(rect.y + rect.h, h); y++) {
+        if (y < rect.y + edge || y >= rect.y + rect.h - edge) {
+            result.addSpan(y, rect.x, rect.x + rect.w);
+        } else {
+            result.addSpan(y, rect.x, rect.x + edge);
+            result.addSpan(y, rect.x + rect.w - edge, rect.x + rect.w);
+        }
+    }
+    
+    // Sides can overlap if the rectangle is thinner than two edges
+    result.normalize();
+    return result;
+}
+
+// Area of an ellipse that fits between two corners
+Selection ellipseShape(int w, int h, ImVec2 a, ImVec2 b, bool filled, float width) {
+    SDL_Rect rect = cornersToRect(a, b);
+    Selection result(w, h);
+    
+    // Center and radii of the outer edge, and of the inner edge if it's only an outline
+    float cx = rect.x + rect.w / 2.0f, cy = rect.y + rect.h / 2.0f;
+    float rx = rect.w / 2.0f, ry = rect.h / 2.0f;
+    float inner_rx = filled ? 0 : rx - width, inner_ry = filled ? 0 : ry - width;
+    
+    // Half the width of an ellipse at a distance dy from its center, or -1 if the row misses it
+    auto halfWidth = [](float rx, float ry, float dy) {
+        if (rx <= 0 || ry <= 0 || std::abs(dy) >= ry) return -1.0f;
+        return rx * std::sqrt(1 - (dy / ry) * (dy / ry));
+    };
+    
+    // One pass over the rows, each row of the ellipse is one span (or two for an outline)
+    // Pixels are inside if their center is, same as polygons
+    for (int y = std::max(rect.y, 0); y < std::min(rect.y + rect.h, h); y++) {
+        float dy = y + 0.5f - cy;
+        float outer = halfWidth(rx, ry, dy);
+        if (outer < 0) continue;
+        
+        int start = std::ceil(cx - outer - 0.5f), end = std::ceil(cx + outer - 0.5f);
+        float inner = halfWidth(inner_rx, inner_ry, dy);
+        if (inner < 0) {
+            result.addSpan(y, start, end);
+        } else {
+            result.addSpan(y, start, std::ceil(cx - inner - 0.5f));
+            result.addSpan(y, std::ceil(cx + inner - 0.5f), end);
+        }
+    }
+    return result;
+}
+
+// Make a contour go clockwise, so overlapping contours add together with the non-zero rule instead of cancelling out
+static void orientContour(std::vector<ImVec2>& contour) {
+    float area = 0;
+    for (size_t i = 0; i < contour.size(); i++) {
+        ImVec2 p = contour[i], q = contour[(i + 1) % contour.size()];
+        area += p.x * q.y - q.x * p.y;
+    }
+    if (area < 0) std::reverse(contour.begin(), contour.end());
+}
+
+// Area of a closed polygon through the given points
+Selection polygonShape(int w, int h, const std::vector<ImVec2>& points, bool filled, float width) {
+    if (filled) return polygonSelection(w, h, points);
+    
+    // The outline is a rectangle along every edge and a disc at every corner to round off the joins,
+    // all rasterized together in one pass with the non-zero rule so they merge into one area
+    std::vector<std::vector<ImVec2>> contours;
+    float half = std::max(width, 1.0f) / 2;
+    
+    for (size_t i = 0; i < points.size(); i++) {
+        ImVec2 a = points[i];
+        ImVec2 b = points[(i + 1) % points.size()];
+        
+        // Normal of the edge scaled to half the width
+        float dx = b.x - a.x, dy = b.y - a.y;
+        float length = std::sqrt(dx * dx + dy * dy);
+        if (length > 0) {
+            float nx = -dy / length * half, ny = dx / length * half;
+            std::vector<ImVec2> quad = {{a.x + nx, a.y + ny}, {b.x + nx, b.y + ny}, {b.x - nx, b.y - ny}, {a.x - nx, a.y - ny}};
+            orientContour(quad);
+            contours.push_back(quad);
+        }
+        
+        // Enough sides that the disc looks round at the outline width
+        int sides = std::clamp((int)(half * 2), 8, 64);
+        std::vector<ImVec2> disc;
+        for (int s = 0; s < sides; s++) {
+            float angle = 2 * M_PI * s / sides;
+            disc.push_back({a.x + half * std::cos(angle), a.y + half * std::sin(angle)});
+        }
+        orientContour(disc);
+        contours.push_back(disc);
+    }
+    
+    return contourSelection(w, h, contours, FillRule::NonZero);
+}
+
+// Blend a premultiplied color on top of every pixel of an image inside the area
+SDL_Rect paintArea(TiledImage& image, const Selection& area, Uint32 color) {
+    SDL_Rect changed = area.bounds();
+    if (changed.w == 0) return changed;
+    
+    // A row of the color, so whole spans can go through the normal blend loop
+    Uint32 colors[tile_size];
+    std::fill(colors, colors + tile_size, color);
+    
+    // Work one tile at a time, only allocating tiles that something is painted on
+    for (int ty = changed.y / tile_size; ty <= (changed.y + changed.h - 1) / tile_size; ty++) {
+        for (int tx = changed.x / tile_size; tx <= (changed.x + changed.w - 1) / tile_size; tx++) {
+            SDL_Rect part = intersectRect(changed, {tx * tile_size, ty * tile_size, tile_size, tile_size});
+            Uint32* t = nullptr;
+            
+            for (int y = part.y; y < part.y + part.h; y++) {
+                area.forEachSpan(y, part.x, part.x + part.w, [&](int start, int end) {
+                    if (t == nullptr) t = image.tileForWrite(tx, ty);
+                    blendRow(BlendMode::Normal, &t[(y - ty * tile_size) * tile_size + start - tx * tile_size], colors, end - start, 255);
+                });
+            }
+        }
+    }
+    
+    return changed;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "selection.hpp"
+#include "image.hpp"
+
+#include <imgui.h>
+#include <SDL3/SDL.h>
+
+#include <vector>
+
+// Area covered by each kind of shape, as a selection so it can be painted one span at a time
+// Rectangles and ellipses fill the pixels between two opposite corners, which are both included.
+// Outlined rectangles and ellipses have an edge of the given width on the inside of the shape,
+// and outlined polygons have an edge of the given width centered on the path.
+Selection rectangleShape(int w, int h, ImVec2 a, ImVec2 b, bool filled, float width);
+Selection ellipseShape(int w, int h, ImVec2 a, ImVec2 b, bool filled, float width);
+Selection polygonShape(int w, int h, const std::vector<ImVec2>& points, bool filled, float width);
+
+// Blend a premultiplied color on top of every pixel of an image inside the area, returns the area that changed
+SDL_Rect paintArea(TiledImage& image, const Selection& area, Uint32 color);
@@ -0,0 +1,43 @@
+#include "startup.hpp"
+
+#include <SDL3/SDL.h>
+
+#include <cstdio>
+
+// Taken while static objects are being initialized, which is as early as the program can read the clock
+// The performance counter doesn't need SDL to be initialized
+static const Uint64 startup_begin = SDL_GetPerformanceCounter();
+
+static bool trace_enabled = false;
+static bool finished = false;
+
+// Time the previous phase was reached, so each phase can also print how long it took on its own
+static double last_phase_ms = 0;
+
+// Start printing phases as they're reached
+void enableStartupTrace() {
+    trace_enabled = true;
+}
+
+// Milliseconds since the program was loaded
+double startupElapsedMs() {
+    return (double)(SDL_GetPerformanceCounter() - startup_begin) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+// Record that startup reached a phase
+void startupPhase(const char* name) {
+    if (!trace_enabled || finished) return;
+    
+    double now = startupElapsedMs();
+    std::fprintf(stderr, "[startup] %8.2f ms (+%7.2f ms) %s\n", now, now - last_phase_ms, name);
+    last_phase_ms = now;
+}
+
+// Record that the first frame has been presented, which ends startup
+void startupFinished() {
+    if (finished) return;
+    startupPhase("First frame presented");
+    finished = true;
+    
+    std::printf("Startup took %.2f ms\n", startupElapsedMs());
+}
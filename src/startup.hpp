@@ -0,0 +1,17 @@
+#pragma once
+
+// Timeline of how long each phase of startup takes, from the moment the program is loaded until the first frame is on screen
+// Turned on with --startup-trace, which prints every phase to stderr as it's reached
+
+// Start printing phases as they're reached
+void enableStartupTrace();
+
+// Milliseconds since the program was loaded
+double startupElapsedMs();
+
+// Record that startup reached a phase, e.g. startupPhase("SDL_Init")
+// Only prints anything if the startup trace is turned on, and does nothing once startup is over
+void startupPhase(const char* name);
+
+// Record that the first frame has been presented, which ends startup and prints the total time
+void startupFinished();
@@ -2,12 +2,26 @@
 
 #include "gui_resource.hpp"
 #include "texture.hpp"
+#include "brush.hpp"
+#include "stroke.hpp"
+#include "layers.hpp"
+#include "selection.hpp"
+#include "filters.hpp"
+#include "adjustments.hpp"
 #include "utils.hpp"
+#include "journal.hpp"
+#include "clipboard.hpp"
 
 #include <imgui.h>
 
 #include <SDL3/SDL.h>
 
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <exception>
+
 // Forward declaration
 struct State;
 
@@ -19,10 +33,23 @@ struct FileActionInfo {
         None,
         DoNew,
         DoOpen,
-        DoSaveAs
+        DoSaveAs,
+        DoExportScaled,
+        DoExportIndexed,
+        DoRecover,
+        DoDiscardRecovery
     };
     Status status = None;
     
+    // How many times bigger than the canvas an export is
+    int export_scale = 2;
+    
+    // Format and encoder settings picked in the Save As window, also used by the scaled exports
+    SaveOptions save_options;
+    
+    // Palette size and dithering of an indexed PNG export
+    SaveOptions indexed_options{256, true};
+    
     struct NewInfo {
         // Size of new canvas to be created
         ImVec2 size;
@@ -33,14 +60,88 @@ struct FileActionInfo {
 struct ImageActionInfo {
     enum Status {
         None,
-        DoResize
+        DoResize,
+        DoCanvasSize,
+        DoFilter,
+        DoAdjust,
+        DoTransform
     };
     Status status = None;
     
+    // How to rotate or mirror the canvas
+    ImageTransform transform = ImageTransform::Rotate90;
+    
     struct ResizeInfo {
         // Size that the canvas should be resized to
         ImVec2 size;
     } resize_info;
+    
+    struct CanvasSizeInfo {
+        // Size that the canvas should be cropped or extended to
+        ImVec2 size;
+        
+        // Which point of the old canvas stays fixed, as a fraction of the canvas size
+        // e.g. {0, 0} keeps the top-left corner in place, {0.5, 0.5} keeps the content centered
+        ImVec2 anchor{0.5f, 0.5f};
+        
+        // Color used to fill in any newly added area
+        ImVec4 fill_color{1, 1, 1, 1};
+    } canvas_size_info;
+    
+    // Filter to run on the active layer, and its settings
+    FilterSettings filter_info;
+    
+    // Color adjustments to apply to the active layer
+    AdjustmentSettings adjust_info;
+};
+
+// Actions performed by the layer panel in the right menu
+struct LayerActionInfo {
+    enum Status {
+        None,
+        DoAdd,
+        DoDelete,
+        DoMoveUp,
+        DoMoveDown,
+        DoChanged   // Visibility, opacity or blend mode of a layer was changed
+    };
+    Status status = None;
+};
+
+// Actions performed by the "Edit" menu in the top menu bar, or its keyboard shortcuts
+struct EditActionInfo {
+    enum Status {
+        None,
+        DoCopy,
+        DoPaste,
+        DoCommitPaste,
+        DoDiscardPaste
+    };
+    Status status = None;
+};
+
+// Actions performed by the document tabs under the top menu bar
+struct DocumentActionInfo {
+    enum Status {
+        None,
+        DoSwitch,
+        DoClose
+    };
+    Status status = None;
+    
+    // Index of the document to switch to or close
+    int index = 0;
+};
+
+// Actions performed by the "Select" menu in the top menu bar
+struct SelectActionInfo {
+    enum Status {
+        None,
+        DoSelectAll,
+        DoDeselect,
+        DoInvert
+    };
+    Status status = None;
 };
 
 struct MousePos {
@@ -59,11 +160,60 @@ struct MouseButtonInfo {
     MousePos drag_start;
 };
 
+// Keeps track of pen (graphics tablet) input
+struct PenInfo {
+    bool down = false;      // Is the pen currently touching the tablet?
+    float pressure = 1;     // Pressure from the last pen axis event, between 0 and 1
+};
+
 // Keep track of which tool the user has selected for drawing
 enum class DrawingTool {
     Brush,
     Line,
-    Fill
+    Rectangle,
+    Ellipse,
+    Polygon,
+    Fill,
+    RectSelect,
+    Lasso,
+    MagicWand,
+    Eyedropper
+};
+
+// How a new selection is combined with the existing one
+enum class SelectionMode {
+    Replace,
+    Add,
+    Subtract,
+    Intersect
+};
+
+// An open image, with everything that belongs to it and not to the app as a whole
+// Only the active document is unpacked. The others keep their tiles compressed in memory and give their canvas texture back
+// to the texture pool, so having many documents open costs little more than the one being drawn on.
+struct Document {
+    std::string name;   // Shown on the document's tab
+    int id;             // Stays the same when other documents are closed, so the tab keeps its state in ImGui
+    
+    // Layers of the document, which all drawing tools paint on
+    // These hold the real pixels, everything on the GPU is only a copy for drawing to the screen
+    LayerStack layers;
+    
+    // Texture of the area that can be drawn to, holds a copy of the composited layers for rendering to the screen
+    // Empty while the document isn't active
+    Texture canvas;
+    
+    // Selection of the canvas, drawing tools only affect the selected area unless nothing is selected
+    Selection selection;
+    std::vector<ImVec4> selection_outline; // Edges of the selection, updated whenever the selection changes
+    
+    // Negative offset of canvas from center of viewport i.e. imagining the viewport is a camera pointed at the canvas, this is the coordinates of the camera
+    ImVec2 viewport_offset{0, 0};
+    // How much the canvas should be scaled up or down
+    float scale = 1;
+    
+    // Autosave journal of the document, which only starts once the user has decided what to do with the journals of a session that crashed
+    Journal journal;
 };
 
 // Faciliate communication between GUI and backend
@@ -103,26 +253,60 @@ struct State {
     MouseButtonInfo lmb_info_old;
     MouseButtonInfo rmb_info_old;
     
+    // Info about the pen, if the user is drawing with a graphics tablet
+    PenInfo pen_info;
+    
     // Info about the current line being drawn when in line tool mode
     MousePos draw_line_start;
     MousePos draw_line_end;
     bool drawing_line = false;
     
+    // Info about the shape currently being drawn with the rectangle, ellipse or polygon tool
+    MousePos shape_start; // Corner where the user started dragging a rectangle or ellipse
+    bool drawing_shape = false;
+    std::vector<ImVec2> polygon_points; // Corners of the polygon placed so far, in canvas coordinates
+    bool shape_filled = false; // Fill shapes in, or only draw their outline with the brush size as the width?
+    
+    SelectionMode selection_mode = SelectionMode::Replace; // How new selections are combined with the current one
+    
+    // Info about the selection currently being dragged with the rectangle or lasso tool
+    MousePos select_start;
+    std::vector<ImVec2> lasso_points; // Points of the lasso in canvas coordinates
+    bool selecting = false;
+    
+    // Paste floating above the active layer, which can be dragged around until it's committed
+    // Drawing tools are put on hold while there is one, clicking outside of it commits it
+    FloatingPaste paste;
+    bool dragging_paste = false;
+    ImVec2 paste_grab; // Mouse position relative to the top-left corner of the paste when it was grabbed, in canvas coordinates
+    
     // Brush settings
     int brush_size = 15; // Brush width (diameter) in pixels
+    int brush_hardness = 100; // Percentage of the brush radius that is fully opaque, the rest fades out
+    bool brush_anti_alias = true; // Smooth out the edge of hard brushes
+    int brush_opacity = 100; // Maximum opacity of a whole stroke in percent, no matter how many dabs overlap
+    int brush_flow = 100; // Opacity of each individual dab in percent
+    int brush_spacing = 10; // Distance between dabs as a percentage of the brush size
+    bool pressure_size = true; // Does pen pressure change the brush size?
+    bool pressure_flow = false; // Does pen pressure change the brush flow?
+    BrushStroke brush_stroke; // Stroke currently being painted with the brush tool
     bool brush_details_changed = false; // Has the user tweaked the brush size or color since the last frame?
-    Texture brush_texture_preview; // Preview of brush size, circular outline with no fill
-    Texture brush_texture; // Brush texture, circle with fill
+    TextureView brush_texture_preview; // Preview of brush size, circular outline with no fill, owned by brush_cache and pinned there
+    BrushCache brush_cache; // Previously generated brush masks and previews, so going back to an old brush size doesn't allocate
     DrawingTool drawing_tool = DrawingTool::Brush; // Which tool has the user selected for drawing?
     
+    // Eyedropper settings, colors are read from the composite in memory so sampling never touches the GPU
+    int eyedropper_size = 1; // Width and height of the square that is averaged, 1 samples a single pixel
+    bool eyedropper_hovering = false; // Is the cursor over the canvas with the eyedropper selected?
+    ImVec4 eyedropper_color{0, 0, 0, 1}; // Color under the cursor, values are floats between 0 and 1
+    
     float framerate; // FPS of window
     
     // Information about the viewport i.e. the area that the canvas is rendered to, outside of any GUI elements
     ImVec4 viewport; // Bounding box of viewport
-    // Negative offset of canvas from center of viewport i.e. imagining the viewport is a camera pointed at the canvas, this is the coordinates of the camera
-    ImVec2 viewport_offset{0, 0};
-    // How much the canvas should be scaled up or down
-    float scale = 1;
+    
+    // Height of the top menu bar, the document tabs go right under it
+    float menu_bar_height = 0;
     
     // Width of the menu on the right that holds drawing tools
     int right_menu_width = 200;
@@ -132,20 +316,77 @@ struct State {
     
     // GUI window visibility flags
     bool show_resize_window = false;
+    bool show_canvas_size_window = false;
     bool show_new_file_window = false;
+    bool show_export_indexed_window = false;
+    bool show_save_window = false;
     
+    // Estimated file size and encode time with the options in the Save As window
+    // Only worked out again when save_estimate_dirty is set, which the window does whenever an option changes
+    SaveEstimate save_estimate;
+    bool save_estimate_dirty = false;
+    bool show_profiler_window = false;
+    bool show_memory_window = false;
+    bool show_filter_window = false;
+    
+    // Small copy of the active layer with the filter applied, shown in the filter window while the settings are adjusted
+    // Only worked out again when filter_preview_dirty is set, which happens whenever a setting changes, another layer is
+    // made active, or any part of the canvas is recomposited
+    Texture filter_preview;
+    bool filter_preview_dirty = false;
+    
+    bool show_adjust_window = false;
+    
+    // Adjustments are previewed on the canvas itself while the adjustments window is open, but only the part of the
+    // canvas that's on screen is composited with them. The preview only goes to the canvas texture, the cached composite
+    // (which saving and the eyedropper read) and the full size layer are only changed when the user clicks OK.
+    ColorAdjustment adjust_preview; // Worked out from adjust_info whenever adjust_preview_dirty is set
+    bool adjust_preview_dirty = false;
+    bool adjust_previewing = false; // Was the preview showing last frame?
+    SDL_Rect adjust_preview_visible{0, 0, 0, 0}; // Area of the canvas that was on screen last frame
+    SDL_Rect adjust_preview_redraw{0, 0, 0, 0}; // Area that needs the preview uploaded again, even though the layers didn't change
+
     // Actions requested by the user, passed from the GUI
     FileActionInfo file_action_info;
     ImageActionInfo image_action_info;
+    LayerActionInfo layer_action_info;
+    SelectActionInfo select_action_info;
+    EditActionInfo edit_action_info;
+    DocumentActionInfo document_action_info;
     
-    // Texture object of the area that can be drawn to
-    Texture canvas;
+    // Open documents, one per tab, and which one is being viewed and drawn on
+    // Documents are kept behind pointers so a reference to one stays valid when others are opened or closed
+    std::vector<std::unique_ptr<Document>> documents;
+    int active_document = 0;
+    int documents_created = 0; // Used to give every document a new id, and untitled documents a number
+    bool select_tab = false; // Should the tab of the active document be selected next frame? Set when the backend switches documents
+    
+    // The document being viewed
+    Document& doc() { return *documents[active_document]; }
+    
+    // Saving runs on a background thread from a snapshot of the composite, so the GUI doesn't freeze while the file is encoded
+    std::thread save_thread;
+    std::atomic<bool> save_done{false}; // Has the save thread finished?
+    std::exception_ptr save_error; // Error thrown by the save thread, rethrown on the main thread once it's finished
+    
+    // Autosaving, each document has a journal of its own but only the active one changes between checkpoints
+    Uint64 last_autosave = 0; // Ticks of the last checkpoint
+    std::vector<std::string> recover_paths; // Journals left over by a session that crashed, offered in the recover window
+    bool show_recover_window = false;
+    int startup_document = 0; // Id of the blank document opened on startup, which recovered documents replace if it's untouched
     
     // Icon textures for drawing tool modes
     struct {
         Texture brush;
         Texture line;
+        Texture rectangle;
+        Texture ellipse;
+        Texture polygon;
         Texture fill;
+        Texture rect_select;
+        Texture lasso;
+        Texture magic_wand;
+        Texture eyedropper;
     } icons;
 };
 
@@ -153,5 +394,5 @@ struct State {
 // It's such a short function that there's no point putting it in its own source file,
 // so making it inline prevents multiple definition linker errors
 inline void MousePos::updateCanvasPos(State* state) {
-    canvas = screenToCanvasPos(state->canvas.size(), state->viewport, state->viewport_offset, state->scale, screen);
+    canvas = screenToCanvasPos(state->doc().canvas.size(), state->viewport, state->doc().viewport_offset, state->doc().scale, screen);
 }
\ No newline at end of file
@@ -0,0 +1,333 @@
+#include "stroke.hpp"
+#include "layers.hpp"
+#include "utils.hpp"
+#include "profiler.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Number of steps that pen pressure is rounded to before scaling the brush size
+// Without this, every tiny change in pressure would be a different radius and flood the brush cache with stamps
+static const float pressure_steps = 16;
+
+// Start a new stroke on a canvas of the given size and place the first dab
+void BrushStroke::begin(BrushCache& cache, int canvas_w, int canvas_h, StrokeSettings settings, ImVec2 pos, float pressure, const SDL_Rect* clip) {
+    this->settings = settings;
+    
+    // Start recording the path, without the selection since that can't be kept around
+    path.settings = settings;
+    path.settings.mask = nullptr;
+    path.points.clear();
+    path.points.push_back({pos, pressure});
+    path.scale = {1, 1};
+    path.offset = {0, 0};
+    
+    // Precompute the premultiplied stroke color for every coverage value
+    // The opacity is applied here, so dabs can build up to full coverage without going over the stroke opacity
+    for (int c = 0; c < 256; c++) {
+        float alpha = c / 255.0f * settings.opacity;
+        Uint32 r = std::round(settings.color.x * alpha * 255);
+        Uint32 g = std::round(settings.color.y * alpha * 255);
+        Uint32 b = std::round(settings.color.z * alpha * 255);
+        Uint32 a = std::round(alpha * 255);
+        
+        // RGBA8888 is a packed format with red in the highest byte
+        color_lut[c] = (r << 24) | (g << 16) | (b << 8) | a;
+    }
+    
+    // The coverage buffer only needs to be recreated if the clip rect changed,
+    // otherwise it was already cleared at the end of the last stroke
+    SDL_Rect new_clip = clip ? intersectRect(*clip, {0, 0, canvas_w, canvas_h}) : SDL_Rect{0, 0, canvas_w, canvas_h};
+    if (new_clip.x != this->clip.x || new_clip.y != this->clip.y || new_clip.w != this->clip.w || new_clip.h != this->clip.h) {
+        this->clip = new_clip;
+        coverage.assign(new_clip.w * new_clip.h, 0);
+        coverage_memory.set(coverage.size());
+    }
+    
+    dirty = {0, 0, 0, 0};
+    bounds = {0, 0, 0, 0};
+    is_active = true;
+    
+    // Place the first dab right away so that a single click still leaves a mark
+    dab(cache, pos, pressure);
+    
+    // Spacing to the next dab is worked out on the first move
+    last_pos = pos;
+    last_pressure = pressure;
+    distance_to_next = 0;
+}
+
+// Continue the stroke to a new position, placing dabs along the way
+// The segment is walked one pixel at a time with an integer DDA (Bresenham's line algorithm), so every dab lands on a whole
+// pixel, the walk ends exactly on the end pixel, and long strokes don't pile up rounding error in the positions
+void BrushStroke::moveTo(BrushCache& cache, ImVec2 pos, float pressure) {
+    path.points.push_back({pos, pressure});
+    
+    // Pixels the segment starts and ends on
+    int x = (int)std::floor(last_pos.x), y = (int)std::floor(last_pos.y);
+    int dx = (int)std::floor(pos.x) - x, dy = (int)std::floor(pos.y) - y;
+    
+    // Every step moves one pixel along the longer axis, and sometimes one along the other too
+    int steps = std::max(std::abs(dx), std::abs(dy));
+    int minor = std::min(std::abs(dx), std::abs(dy));
+    bool x_major = std::abs(dx) >= std::abs(dy);
+    int step_x = dx < 0 ? -1 : 1, step_y = dy < 0 ? -1 : 1;
+    
+    // Distance between dabs in pixels at a given pressure, at least one pixel so there's never more than one dab per step
+    auto spacingAt = [&](float p) {
+        float diameter = settings.shape.radius * 2 * (settings.pressure_size ? p : 1);
+        return std::max(diameter * settings.spacing, 1.0f);
+    };
+    
+    if (distance_to_next <= 0) distance_to_next = spacingAt(last_pressure);
+    
+    // Length of the segment covered by each step, which is the same for every step
+    float step_length = steps > 0 ? std::sqrt((float)(dx * dx + dy * dy)) / steps : 0;
+    
+    int error = steps / 2;
+    for (int i = 1; i <= steps; i++) {
+        // Step along the longer axis, and along the other one whenever the error runs out
+        error -= minor;
+        bool minor_step = error < 0;
+        if (minor_step) error += steps;
+        if (x_major) {
+            x += step_x;
+            if (minor_step) y += step_y;
+        } else {
+            y += step_y;
+            if (minor_step) x += step_x;
+        }
+        
+        // Place a dab once the spacing distance is reached, carrying over whatever's left so spacing stays even
+        distance_to_next -= step_length;
+        if (distance_to_next <= 0) {
+            float this_pressure = last_pressure + (pressure - last_pressure) * i / steps;
+            dab(cache, {(float)x, (float)y}, this_pressure);
+            distance_to_next += spacingAt(this_pressure);
+        }
+    }
+    
+    last_pos = pos;
+    last_pressure = pressure;
+}
+
+// Composite a single dab centered at the given position
+void BrushStroke::dab(BrushCache& cache, ImVec2 pos, float pressure) {
+    // Scale size and flow by pressure if enabled
+    float quantized_pressure = std::max(std::round(pressure * pressure_steps) / pressure_steps, 1 / pressure_steps);
+    int radius = settings.shape.radius;
+    if (settings.pressure_size) radius = std::max((int)std::round(radius * quantized_pressure), 1);
+    int flow = std::round(settings.flow * (settings.pressure_flow ? pressure : 1) * 255);
+    
+    // Coverage mask of the dab, no textures are needed since it is composited on the CPU
+    const BrushStamp& stamp = cache.getMask({radius, settings.shape.hardness, settings.shape.anti_alias});
+    
+    // Top-left corner of the dab, centered around the position
+    int x0 = (int)std::floor(pos.x) - radius;
+    int y0 = (int)std::floor(pos.y) - radius;
+    
+    // Only the part of the dab that is on the canvas and inside the clip rect
+    SDL_Rect rect = intersectRect({x0, y0, stamp.size, stamp.size}, clip);
+    if (rect.w == 0) return;
+    
+    // Blend the dab into the coverage buffer one row at a time
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        blendCoverageRow(&coverage[(y - clip.y) * clip.w + rect.x - clip.x], &stamp.mask[(y - y0) * stamp.size + (rect.x - x0)], rect.w, flow);
+    }
+    
+    // Keep track of what changed
+    dirty = unionRect(dirty, rect);
+    bounds = unionRect(bounds, rect);
+}
+
+// Blend the stroke on top of a row of premultiplied pixels that starts at the given canvas position
+void BrushStroke::blendOver(Uint32* row, int x, int y, int count) const {
+    if (settings.mask == nullptr) {
+        blendSpan(row, x, y, count);
+        return;
+    }
+    
+    // Only blend the parts of the row that are selected, a whole span at a time
+    settings.mask->forEachSpan(y, x, x + count, [&](int start, int end) {
+        blendSpan(&row[start - x], start, y, end - start);
+    });
+}
+
+// Blend part of a row without looking at the selection
+void BrushStroke::blendSpan(Uint32* row, int x, int y, int count) const {
+    const Uint8* src = &coverage[(y - clip.y) * clip.w + x - clip.x];
+    
+    // Convert coverage to premultiplied color with the lookup table in chunks, then blend each chunk normally
+    Uint32 colors[256];
+    for (int start = 0; start < count; start += 256) {
+        int chunk = std::min(count - start, 256);
+        for (int i = 0; i < chunk; i++) {
+            colors[i] = color_lut[src[start + i]];
+        }
+        blendRow(BlendMode::Normal, &row[start], colors, chunk, 255);
+    }
+}
+
+// Finish the stroke by blending it into an image, returns the area that changed
+SDL_Rect BrushStroke::commit(TiledImage& image) {
+    SDL_Rect changed = bounds;
+    
+    // Blend the stroke into every tile it touched
+    if (changed.w > 0) {
+        for (int ty = changed.y / tile_size; ty <= (changed.y + changed.h - 1) / tile_size; ty++) {
+            for (int tx = changed.x / tile_size; tx <= (changed.x + changed.w - 1) / tile_size; tx++) {
+                SDL_Rect part = intersectRect(changed, {tx * tile_size, ty * tile_size, tile_size, tile_size});
+                Uint32* t = image.tileForWrite(tx, ty);
+                
+                for (int y = part.y; y < part.y + part.h; y++) {
+                    blendOver(&t[(y - ty * tile_size) * tile_size + part.x - tx * tile_size], part.x, y, part.w);
+                }
+            }
+        }
+    }
+    
+    // Clear the area touched by this stroke, ready for the next one
+    for (int y = bounds.y; y < bounds.y + bounds.h; y++) {
+        std::memset(&coverage[(y - clip.y) * clip.w + bounds.x - clip.x], 0, bounds.w);
+    }
+    
+    dirty = {0, 0, 0, 0};
+    bounds = {0, 0, 0, 0};
+    is_active = false;
+    
+    return changed;
+}
+
+// Get the area changed since the last call, so only that area needs recompositing
+SDL_Rect BrushStroke::takeDirty() {
+    SDL_Rect changed = dirty;
+    dirty = {0, 0, 0, 0};
+    return changed;
+}
+
+// Area that a recorded stroke can touch on the canvas, which is every point grown by the biggest dab
+static SDL_Rect strokeArea(const StrokeRecord& stroke, float radius) {
+    float min_x = stroke.points[0].pos.x, max_x = min_x;
+    float min_y = stroke.points[0].pos.y, max_y = min_y;
+    for (const StrokePoint& point : stroke.points) {
+        min_x = std::min(min_x, point.pos.x);
+        max_x = std::max(max_x, point.pos.x);
+        min_y = std::min(min_y, point.pos.y);
+        max_y = std::max(max_y, point.pos.y);
+    }
+    
+    // Dabs are placed at the floor of the position, so one extra pixel covers the rounding
+    int x0 = std::floor(min_x * stroke.scale.x + stroke.offset.x - radius) - 1;
+    int y0 = std::floor(min_y * stroke.scale.y + stroke.offset.y - radius) - 1;
+    int x1 = std::ceil(max_x * stroke.scale.x + stroke.offset.x + radius) + 1;
+    int y1 = std::ceil(max_y * stroke.scale.y + stroke.offset.y + radius) + 1;
+    return {x0, y0, x1 - x0, y1 - y0};
+}
+
+// Paint recorded strokes in order onto a new image of the given size, filled with a solid base color first
+TiledImage rasterizeStrokes(const std::vector<StrokeRecord>& strokes, Uint32 base_color, int w, int h) {
+    PROFILE_SCOPE("rasterizeStrokes");
+    
+    TiledImage image(w, h);
+    if (w == 0 || h == 0) return image;
+    
+    // Brush settings at the size each stroke is painted at, and the area it can reach
+    // The radius scales with the geometric mean of the two scale factors so a non-uniform resize still gives round dabs
+    std::vector<StrokeSettings> settings(strokes.size());
+    std::vector<SDL_Rect> areas(strokes.size());
+    for (size_t i = 0; i < strokes.size(); i++) {
+        const StrokeRecord& stroke = strokes[i];
+        float radius_scale = std::sqrt(stroke.scale.x * stroke.scale.y);
+        settings[i] = stroke.settings;
+        settings[i].shape.radius = std::max((int)std::round(stroke.settings.shape.radius * radius_scale), 1);
+        areas[i] = stroke.points.empty() ? SDL_Rect{0, 0, 0, 0} : strokeArea(stroke, settings[i].shape.radius);
+    }
+    
+    // Bands are a whole number of tile rows, so no two threads ever write to the same tile
+    int threads = std::max(SDL_GetNumLogicalCPUCores(), 1);
+    int tile_rows = (h + tile_size - 1) / tile_size;
+    int band_rows = (tile_rows + threads - 1) / threads;
+    
+    auto paintBand = [&](SDL_Rect band) {
+        TRACE_SCOPE("rasterizeBand");
+        
+        if (base_color != 0) image.fillRect(band, base_color);
+        
+        // Every thread needs its own brush cache and stroke, since neither is thread safe
+        BrushCache cache;
+        BrushStroke stroke;
+        for (size_t i = 0; i < strokes.size(); i++) {
+            if (intersectRect(areas[i], band).w == 0) continue;
+            
+            // Replay the stroke exactly the way it was painted, so dab spacing comes out the same
+            const StrokeRecord& record = strokes[i];
+            auto toCanvas = [&](ImVec2 pos) { return ImVec2(pos.x * record.scale.x + record.offset.x, pos.y * record.scale.y + record.offset.y); };
+            stroke.begin(cache, w, h, settings[i], toCanvas(record.points[0].pos), record.points[0].pressure, &band);
+            for (size_t p = 1; p < record.points.size(); p++) {
+                stroke.moveTo(cache, toCanvas(record.points[p].pos), record.points[p].pressure);
+            }
+            stroke.commit(image);
+        }
+    };
+    
+    std::vector<std::thread> workers;
+    for (int row = 0; row < tile_rows; row += band_rows) {
+        int y = row * tile_size;
+        workers.emplace_back(paintBand, SDL_Rect{0, y, w, std::min(band_rows * tile_size, h - y)});
+    }
+    for (std::thread& worker : workers) worker.join();
+    
+    return image;
+}
+
+// Blend a row of dab coverage into a row of stroke coverage with the given flow (0 to 255)
+// dest = dest + src * flow * (1 - dest), so the result never goes above 255
+void blendCoverageRow(Uint8* dest, const Uint8* src, int count, int flow) {
+    int i = 0;
+
+#ifdef __SSE2__
+    // Process 16 pixels at a time, widened to 16 bits so the multiplications don't overflow
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i v255 = _mm_set1_epi16(255);
+    const __m128i v128 = _mm_set1_epi16(128);
+    const __m128i flow_16 = _mm_set1_epi16(flow);
+    
+    // Exact x / 255 (rounded) for 0 <= x <= 255*255
+    auto div255_16 = [&](__m128i x) {
+        x = _mm_add_epi16(x, v128);
+        return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+    };
+    
+    for (; i + 16 <= count; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*)&dest[i]);
+        __m128i s = _mm_loadu_si128((const __m128i*)&src[i]);
+        
+        // Low and high 8 pixels
+        __m128i d_lo = _mm_unpacklo_epi8(d, zero), d_hi = _mm_unpackhi_epi8(d, zero);
+        __m128i s_lo = _mm_unpacklo_epi8(s, zero), s_hi = _mm_unpackhi_epi8(s, zero);
+        
+        // Scale dab coverage by flow
+        s_lo = div255_16(_mm_mullo_epi16(s_lo, flow_16));
+        s_hi = div255_16(_mm_mullo_epi16(s_hi, flow_16));
+        
+        // dest + src * (255 - dest) / 255
+        d_lo = _mm_add_epi16(d_lo, div255_16(_mm_mullo_epi16(s_lo, _mm_sub_epi16(v255, d_lo))));
+        d_hi = _mm_add_epi16(d_hi, div255_16(_mm_mullo_epi16(s_hi, _mm_sub_epi16(v255, d_hi))));
+        
+        _mm_storeu_si128((__m128i*)&dest[i], _mm_packus_epi16(d_lo, d_hi));
+    }
+#endif
+
+    // Scalar version for the remaining pixels, or every pixel if SSE2 isn't available
+    auto div255 = [](int x) { x += 128; return (x + (x >> 8)) >> 8; };
+    for (; i < count; i++) {
+        int s = div255(src[i] * flow);
+        dest[i] = dest[i] + div255(s * (255 - dest[i]));
+    }
+}
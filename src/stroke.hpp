@@ -0,0 +1,109 @@
+#pragma once
+
+#include "brush.hpp"
+#include "image.hpp"
+#include "selection.hpp"
+
+#include <SDL3/SDL.h>
+#include <imgui.h>
+
+#include <vector>
+
+// Settings of the brush engine, copied when a stroke starts so changing them mid-stroke doesn't do anything weird
+struct StrokeSettings {
+    BrushKey shape;             // Shape of each dab at full pressure
+    ImVec4 color;               // Color of the whole stroke, values are floats between 0 and 1
+    float opacity = 1;          // Maximum alpha of the whole stroke, no matter how many dabs overlap
+    float flow = 1;             // Alpha of each individual dab
+    float spacing = 0.1f;       // Distance between dabs as a fraction of the brush diameter
+    bool pressure_size = true;  // Does pen pressure scale the size of each dab?
+    bool pressure_flow = false; // Does pen pressure scale the flow of each dab?
+    const Selection* mask = nullptr; // Only paint inside this selection, or everywhere if nullptr. Must stay unchanged until the stroke is committed
+};
+
+// A position along a stroke, as it was passed to the brush engine
+struct StrokePoint {
+    ImVec2 pos;
+    float pressure;
+};
+
+// A stroke kept as its path and settings instead of pixels, so it can be painted again at any size
+// Points are in the coordinates the stroke was painted in, and canvas position = point * scale + offset
+struct StrokeRecord {
+    StrokeSettings settings;            // The mask is always nullptr, since the selection isn't kept
+    std::vector<StrokePoint> points;    // Where the stroke began, then every position it moved to
+    ImVec2 scale{1, 1};
+    ImVec2 offset{0, 0};
+};
+
+// A stroke that is currently being painted
+// Dabs are composited into a CPU coverage buffer rather than straight onto a layer, so overlapping
+// dabs build up towards the stroke opacity instead of stacking their alpha on top of each other.
+// The stroke is blended on top of the active layer when compositing while painting, and merged into the layer at the end.
+class BrushStroke {
+public:
+    // Start a new stroke on a canvas of the given size and place the first dab
+    // If clip isn't null, only that part of the canvas is painted and the stroke only needs memory for that part
+    void begin(BrushCache& cache, int canvas_w, int canvas_h, StrokeSettings settings, ImVec2 pos, float pressure, const SDL_Rect* clip = nullptr);
+    
+    // Continue the stroke to a new position, placing dabs along the way
+    void moveTo(BrushCache& cache, ImVec2 pos, float pressure);
+    
+    // Blend the stroke on top of a row of premultiplied pixels that starts at the given canvas position
+    void blendOver(Uint32* row, int x, int y, int count) const;
+    
+    // Finish the stroke by blending it into an image, returns the area that changed
+    SDL_Rect commit(TiledImage& image);
+    
+    // Get the area changed since the last call, so only that area needs recompositing
+    SDL_Rect takeDirty();
+    
+    // Area touched by the whole stroke so far
+    SDL_Rect area() const { return bounds; }
+    
+    // Is a stroke currently being painted?
+    bool active() const { return is_active; }
+    
+    // Path and settings of the stroke so far, still valid after commit() until the next stroke begins
+    const StrokeRecord& record() const { return path; }
+    
+    // Is the stroke limited to a selection?
+    bool masked() const { return settings.mask != nullptr; }
+
+private:
+    // Composite a single dab centered at the given position
+    void dab(BrushCache& cache, ImVec2 pos, float pressure);
+    
+    // Blend part of a row without looking at the selection
+    void blendSpan(Uint32* row, int x, int y, int count) const;
+    
+    bool is_active = false;
+    StrokeSettings settings;
+    
+    // Coverage of each pixel of the clip rect from 0 to 255, no padding
+    std::vector<Uint8> coverage;
+    MemoryUsage coverage_memory{MemoryCategory::Brush};
+    SDL_Rect clip{0, 0, 0, 0};
+    
+    // Recorded path of the stroke
+    StrokeRecord path;
+    
+    SDL_Rect dirty{0, 0, 0, 0};     // Area changed since the last call to takeDirty()
+    SDL_Rect bounds{0, 0, 0, 0};    // Area touched by the whole stroke
+    
+    // Where the last dab was placed, and how far along the path the next dab should go
+    ImVec2 last_pos;
+    float last_pressure = 1;
+    float distance_to_next = 0;
+    
+    // Premultiplied stroke color for every possible coverage value, so blending starts with just a lookup
+    Uint32 color_lut[256];
+};
+
+// Paint recorded strokes in order onto a new image of the given size, filled with a solid base color first
+// The image is split into bands of tiles that are painted on separate threads, each replaying only the strokes that reach it
+TiledImage rasterizeStrokes(const std::vector<StrokeRecord>& strokes, Uint32 base_color, int w, int h);
+
+// Blend a row of dab coverage into a row of stroke coverage with the given flow (0 to 255)
+// dest = dest + src * flow * (1 - dest), so the result never goes above 255
+void blendCoverageRow(Uint8* dest, const Uint8* src, int count, int flow);
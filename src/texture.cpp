@@ -1,12 +1,29 @@
 #include "texture.hpp"
 #include "utils.hpp"
+#include "pool.hpp"
 
 #include <string>
 #include <stdexcept>
 #include <cmath>
 
+// Destroy a texture, or give it back to the pool if it came from there
+void TextureDeleter::operator()(SDL_Texture* texture) const {
+    trackFree(category, bytes);
+    if (pooled) releaseTexture(texture);
+    else SDL_DestroyTexture(texture);
+}
+
+// Take ownership of a texture, with its memory counted by the memory tracker for as long as it's alive
+static std::unique_ptr<SDL_Texture, TextureDeleter> trackedTexture(SDL_Texture* texture, MemoryCategory category, bool pooled = false) {
+    // Textures are always 4 bytes per pixel
+    size_t bytes = (size_t)texture->w * texture->h * sizeof(Uint32);
+    trackAlloc(category, bytes);
+    
+    return std::unique_ptr<SDL_Texture, TextureDeleter>(texture, TextureDeleter{category, bytes, pooled});
+}
+
 // Texture constructor for new blank texture given width and height
-Texture::Texture(SDL_Renderer* renderer, SDL_TextureAccess access, int w, int h) {
+Texture::Texture(SDL_Renderer* renderer, SDL_TextureAccess access, int w, int h, MemoryCategory category) {
     this->renderer = renderer;
     this->access = access;
     
@@ -17,12 +34,27 @@ Texture::Texture(SDL_Renderer* renderer, SDL_TextureAccess access, int w, int h)
     if (texture_raw == nullptr)
         throw std::runtime_error(std::string("Error: SDL_CreateTexture(): ") + SDL_GetError());
         
-    // Create shared pointer with custom allocator, will automatically destroy texture
-    texture = std::shared_ptr<SDL_Texture>(texture_raw, SDL_DestroyTexture);
+    // Take ownership of the texture, it's destroyed along with this object
+    texture = trackedTexture(texture_raw, category);
+}
+
+// Get a blank texture from the texture pool, which goes back to the pool instead of being destroyed
+Texture Texture::fromPool(SDL_Renderer* renderer, SDL_TextureAccess access, int w, int h, MemoryCategory category) {
+    Texture result;
+    result.renderer = renderer;
+    result.access = access;
+    
+    // Throws if a new texture had to be created and that failed
+    SDL_Texture* texture_raw = acquireTexture(renderer, SDL_PIXELFORMAT_RGBA8888, access, w, h);
+    
+    // Same as a normal texture, except it's given back to the pool when the owner is destroyed
+    result.texture = trackedTexture(texture_raw, category, true);
+    
+    return result;
 }
 
 // Texture constructor for new texture created from an existing surface
-Texture::Texture(SDL_Renderer* renderer, SDL_Surface* surface) {
+Texture::Texture(SDL_Renderer* renderer, SDL_Surface* surface, MemoryCategory category) {
     this->renderer = renderer;
     this->access = SDL_TEXTUREACCESS_STATIC; // Textures created from surface can only have static access mode
     
@@ -33,8 +65,8 @@ Texture::Texture(SDL_Renderer* renderer, SDL_Surface* surface) {
     if (texture_raw == nullptr)
         throw std::runtime_error(std::string("Error: SDL_CreateTextureFromSurface(): ") + SDL_GetError());
     
-    // Create shared pointer with custom allocator, will automatically destroy textur
-    texture = std::shared_ptr<SDL_Texture>(texture_raw, SDL_DestroyTexture);
+    // Take ownership of the texture, it's destroyed along with this object
+    texture = trackedTexture(texture_raw, category);
 }
 
 // Fill texture with solid color
@@ -134,50 +166,29 @@ void Texture::loadFromArray(unsigned char* data) {
         // In target mode it's easy - just create a new texture with streaming access mode, load the array data into that,
         // then render it to this texture
         {
-            Texture streaming_texture(renderer, SDL_TEXTUREACCESS_STREAMING, texture->w, texture->h);
+            Texture streaming_texture = Texture::fromPool(renderer, SDL_TEXTUREACCESS_STREAMING, texture->w, texture->h);
             streaming_texture.loadFromArray(data);
-            streaming_texture.renderTo(*this, nullptr, nullptr);
+            streaming_texture.renderTo(view(), nullptr, nullptr);
             break;
         }
     }
 }
 
+// Replace the pixels of a rect of the texture (or the whole texture if rect is null), pitch is in bytes
+// Pixels should be in the same format as the texture
+void Texture::update(const SDL_Rect* rect, const void* pixels, int pitch) {
+    SDL_UpdateTexture(texture.get(), rect, pixels, pitch);
+}
+
 // Render this texture to another one
-void Texture::renderTo(Texture dest, const SDL_FRect* src_rect, const SDL_FRect* dest_rect) {
+void Texture::renderTo(TextureView dest, const SDL_FRect* src_rect, const SDL_FRect* dest_rect) {
     // Only valid if the destination texture supports being set as a render target
-    if (dest.access == SDL_TEXTUREACCESS_TARGET) {
+    if (dest.accessMode() == SDL_TEXTUREACCESS_TARGET) {
         SDL_SetRenderTarget(renderer, dest.get());
         SDL_RenderTexture(renderer, texture.get(), src_rect, dest_rect);
     }
 }
 
-// Renders a provided texture to every point of this texture that is along a line
-void Texture::stampTextureAlongLine(Texture src, ImVec2 start, ImVec2 end) {
-    // Only valid if this texture supports being set as the render target
-    if (access != SDL_TEXTUREACCESS_TARGET) return;
-    
-    // Width and height of line
-    double dx = end.x - start.x;
-    double dy = end.y - start.y;
-    
-    // Amount that the interpolation variable should step forward each iteration
-    // If |width| > |height|, then step size should be 1 / width, otherwise 1/height
-    double dt = 1 / std::max(std::abs(dx), std::abs(dy));
-    
-    // Interpolate from 0 to 1
-    for (double t = 0; t < 1.0f; t += dt) {
-        // Center texture around current point on line
-        SDL_FRect dest_rect{
-            (float)(int)(start.x + dx * t - src.width() / 2.0f),
-            (float)(int)(start.y + dy * t - src.height() / 2.0f),
-            (float)(int)src.width(),
-            (float)(int)src.height()
-        };
-        // Render source texture to this one
-        src.renderTo(*this, NULL, &dest_rect);
-    }
-}
-
 // Set this texture as the render target
 void Texture::setRenderTarget() {
     SDL_SetRenderTarget(renderer, texture.get());
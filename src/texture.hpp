@@ -1,19 +1,68 @@
 #pragma once
 
+#include "memory.hpp"
+
 #include <SDL3/SDL.h>
 #include <imgui.h>
 #include <memory>
+#include <cstddef>
+
+// Non-owning handle to a texture, cheap to copy and pass by value since there is no reference count to update
+// Only valid for as long as the Texture it was taken from is alive, so views shouldn't be stored unless
+// whoever stores them knows the owner outlives them
+class TextureView {
+public:
+    // Default constructor, doesn't point at any texture
+    TextureView() {}
+    TextureView(SDL_TextureAccess access, SDL_Texture* texture) : access(access), texture(texture) {}
+    
+    // Getters for width, height, size, access mode, and underlying texture pointer
+    int width() const { return texture->w; }
+    int height() const { return texture->h; }
+    ImVec2 size() const { return {(float)width(), (float)height()}; }
+    SDL_TextureAccess accessMode() const { return access; }
+    SDL_Texture* get() const { return texture; }
 
+private:
+    SDL_TextureAccess access = SDL_TEXTUREACCESS_STATIC;
+    SDL_Texture* texture = nullptr;
+};
+
+// Destroys a texture (or gives it back to the texture pool) and records the free with the memory tracker
+struct TextureDeleter {
+    MemoryCategory category = MemoryCategory::Temporary;
+    size_t bytes = 0;       // Memory counted for the texture, always 4 bytes per pixel
+    bool pooled = false;    // Was the texture taken from the texture pool?
+    
+    void operator()(SDL_Texture* texture) const;
+};
+
+// Owner of a texture, the texture is destroyed when its owner is
+// Textures can be moved but not copied, so every texture has exactly one owner:
+// - the canvas of each document is owned by its Document, and the tool icons in state->icons by State
+// - brush previews are owned by the stamps in the brush cache, State only keeps a view of the current one
+// Anything that only needs to draw with a texture takes a TextureView instead
 class Texture {
 public:
     // Default constructor, does not create texture
     Texture() {}
     
+    // Move-only, since copying would mean two owners destroying the same texture
+    Texture(Texture&& other) = default;
+    Texture& operator=(Texture&& other) = default;
+    Texture(const Texture&) = delete;
+    Texture& operator=(const Texture&) = delete;
+    
     // Texture constructor for new blank texture given width and height
-    Texture(SDL_Renderer* renderer, SDL_TextureAccess access, int w, int h);
+    // The category is what the texture's memory is counted under by the memory tracker
+    Texture(SDL_Renderer* renderer, SDL_TextureAccess access, int w, int h, MemoryCategory category = MemoryCategory::Temporary);
+    
+    // Get a blank texture from the texture pool, which goes back to the pool instead of being destroyed
+    // Use this for textures that get created over and over, so they don't need a new driver allocation every time
+    static Texture fromPool(SDL_Renderer* renderer, SDL_TextureAccess access, int w, int h, MemoryCategory category = MemoryCategory::Temporary);
     
     // Texture constructor for new texture created from an existing surface
-    Texture(SDL_Renderer* renderer, SDL_Surface* surface);
+    Texture(SDL_Renderer* renderer, SDL_Surface* surface, MemoryCategory category = MemoryCategory::Temporary);
     
     // Fill texture with solid color
     void fill(ImVec4 color);
@@ -24,11 +73,12 @@ public:
     // Create a new texture from an array
     void loadFromArray(unsigned char* data); // Size is assumed to be w*h*4 (4 bytes per pixel)
     
-    // Render this texture to another one
-    void renderTo(Texture dest, const SDL_FRect* src_rect, const SDL_FRect* dest_rect);
+    // Replace the pixels of a rect of the texture (or the whole texture if rect is null), pitch is in bytes
+    // Pixels should be in the same format as the texture
+    void update(const SDL_Rect* rect, const void* pixels, int pitch);
     
-    // Renders a provided texture to every point of this texture that is along a line
-    void stampTextureAlongLine(Texture src, ImVec2 start, ImVec2 end);
+    // Render this texture to another one
+    void renderTo(TextureView dest, const SDL_FRect* src_rect, const SDL_FRect* dest_rect);
     
     // Set this texture as the render target
     void setRenderTarget();
@@ -38,9 +88,12 @@ public:
     int height() { return texture->h; }
     ImVec2 size() { return {(float)width(), (float)height()}; }
     SDL_Texture* get() { return texture.get(); }
+    
+    // Get a non-owning view of this texture
+    TextureView view() const { return TextureView(access, texture.get()); }
 
 private:
-    SDL_Renderer* renderer;
-    SDL_TextureAccess access;
-    std::shared_ptr<SDL_Texture> texture;
+    SDL_Renderer* renderer = nullptr;
+    SDL_TextureAccess access = SDL_TEXTUREACCESS_STATIC;
+    std::unique_ptr<SDL_Texture, TextureDeleter> texture;
 };
\ No newline at end of file
@@ -0,0 +1,92 @@
+#include "trace.hpp"
+
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+
+// Maximum number of events kept in memory before they're written to the file
+static const size_t max_buffered_events = 65536;
+
+// The one tracer used by the whole program
+Tracer& Tracer::get() {
+    static Tracer tracer;
+    return tracer;
+}
+
+// Start writing events to a file, throws if the file can't be opened
+void Tracer::start(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    file = std::fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        throw std::runtime_error("Error: could not open trace file " + path);
+    }
+    
+    // Chrome trace format is a JSON array of events
+    std::fputs("[\n", file);
+    first_event = true;
+    
+    events.reserve(max_buffered_events);
+    start_time = SDL_GetPerformanceCounter();
+    is_enabled.store(true, std::memory_order_relaxed);
+    
+    std::cout << "Tracing to " << path << std::endl;
+}
+
+// Write any remaining events and close the file
+void Tracer::stop() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (file == nullptr) return;
+    
+    is_enabled.store(false, std::memory_order_relaxed);
+    writeEvents();
+    
+    std::fputs("\n]\n", file);
+    std::fclose(file);
+    file = nullptr;
+}
+
+// Record an event that ran from start to end, can be called from any thread
+void Tracer::addEvent(const char* name, Uint64 start, Uint64 end) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (file == nullptr) return;
+    
+    events.push_back({name, start, end, SDL_GetCurrentThreadID()});
+    
+    // Write the buffer out when it's full so it never grows past its size
+    if (events.size() >= max_buffered_events) writeEvents();
+}
+
+// Write all buffered events to the file now
+void Tracer::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (file == nullptr) return;
+    
+    writeEvents();
+    std::fflush(file);
+}
+
+// Number of events waiting in the buffer
+size_t Tracer::bufferedEvents() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return events.size();
+}
+
+// Write buffered events to the file, the mutex must already be locked
+void Tracer::writeEvents() {
+    // Timestamps and durations are in microseconds
+    double us_per_tick = 1000000.0 / SDL_GetPerformanceFrequency();
+    
+    for (const TraceEvent& event : events) {
+        // Scopes that were already running when tracing started are cut off at the start
+        Uint64 start = std::max(event.start, start_time);
+        
+        // "X" is a complete event, which has both a start time and a duration
+        std::fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%llu}",
+            first_event ? "" : ",\n", event.name,
+            (start - start_time) * us_per_tick, (event.end - start) * us_per_tick,
+            (unsigned long long)event.thread);
+        first_event = false;
+    }
+    events.clear();
+}
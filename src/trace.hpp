@@ -0,0 +1,84 @@
+#pragma once
+
+#include <SDL3/SDL.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <cstdio>
+
+// A single timed event, in performance counter ticks
+struct TraceEvent {
+    const char* name;
+    Uint64 start;
+    Uint64 end;
+    SDL_ThreadID thread;
+};
+
+// Records timed events from any thread and writes them out in the Chrome trace event format,
+// which can be opened in a local trace viewer such as Perfetto or chrome://tracing
+// Events are kept in a fixed-size buffer that is written to the file whenever it fills up,
+// when flush() is called, and when tracing stops, so memory use stays bounded no matter how long the session is.
+class Tracer {
+public:
+    // The one tracer used by the whole program
+    static Tracer& get();
+    
+    // Start writing events to a file, throws if the file can't be opened
+    void start(const std::string& path);
+    
+    // Write any remaining events and close the file
+    void stop();
+    
+    // Is tracing turned on? Cheap enough to check before every event
+    bool enabled() const { return is_enabled.load(std::memory_order_relaxed); }
+    
+    // Record an event that ran from start to end, can be called from any thread
+    // The name must be a string literal or otherwise live until the tracer is stopped
+    void addEvent(const char* name, Uint64 start, Uint64 end);
+    
+    // Write all buffered events to the file now
+    void flush();
+    
+    // Number of events waiting in the buffer
+    size_t bufferedEvents();
+
+private:
+    Tracer() {}
+    
+    // Write buffered events to the file, the mutex must already be locked
+    void writeEvents();
+    
+    std::atomic<bool> is_enabled{false};
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+    FILE* file = nullptr;
+    bool first_event = true;    // Every event after the first needs a comma in front of it
+    Uint64 start_time = 0;      // Timestamps in the file are relative to when tracing started
+};
+
+// Records the scope it is created in as an event, if tracing is turned on
+class TraceScope {
+public:
+    TraceScope(const char* name) : name(name), start(SDL_GetPerformanceCounter()) {}
+    ~TraceScope() {
+        Tracer& tracer = Tracer::get();
+        if (tracer.enabled()) tracer.addEvent(name, start, SDL_GetPerformanceCounter());
+    }
+
+private:
+    const char* name;
+    Uint64 start;
+};
+
+// Record the rest of the current scope as a trace event, e.g. TRACE_SCOPE("filterJob")
+// Unlike PROFILE_SCOPE (which also records trace events) this is safe to use on worker threads.
+// Compiled out along with the profiler if PAINT_PROFILER isn't defined.
+#ifdef PAINT_PROFILER
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name)
+#endif
@@ -1,4 +1,9 @@
 #include "utils.hpp"
+#include "profiler.hpp"
+#include "memory.hpp"
+#include "pool.hpp"
+#include "quantize.hpp"
+#include "image.hpp"
 
 #include <imgui.h>
 #include <SDL3/SDL.h>
@@ -10,11 +15,16 @@
 #include <stb_image_write.h>
 
 #include <vector>
+#include <cstring>
+#include <functional>
 #include <tuple>
 #include <string>
 #include <stdexcept>
 #include <filesystem>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <thread>
 
 // Convert a position from canvas space to screen space
 ImVec2 canvasToScreenPos(ImVec2 canvas_size, ImVec4 viewport, ImVec2 viewport_offset, float scale, ImVec2 point) {
@@ -78,6 +88,44 @@ void editPixel(void* array, int pitch, int x, int y, Uint32 rgba) {
     *getPixel(array, pitch, x, y) = rgba;
 }
 
+// Split the numbers from 0 to count between one thread per CPU core, and call job(start, end) on each thread
+void parallelFor(int count, const std::function<void(int, int)>& job) {
+    int threads = std::min(std::max(SDL_GetNumLogicalCPUCores(), 1), std::max(count, 1));
+    int per_thread = (count + threads - 1) / threads;
+    
+    std::vector<std::thread> workers;
+    for (int start = 0; start < count; start += per_thread) {
+        workers.emplace_back(job, start, std::min(start + per_thread, count));
+    }
+    for (std::thread& worker : workers) worker.join();
+}
+
+// Smallest rect containing both rects, a rect with zero width or height counts as empty
+SDL_Rect unionRect(SDL_Rect a, SDL_Rect b) {
+    // Union with an empty rect is just the other rect
+    if (a.w <= 0 || a.h <= 0) return b;
+    if (b.w <= 0 || b.h <= 0) return a;
+    
+    int x1 = std::min(a.x, b.x);
+    int y1 = std::min(a.y, b.y);
+    int x2 = std::max(a.x + a.w, b.x + b.w);
+    int y2 = std::max(a.y + a.h, b.y + b.h);
+    return {x1, y1, x2 - x1, y2 - y1};
+}
+
+// Overlapping area of both rects, returns an empty rect if they don't overlap
+SDL_Rect intersectRect(SDL_Rect a, SDL_Rect b) {
+    int x1 = std::max(a.x, b.x);
+    int y1 = std::max(a.y, b.y);
+    int x2 = std::min(a.x + a.w, b.x + b.w);
+    int y2 = std::min(a.y + a.h, b.y + b.h);
+    
+    // No overlap
+    if (x2 <= x1 || y2 <= y1) return {0, 0, 0, 0};
+    
+    return {x1, y1, x2 - x1, y2 - y1};
+}
+
 // Draw the outline of a circle centered on the surface
 void drawCircle(SDL_Surface* surface, int radius, ImVec4 color) {
     int diameter = radius * 2;
@@ -124,49 +172,90 @@ void drawCircle(SDL_Surface* surface, int radius, ImVec4 color) {
     }
 }
 
-// Paint bucket tool - starting as pos, fill all matching colors with draw color
-void floodFill(SDL_Surface* surface, ImVec2 pos, ImVec4 draw_color_vec) {
-    // Convert draw color to Uint32 that can be written into pixel array
-    Uint32 draw_color = vecToUint32(surface->format, scaleVec(draw_color_vec, 255));
+// Find the region of pixels connected to pos that match its color, which is the area a paint bucket fills
+// Calls add_run(y, start, end) for every horizontal run of the region, with end not included
+// Works on whole runs at a time instead of single pixels, so both the fill tool and magic wand can use the runs directly
+void floodRegion(SDL_Surface* surface, ImVec2 pos, const std::function<void(int, int, int)>& add_run) {
+    // Skip if starting position is out of bounds
+    if (pos.x < 0 || pos.x >= surface->w || pos.y < 0 || pos.y >= surface->h) return;
     
-    // Color at provided position - only other pixels matching this color will be modified
-    Uint32 starting_color = *getPixel(surface->pixels, surface->pitch, pos.x, pos.y); 
+    // Color at provided position - only other pixels matching this color are part of the region
+    Uint32 starting_color = *getPixel(surface->pixels, surface->pitch, pos.x, pos.y);
+    
+    // Keep track of which pixels are already part of the region, since the surface isn't modified
+    // Borrowed from the pool since every click of the fill or magic wand tool needs one the size of the canvas
+    PooledBuffer visited_buffer(surface->w * surface->h);
+    Uint8* visited = (Uint8*)visited_buffer.data();
+    std::memset(visited, 0, visited_buffer.size());
+
+    // Is a pixel part of the region but not visited yet?
+    auto matches = [&](int x, int y) {
+        return !visited[y * surface->w + x] && *getPixel(surface->pixels, surface->pitch, x, y) == starting_color;
+    };
     
-    // Stack of pixels that need to be filled in
+    // Stack of positions that a new run might start from
     std::vector<std::tuple<int, int>> stack;
     
     // Start with initial position
-    stack.push_back({pos.x, pos.y});
+    stack.push_back({(int)pos.x, (int)pos.y});
     
     while (!stack.empty()) {
         // Pop the last position off the stack
         auto [this_x, this_y] = stack[stack.size() - 1];
         stack.pop_back();
         
-        // Skip if position is out of bounds
-        if (this_x < 0 || this_x >= surface->w || this_y < 0 || this_y >= surface->h) continue;
+        // Skip if already part of a run
+        if (!matches(this_x, this_y)) continue;
         
-        // Get address of pixel's color
-        Uint32* this_pixel = getPixel(surface->pixels, surface->pitch, this_x, this_y);
-
-        // Skip if pixel's color does not match starting color or if already filled in
-        if (*this_pixel != starting_color || *this_pixel == draw_color) continue;
+        // Extend the run as far left and right as possible
+        int start = this_x, end = this_x + 1;
+        while (start > 0 && matches(start - 1, this_y)) start--;
+        while (end < surface->w && matches(end, this_y)) end++;
         
-        // Update pixel color
-        *this_pixel = draw_color;
+        std::memset(&visited[this_y * surface->w + start], 1, end - start);
+        add_run(this_y, start, end);
         
-        // Add neighboring pixels to stack to check
-        stack.push_back({this_x+1, this_y});
-        stack.push_back({this_x-1, this_y});
-        stack.push_back({this_x, this_y+1});
-        stack.push_back({this_x, this_y-1});
+        // Check the rows above and below, and add one position for every run that touches this one
+        for (int next_y : {this_y - 1, this_y + 1}) {
+            if (next_y < 0 || next_y >= surface->h) continue;
+            
+            for (int x = start; x < end; x++) {
+                if (!matches(x, next_y)) continue;
+                stack.push_back({x, next_y});
+                
+                // Skip to the end of this run
+                while (x < end && matches(x, next_y)) x++;
+            }
+        }
     }
 }
 
+// Native file dialog is initialized the first time a dialog is opened, since on some platforms (e.g. GTK on Linux)
+// it loads a whole toolkit that most sessions never need
+static bool file_dialog_initialized = false;
+
+static void initFileDialog() {
+    if (file_dialog_initialized) return;
+    
+    if (NFD_Init() != NFD_OKAY)
+        throw std::runtime_error(std::string("Error: NFD_Init(): ") + NFD_GetError());
+    file_dialog_initialized = true;
+}
+
+// Shut down the native file dialog, if a dialog was ever opened
+void quitFileDialog() {
+    if (!file_dialog_initialized) return;
+    
+    NFD_Quit();
+    file_dialog_initialized = false;
+}
+
 // Opens a file explorer GUI that lets the user pick a file to open from/save to
 // Set save to true if a save dialog should be opened which lets the user type in a filename,
 // or false to force the user to select an existing file
 std::string requestFileDialog(std::vector<nfdu8filteritem_t> filters, bool save) {
+    initFileDialog();
+    
     // Variables for storing the output path picked by the user
     nfdu8char_t *out_path_raw;
     std::string out_path;
@@ -218,21 +307,17 @@ std::string requestFileDialog(std::vector<nfdu8filteritem_t> filters, bool save)
     throw std::runtime_error(std::string("Error: NFD_OpenDialogU8_With(): ") + NFD_GetError());
 }
 
-// Open an image file at given path and create surface from image data
-SDL_Surface* openImage(std::string path) {
-    // Load image data and request 4 channels
-    int w, h;
-    unsigned char *data = stbi_load(path.c_str(), &w, &h, nullptr, 4);
-    
-    // Throw error if image could not be loaded
-    if (data == nullptr)
-        throw std::runtime_error("stbi_load()");
-    
+// Create a surface from image data decoded by stb_image, and free the data
+static SDL_Surface* surfaceFromImageData(unsigned char* data, int w, int h) {
     // New surface to hold image data
-    SDL_Surface* image = SDL_CreateSurface(w, h, SDL_PIXELFORMAT_RGBA8888);
-    if (image == nullptr) {
+    // Counted as temporary memory since it's only needed until the pixels are copied into the canvas,
+    // must be destroyed with destroySurface()
+    SDL_Surface* image;
+    try {
+        image = createSurface(w, h, SDL_PIXELFORMAT_RGBA8888, MemoryCategory::Temporary);
+    } catch (...) {
         stbi_image_free(data);
-        throw std::runtime_error(std::string("Error: SDL_CreateSurface(): ") + SDL_GetError());
+        throw;
     }
         
     
@@ -254,12 +339,44 @@ SDL_Surface* openImage(std::string path) {
     // Free image data
     stbi_image_free(data);
     
+    return image;
+}
+
+// Open an image file at given path and create surface from image data
+SDL_Surface* openImage(std::string path) {
+    PROFILE_SCOPE("openImage");
+    
+    // Load image data and request 4 channels
+    int w, h;
+    unsigned char *data = stbi_load(path.c_str(), &w, &h, nullptr, 4);
+    
+    // Throw error if image could not be loaded
+    if (data == nullptr)
+        throw std::runtime_error("stbi_load()");
+    
+    SDL_Surface* image = surfaceFromImageData(data, w, h);
+    
     // Log success
     std::cout << "Opened file " << path << std::endl;
     
     return image;
 }
 
+// Create a surface from an image file that's already in memory
+SDL_Surface* openImageFromMemory(const void* data, size_t size) {
+    PROFILE_SCOPE("openImageFromMemory");
+    
+    // Load image data and request 4 channels
+    int w, h;
+    unsigned char *pixels = stbi_load_from_memory((const unsigned char*)data, size, &w, &h, nullptr, 4);
+    
+    // Throw error if image could not be loaded
+    if (pixels == nullptr)
+        throw std::runtime_error(std::string("Error: stbi_load_from_memory(): ") + stbi_failure_reason());
+    
+    return surfaceFromImageData(pixels, w, h);
+}
+
 // Check if a string ends with another string
 bool endsWith(const std::string& value, const std::string& ending) {
     // String too short to end with ending
@@ -269,8 +386,278 @@ bool endsWith(const std::string& value, const std::string& ending) {
     return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
 }
 
+// CRC of some bytes, which is what every PNG chunk ends with
+// Pass the CRC of the bytes so far as crc to continue it
+static Uint32 crc32(const unsigned char* data, size_t size, Uint32 crc = 0) {
+    // CRC of every possible byte, worked out the first time it's needed
+    static const struct Table {
+        Uint32 values[256];
+        Table() {
+            for (Uint32 n = 0; n < 256; n++) {
+                Uint32 c = n;
+                for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                values[n] = c;
+            }
+        }
+    } table;
+    
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = table.values[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Put together a PNG file from rows that already start with their filter type
+// stb_image_write reads its PNG compression level from a global, which would be shared by every thread that encodes a PNG,
+// so PNGs are put together here with the level passed straight to stb's zlib compression
+// palette and alpha are only used for indexed images (color type 3), alpha can stop after the last color that isn't opaque
+static std::vector<unsigned char> makePng(int w, int h, int depth, int color_type, const std::vector<unsigned char>& rows, int compression,
+                                          const std::vector<unsigned char>& palette = {}, const std::vector<unsigned char>& alpha = {}) {
+    int compressed_size;
+    unsigned char* compressed = stbi_zlib_compress((unsigned char*)rows.data(), rows.size(), &compressed_size, compression);
+    if (compressed == nullptr)
+        throw std::runtime_error("Error: stbi_zlib_compress()");
+    
+    std::vector<unsigned char> file = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    
+    // Add a number in big endian byte order
+    auto put32 = [&file](Uint32 value) {
+        for (int shift = 24; shift >= 0; shift -= 8) file.push_back((value >> shift) & 0xFF);
+    };
+    
+    // Add a chunk, which is its size, type, data, and the CRC of the type and data
+    auto chunk = [&](const char* type, const unsigned char* data, size_t size) {
+        put32(size);
+        size_t start = file.size();
+        file.insert(file.end(), type, type + 4);
+        file.insert(file.end(), data, data + size);
+        put32(crc32(&file[start], size + 4));
+    };
+    
+    // Header: width, height, bit depth, color type, then default compression, filtering and no interlacing
+    unsigned char header[13] = {
+        (unsigned char)(w >> 24), (unsigned char)(w >> 16), (unsigned char)(w >> 8), (unsigned char)w,
+        (unsigned char)(h >> 24), (unsigned char)(h >> 16), (unsigned char)(h >> 8), (unsigned char)h,
+        (unsigned char)depth, (unsigned char)color_type, 0, 0, 0
+    };
+    chunk("IHDR", header, sizeof(header));
+    
+    if (!palette.empty()) chunk("PLTE", palette.data(), palette.size());
+    if (!alpha.empty()) chunk("tRNS", alpha.data(), alpha.size());
+    chunk("IDAT", compressed, compressed_size);
+    chunk("IEND", nullptr, 0);
+    
+    // stb allocated the compressed data with malloc
+    free(compressed);
+    return file;
+}
+
+// Encode flat RGBA bytes as a PNG with the given compression level, passing the encoded bytes to func
+// Returns 0 if encoding failed, like stb_image_write
+static int writePng(stbi_write_func* func, void* context, const unsigned char* data, int w, int h, int compression) {
+    // Every row gets whichever of the five PNG filters leaves the smallest differences, the same guess stb_image_write makes
+    // The row above the first one counts as all zeros
+    size_t row_bytes = (size_t)w * 4;
+    std::vector<unsigned char> rows((row_bytes + 1) * h);
+    std::vector<unsigned char> zeros(row_bytes, 0);
+    std::vector<unsigned char> filtered[5];
+    for (auto& row : filtered) row.resize(row_bytes);
+    
+    for (int y = 0; y < h; y++) {
+        const unsigned char* row = &data[y * row_bytes];
+        const unsigned char* above = y > 0 ? row - row_bytes : zeros.data();
+        
+        int best = 0;
+        long best_estimate = -1;
+        for (int filter = 0; filter < 5; filter++) {
+            long estimate = 0;
+            for (size_t i = 0; i < row_bytes; i++) {
+                int a = i >= 4 ? row[i - 4] : 0, b = above[i], c = i >= 4 ? above[i - 4] : 0;
+                int predicted = 0;
+                if (filter == 1) predicted = a;
+                else if (filter == 2) predicted = b;
+                else if (filter == 3) predicted = (a + b) / 2;
+                else if (filter == 4) {
+                    int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                    predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                }
+                filtered[filter][i] = row[i] - predicted;
+                estimate += std::abs((signed char)filtered[filter][i]);
+            }
+            if (best_estimate < 0 || estimate < best_estimate) {
+                best = filter;
+                best_estimate = estimate;
+            }
+        }
+        
+        unsigned char* out = &rows[y * (row_bytes + 1)];
+        out[0] = best;
+        std::copy(filtered[best].begin(), filtered[best].end(), out + 1);
+    }
+    
+    // Color type 6 is RGBA
+    std::vector<unsigned char> file;
+    try {
+        file = makePng(w, h, 8, 6, rows, compression);
+    } catch (const std::exception&) {
+        return 0;
+    }
+    func(context, file.data(), file.size());
+    return 1;
+}
+
+// Write an image with a palette as an indexed PNG, returns the size of the file in bytes
+static size_t writeIndexedPng(const std::string& path, const IndexedImage& image, int compression) {
+    // Smallest bit depth that fits every palette index, pixels are packed into bytes starting from the highest bit
+    int palette_size = image.palette.size();
+    int depth = palette_size <= 2 ? 1 : palette_size <= 4 ? 2 : palette_size <= 16 ? 4 : 8;
+    int row_bytes = (image.w * depth + 7) / 8;
+    
+    // Every row starts with a filter type, which is 0 (no filter) since filters don't help with palette indices
+    std::vector<unsigned char> rows((size_t)(row_bytes + 1) * image.h, 0);
+    for (int y = 0; y < image.h; y++) {
+        unsigned char* row = &rows[(size_t)y * (row_bytes + 1) + 1];
+        for (int x = 0; x < image.w; x++) {
+            int bit = x * depth;
+            row[bit / 8] |= image.indices[(size_t)y * image.w + x] << (8 - depth - bit % 8);
+        }
+    }
+    
+    // Palette colors, and their alpha in a separate chunk that can stop after the last one that isn't opaque
+    std::vector<unsigned char> palette, alpha;
+    for (Uint32 color : image.palette) {
+        palette.insert(palette.end(), {(unsigned char)(color >> 24), (unsigned char)(color >> 16), (unsigned char)(color >> 8)});
+        alpha.push_back(color & 0xFF);
+    }
+    while (!alpha.empty() && alpha.back() == 255) alpha.pop_back();
+    
+    // Color type 3 is indexed
+    std::vector<unsigned char> file = makePng(image.w, image.h, depth, 3, rows, compression, palette, alpha);
+    
+    FILE* out = fopen(path.c_str(), "wb");
+    if (out == nullptr)
+        throw std::runtime_error("Error: could not open " + path + " for writing");
+    size_t written = fwrite(file.data(), 1, file.size(), out);
+    fclose(out);
+    if (written != file.size())
+        throw std::runtime_error("Error: could not write " + path);
+    
+    return file.size();
+}
+
+// Callback for stbi_write_*_to_func that appends the encoded bytes to a file
+static void writeToFile(void* context, void* data, int size) {
+    fwrite(data, 1, size, (FILE*)context);
+}
+
+// Callback for stbi_write_*_to_func that only adds up how many bytes were encoded
+static void countBytes(void* context, void*, int size) {
+    *(size_t*)context += size;
+}
+
+// Blend flat RGBA bytes over a background color, leaving every pixel opaque
+static void flattenAlpha(unsigned char* data, size_t count, const float background[3]) {
+    int bg[3];
+    for (int c = 0; c < 3; c++) bg[c] = std::clamp((int)std::lround(background[c] * 255), 0, 255);
+    
+    for (size_t i = 0; i < count; i++) {
+        unsigned char* p = &data[i * 4];
+        int a = p[3];
+        for (int c = 0; c < 3; c++) p[c] = (p[c] * a + bg[c] * (255 - a) + 127) / 255;
+        p[3] = 255;
+    }
+}
+
+// Encode flat RGBA bytes with stb_image_write, passing the encoded bytes to func as they're made
+// Returns 0 if encoding failed
+static int encodeImage(stbi_write_func* func, void* context, const unsigned char* data, int w, int h, ImageFormat format, const SaveOptions& options) {
+    if (format == ImageFormat::JPG) {
+        // JPGs have no alpha channel, stb_image_write ignores the fourth byte of each pixel
+        return stbi_write_jpg_to_func(func, context, w, h, 4, data, std::clamp(options.jpg_quality, 1, 100));
+    }
+    
+    return writePng(func, context, data, w, h, options.png_compression);
+}
+
+// Reduce an image to a palette and save it as an indexed PNG
+// Also encodes a full color PNG in memory, so the size and time saved can be reported
+static void saveIndexedImage(const std::string& path, const unsigned char* data, int w, int h, const SaveOptions& options) {
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 start = SDL_GetPerformanceCounter();
+    
+    // The quantizer works on packed RGBA8888 colors
+    std::vector<Uint32> pixels((size_t)w * h);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        const unsigned char* p = &data[i * 4];
+        pixels[i] = ((Uint32)p[0] << 24) | ((Uint32)p[1] << 16) | ((Uint32)p[2] << 8) | p[3];
+    }
+    
+    IndexedImage indexed = quantizeImage(pixels.data(), w, h, options.palette_colors, options.dither);
+    size_t indexed_bytes = writeIndexedPng(path, indexed, options.png_compression);
+    double indexed_ms = (double)(SDL_GetPerformanceCounter() - start) * 1000 / frequency;
+    
+    // Size and time of the same image as a full color PNG, which is only counted and never written anywhere
+    start = SDL_GetPerformanceCounter();
+    size_t full_bytes = 0;
+    writePng(countBytes, &full_bytes, data, w, h, options.png_compression);
+    double full_ms = (double)(SDL_GetPerformanceCounter() - start) * 1000 / frequency;
+    
+    // The indexed PNG isn't always the smaller one, so the difference can go either way
+    int saved = full_bytes > 0 ? (int)std::round(100 - (double)indexed_bytes * 100 / full_bytes) : 0;
+    std::cout << "Indexed PNG with " << indexed.palette.size() << " colors: " << indexed_bytes / 1024 << " KiB in " << indexed_ms << " ms "
+              << "(full color PNG: " << full_bytes / 1024 << " KiB in " << full_ms << " ms, "
+              << std::abs(saved) << (saved < 0 ? "% larger)" : "% smaller)") << std::endl;
+}
+
+// Callback for stbi_write_*_to_func that appends the encoded bytes to a vector
+static void appendBytes(void* context, void* data, int size) {
+    std::vector<unsigned char>& bytes = *(std::vector<unsigned char>*)context;
+    bytes.insert(bytes.end(), (unsigned char*)data, (unsigned char*)data + size);
+}
+
+// Encode straight alpha RGBA8888 pixels as a PNG in memory
+std::vector<unsigned char> encodePng(const Uint32* pixels, int w, int h) {
+    // stb_image_write wants the bytes of each pixel in RGBA order
+    std::vector<unsigned char> data((size_t)w * h * 4);
+    for (size_t i = 0; i < (size_t)w * h; i++) {
+        data[i * 4] = pixels[i] >> 24;
+        data[i * 4 + 1] = pixels[i] >> 16;
+        data[i * 4 + 2] = pixels[i] >> 8;
+        data[i * 4 + 3] = pixels[i];
+    }
+    
+    // Always stb_image_write's default level, so the last Save As settings don't change what other apps get
+    std::vector<unsigned char> png;
+    if (writePng(appendBytes, &png, data.data(), w, h, 8) == 0)
+        throw std::runtime_error("Error: encodePng(): could not encode the image");
+    return png;
+}
+
+// Compress bytes with zlib, favoring speed over size
+std::vector<unsigned char> compressBytes(const void* data, size_t size) {
+    // 5 is the fastest setting stb_image_write has, it only looks at a few earlier matches for each position
+    int compressed_size;
+    unsigned char* compressed = stbi_zlib_compress((unsigned char*)data, size, &compressed_size, 5);
+    if (compressed == nullptr)
+        throw std::runtime_error("Error: stbi_zlib_compress()");
+    
+    // stb allocated the compressed data with malloc
+    std::vector<unsigned char> result(compressed, compressed + compressed_size);
+    free(compressed);
+    return result;
+}
+
+// Decompress bytes from compressBytes() into dest
+void decompressBytes(const std::vector<unsigned char>& compressed, void* dest, size_t size) {
+    int ret = stbi_zlib_decode_buffer((char*)dest, size, (const char*)compressed.data(), compressed.size());
+    if (ret != (int)size)
+        throw std::runtime_error("Error: stbi_zlib_decode_buffer()");
+}
+
 // Save surface image data at given path
-void saveImage(std::string path, SDL_Surface* surface) {
+void saveImage(std::string path, SDL_Surface* surface, const SaveOptions& options) {
+    // Runs on the save thread, so only a trace event is recorded
+    TRACE_SCOPE("saveImage");
+    
     // Create array to store image data
     auto data = std::make_unique<unsigned char[]>(surface->w * surface->h * sizeof(Uint32));
     
@@ -294,24 +681,80 @@ void saveImage(std::string path, SDL_Surface* surface) {
         }
     }
     
-    int ret;
-    if (endsWith(path, ".png")) {
+    // Indexed images are always PNGs
+    ImageFormat format = options.format;
+    if (options.palette_colors > 0) {
+        format = ImageFormat::PNG;
+        if (!endsWith(path, ".png")) path += ".png";
+    } else if (endsWith(path, ".png")) {
         // If path ends with .png
-        ret = stbi_write_png(path.c_str(), surface->w, surface->h, 4, data.get(), surface->w * sizeof(Uint32));
+        format = ImageFormat::PNG;
     } else if (endsWith(path, ".jpg") || endsWith(path, ".jpeg")) {
         // If path ends with .jpg or .jpeg
-        // Use maximum jpg quality of 100
-        ret = stbi_write_jpg(path.c_str(), surface->w, surface->h, 4, data.get(), 100);
+        format = ImageFormat::JPG;
     } else {
-        // If file type not recognized, save it as a png and add .png to the end
-        path += ".png";
-        ret = stbi_write_png(path.c_str(), surface->w, surface->h, 4, data.get(), surface->w * sizeof(Uint32));
+        // If file type not recognized, save it in the format from the options and add its extension to the end
+        path += format == ImageFormat::JPG ? ".jpg" : ".png";
+    }
+    
+    // Blend transparent pixels over the background, otherwise a JPG would show whatever color they happen to have
+    if (options.flatten_alpha || format == ImageFormat::JPG) flattenAlpha(data.get(), (size_t)surface->w * surface->h, options.background);
+    
+    if (options.palette_colors > 0) {
+        saveIndexedImage(path, data.get(), surface->w, surface->h, options);
+        std::cout << "Saved file as " << path << std::endl;
+        return;
     }
     
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr)
+        throw std::runtime_error("Error: could not open " + path + " for writing");
+    int ret = encodeImage(writeToFile, file, data.get(), surface->w, surface->h, format, options);
+    
     // Check that file was saved successfully
-    if (ret == 0)
+    if (fclose(file) != 0 || ret == 0)
         throw std::runtime_error("Error: stbi_write()");
     
     // Log success
     std::cout << "Saved file as " << path << std::endl;
+}
+
+// Estimate the size and encode time of a saved image
+SaveEstimate estimateSave(const Uint32* pixels, int w, int h, const SaveOptions& options) {
+    PROFILE_SCOPE("estimateSave");
+    
+    // Encode a grid of up to 8x8 blocks of 64x64 pixels, spread out evenly over the image and put side by side
+    // Blocks from all over the image compress much more like the whole image than one big block from the middle would
+    const int block = 64, grid = 8;
+    int blocks_x = std::min(grid, (w + block - 1) / block), blocks_y = std::min(grid, (h + block - 1) / block);
+    int block_w = std::min(block, w), block_h = std::min(block, h);
+    int sample_w = blocks_x * block_w, sample_h = blocks_y * block_h;
+    
+    // Flat RGBA bytes, the same as saveImage gives to stb_image_write
+    std::vector<unsigned char> data((size_t)sample_w * sample_h * 4);
+    for (int by = 0; by < blocks_y; by++) {
+        int src_y = blocks_y > 1 ? (h - block_h) * by / (blocks_y - 1) : 0;
+        for (int bx = 0; bx < blocks_x; bx++) {
+            int src_x = blocks_x > 1 ? (w - block_w) * bx / (blocks_x - 1) : 0;
+            for (int y = 0; y < block_h; y++) {
+                for (int x = 0; x < block_w; x++) {
+                    Uint32 pixel = unpremultiply(pixels[(size_t)(src_y + y) * w + src_x + x]);
+                    unsigned char* p = &data[((size_t)(by * block_h + y) * sample_w + bx * block_w + x) * 4];
+                    p[0] = pixel >> 24, p[1] = pixel >> 16, p[2] = pixel >> 8, p[3] = pixel;
+                }
+            }
+        }
+    }
+    
+    // Time flattening too, since saving does it
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (options.flatten_alpha || options.format == ImageFormat::JPG) flattenAlpha(data.data(), (size_t)sample_w * sample_h, options.background);
+    
+    size_t bytes = 0;
+    encodeImage(countBytes, &bytes, data.data(), sample_w, sample_h, options.format, options);
+    double ms = (double)(SDL_GetPerformanceCounter() - start) * 1000 / SDL_GetPerformanceFrequency();
+    
+    // Both grow with the number of pixels
+    double ratio = (double)w * h / ((double)sample_w * sample_h);
+    return SaveEstimate{(size_t)(bytes * ratio), ms * ratio};
 }
\ No newline at end of file
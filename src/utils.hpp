@@ -6,6 +6,7 @@
 
 #include <vector>
 #include <string>
+#include <functional>
 
 // Convert a position from canvas space to screen space
 ImVec2 canvasToScreenPos(ImVec2 canvas_size, ImVec4 viewport, ImVec2 viewport_offset, float scale, ImVec2 point);
@@ -31,16 +32,89 @@ void editPixel(void* array, int pitch, int x, int y, Uint32 rgba);
 // Draw the outline of a circle centered on the surface
 void drawCircle(SDL_Surface* surface, int radius, ImVec4 color);
 
-// Paint bucket tool - starting as pos, fill all matching colors with draw color
-void floodFill(SDL_Surface* surface, ImVec2 pos, ImVec4 draw_color_vec);
+// Find the region of pixels connected to pos that match its color, which is the area a paint bucket fills
+// Calls add_run(y, start, end) for every horizontal run of the region, with end not included
+void floodRegion(SDL_Surface* surface, ImVec2 pos, const std::function<void(int, int, int)>& add_run);
 
 // Opens a file explorer GUI that lets the user pick a file to open from/save to
 // Set save to true if a save dialog should be opened which lets the user type in a filename,
 // or false to force the user to select an existing file
+// The native file dialog is initialized the first time this is called
 std::string requestFileDialog(std::vector<nfdu8filteritem_t> filters, bool save);
 
+// Shut down the native file dialog, if a dialog was ever opened
+void quitFileDialog();
+
 // Open an image file at given path and create surface from image data
+// The surface must be destroyed with destroySurface()
 SDL_Surface* openImage(std::string path);
 
+// Create a surface from an image file that's already in memory, e.g. a PNG from the clipboard
+// The surface must be destroyed with destroySurface()
+SDL_Surface* openImageFromMemory(const void* data, size_t size);
+
+// File formats an image can be saved as
+enum class ImageFormat {
+    PNG,
+    JPG
+};
+
+// Extra options for saving an image
+struct SaveOptions {
+    // Number of colors in the palette of an indexed PNG, or 0 to keep every color as it is
+    int palette_colors = 0;
+    
+    // Dither when reducing the image to a palette
+    bool dither = true;
+    
+    // Format to save as if the path doesn't end in .png, .jpg or .jpeg, in which case the extension is added to it
+    ImageFormat format = ImageFormat::PNG;
+    
+    // JPG quality from 1 to 100
+    // stb_image_write has no separate setting for chroma subsampling, it halves the color resolution (4:2:0)
+    // at quality 90 and below, and keeps it all (4:4:4) above that
+    int jpg_quality = 100;
+    
+    // How hard the PNG compressor looks for matches, higher is smaller and slower
+    // stb_image_write treats anything below 5 as 5, and uses 8 by default
+    int png_compression = 8;
+    
+    // Blend every pixel over the background color so the image has no transparency
+    // JPGs can't store alpha, so they're always flattened
+    bool flatten_alpha = false;
+    float background[3] = {1, 1, 1};
+};
+
 // Save surface image data at given path
-void saveImage(std::string path, SDL_Surface* surface);
\ No newline at end of file
+void saveImage(std::string path, SDL_Surface* surface, const SaveOptions& options = {});
+
+// Estimated size and encode time of a saved image
+struct SaveEstimate {
+    size_t bytes = 0;
+    double ms = 0;
+};
+
+// Estimate how big a file saving w*h premultiplied RGBA8888 pixels (like a layer stack's composite) with the given options
+// makes, and how long encoding takes. Only a sample of blocks spread out over the image is encoded, so this stays quick for big images
+SaveEstimate estimateSave(const Uint32* pixels, int w, int h, const SaveOptions& options);
+
+// Encode w*h straight alpha RGBA8888 pixels with no padding as a PNG in memory
+// Throws if the image couldn't be encoded
+std::vector<unsigned char> encodePng(const Uint32* pixels, int w, int h);
+
+// Compress bytes with zlib, favoring speed over size
+// Used to keep data that isn't needed for a while in less memory
+std::vector<unsigned char> compressBytes(const void* data, size_t size);
+
+// Decompress bytes from compressBytes() into dest, throws if they don't decompress to exactly size bytes
+void decompressBytes(const std::vector<unsigned char>& compressed, void* dest, size_t size);
+
+// Split the numbers from 0 to count between one thread per CPU core, and call job(start, end) on each thread
+// Returns once every thread has finished
+void parallelFor(int count, const std::function<void(int, int)>& job);
+
+// Smallest rect containing both rects, a rect with zero width or height counts as empty
+SDL_Rect unionRect(SDL_Rect a, SDL_Rect b);
+
+// Overlapping area of both rects, returns an empty rect if they don't overlap
+SDL_Rect intersectRect(SDL_Rect a, SDL_Rect b);
@@ -0,0 +1,78 @@
+// Build-time tool that bakes icon images into the program
+// Usage: embed_icons <output header> <image files...>
+// Every image is decoded and converted to RGBA8888 here, so at startup the pixels only need to be
+// uploaded to a texture with no file access, no decoding and no per-pixel conversion.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#include <cstdio>
+#include <cstdint>
+#include <cctype>
+#include <string>
+
+// Name of the variable for an image, which is its file name without the folder or extension
+// e.g. "icons/select_rect.png" becomes "icon_select_rect"
+static std::string variableName(std::string path) {
+    size_t slash = path.find_last_of("/\\");
+    if (slash != std::string::npos) path = path.substr(slash + 1);
+    
+    size_t dot = path.find_last_of('.');
+    if (dot != std::string::npos) path = path.substr(0, dot);
+    
+    // Anything that can't be part of a C++ name becomes an underscore
+    for (char& c : path) {
+        if (!std::isalnum((unsigned char)c)) c = '_';
+    }
+    return "icon_" + path;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s <output header> <image files...>\n", argv[0]);
+        return 1;
+    }
+    
+    FILE* out = std::fopen(argv[1], "w");
+    if (out == nullptr) {
+        std::fprintf(stderr, "Error: could not open %s for writing\n", argv[1]);
+        return 1;
+    }
+    
+    std::fprintf(out, "// Generated by tools/embed_icons.cpp, do not edit\n");
+    std::fprintf(out, "#pragma once\n\n");
+    std::fprintf(out, "#include <cstdint>\n\n");
+    std::fprintf(out, "// Icon image baked into the program, pixels are RGBA8888 with no padding\n");
+    std::fprintf(out, "struct EmbeddedIcon {\n    int w, h;\n    const uint32_t* pixels;\n};\n");
+    
+    for (int i = 2; i < argc; i++) {
+        // Load image data and request 4 channels, same as openImage()
+        int w, h;
+        unsigned char* data = stbi_load(argv[i], &w, &h, nullptr, 4);
+        if (data == nullptr) {
+            std::fprintf(stderr, "Error: could not load %s: %s\n", argv[i], stbi_failure_reason());
+            std::fclose(out);
+            return 1;
+        }
+        
+        std::string name = variableName(argv[i]);
+        std::fprintf(out, "\n// %s\n", argv[i]);
+        std::fprintf(out, "static const uint32_t %s_pixels[] = {", name.c_str());
+        
+        for (int p = 0; p < w * h; p++) {
+            // RGBA8888 is a packed format with red in the highest byte
+            unsigned char* rgba = &data[p * 4];
+            uint32_t pixel = ((uint32_t)rgba[0] << 24) | ((uint32_t)rgba[1] << 16) | ((uint32_t)rgba[2] << 8) | rgba[3];
+            
+            // A handful of pixels per line keeps the file readable
+            std::fprintf(out, "%s0x%08x,", p % 8 == 0 ? "\n    " : " ", pixel);
+        }
+        std::fprintf(out, "\n};\n");
+        std::fprintf(out, "static const EmbeddedIcon %s = {%d, %d, %s_pixels};\n", name.c_str(), w, h, name.c_str());
+        
+        stbi_image_free(data);
+    }
+    
+    std::fclose(out);
+    return 0;
+}